@@ -0,0 +1,88 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only) 
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Allocation of the memory arenas into which video_capture.userptr
+  * captures frames directly.
+  */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "video.h"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+static inline size_t _round_up( size_t n, size_t m ) {
+	return ( n + m - 1 ) & ~( m - 1 );
+}
+
+
+/**
+  * Huge pages are a reservation that may well be exhausted (or not
+  * configured at all) so failure to get them is only a warning; the arena
+  * is then backed by ordinary pages, with transparent huge pages requested
+  * as a consolation.
+  */
+void *video_arena_alloc( size_t size, int flags ) {
+
+	const int PREFAULT
+		= ( flags & VIDEO_ARENA_PREFAULT ) ? MAP_POPULATE : 0;
+	void *arena = MAP_FAILED;
+
+	// Rounded either way so that video_arena_free needn't know which
+	// kind of pages were actually obtained.
+
+	if( flags & VIDEO_ARENA_HUGETLB ) {
+		size = _round_up( size, HUGE_PAGE_SIZE );
+		arena = mmap( NULL, size,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | PREFAULT,
+			-1, 0 );
+		if( MAP_FAILED == arena )
+			warn( "MAP_HUGETLB arena of %zu bytes", size );
+	}
+
+	if( MAP_FAILED == arena ) {
+		arena = mmap( NULL, size,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | PREFAULT,
+			-1, 0 );
+		if( MAP_FAILED == arena ) {
+			warn( "arena of %zu bytes", size );
+			return NULL;
+		}
+		if( flags & VIDEO_ARENA_HUGETLB )
+			madvise( arena, size, MADV_HUGEPAGE );
+	}
+
+	return arena;
+}
+
+
+int video_arena_free( void *arena, size_t size, int flags ) {
+	if( flags & VIDEO_ARENA_HUGETLB )
+		size = _round_up( size, HUGE_PAGE_SIZE );
+	return munmap( arena, size );
+}
+
@@ -18,7 +18,20 @@
   * along with this program.  If not, see <http://www.gnu.org/licenses/>.
   */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vidfmt.h"
+#include "fourcc.h"
+#include "raw.h"
+#include "bayer.h"
 
 /**
   * BA81 format according to 
@@ -28,59 +41,1019 @@
   * start + 4:	G10	R11	G12	R13
   * start + 8:	B20	G21	B22	G23
   * start + 12:	G30	R31	G32	R33
+  *
+  * The other orders are the same pattern shifted by a row and/or column.
+  * Within any row the sites alternate between G and one of R or B (the
+  * row's "K" color; K' is the other). Bilinear interpolation then gives,
+  * with C the site's own sample:
+  *
+  *             K                        G             K'
+  *   G site:   horizontal average (H)   C             vertical average (V)
+  *   K site:   C                        cross (X)     diagonal (D)
+  *
+  * where X and D are the averages of the 4 orthogonal and 4 diagonal
+  * neighbors.
+  */
+
+#define FOURCC(a,b,c,d) \
+	( (uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24) )
+
+/**
+  * (R+G+B)/3, for sums up to 765, as a multiply and shift, exactly as
+  * the SIMD code computes it (pmulhuw).
+  */
+#define THIRD(s) ( ( (s) * 21846U ) >> 16 )
+
+int bayer_order( uint32_t fcc ) {
+	switch( fcc ) {
+	case FOURCC('B','A','8','1'): return BAYER_BGGR;
+	case FOURCC('G','B','R','G'): return BAYER_GBRG;
+	case FOURCC('G','R','B','G'): return BAYER_GRBG;
+	case FOURCC('R','G','G','B'): return BAYER_RGGB;
+	default:
+		return -1;
+	}
+}
+
+
+int bayer_output_size( enum bayer_output out ) {
+	return out == BAYER_OUT_RGB24 ? 3 : ( out == BAYER_OUT_BGRX ? 4 : 1 );
+}
+
+
+static inline void _emit( uint8_t R, uint8_t G, uint8_t B,
+		enum bayer_output out, uint8_t *o ) {
+	switch( out ) {
+	case BAYER_OUT_RGB24:
+		o[0] = R;
+		o[1] = G;
+		o[2] = B;
+		break;
+	case BAYER_OUT_BGRX:
+		o[0] = B;
+		o[1] = G;
+		o[2] = R;
+		o[3] = 0xFF;
+		break;
+	default:
+		o[0] = THIRD( R + G + B );
+	}
+}
+
+
+/**
+  * Row y's parameters: whether G is at even x and whether K is R.
+  */
+static inline bool _g_even( enum bayer_order order, int y ) {
+	return ( order & 1 ) ^ ( y & 1 );
+}
+
+static inline bool _k_red( enum bayer_order order, int y ) {
+	return ( ( order >> 1 ) & 1 ) ^ ( y & 1 );
+}
+
+
+/**
+  * The scalar reference: demosaics pixels [x0, x1) of the row mid (of w
+  * pixels) from its neighbors up and dn, writing from o (pixel x0).
+  * Columns -1 and w mirror to 1 and w-2.
+  */
+static void _bilinear_pixels( const uint8_t *up, const uint8_t *mid, const uint8_t *dn,
+		int w, int x0, int x1, bool g_even, bool k_red,
+		enum bayer_output out, uint8_t *o ) {
+
+	const int N = bayer_output_size( out );
+	int x;
+
+	for(x = x0; x < x1; x++, o += N ) {
+
+		const int L = x > 0 ? x - 1 : 1;
+		const int R = x < w - 1 ? x + 1 : w - 2;
+		uint8_t K, G, Kp;
+
+		if( ( ( x & 1 ) == 0 ) == g_even ) {
+			K  = ( mid[L] + mid[R] + 1 ) >> 1;
+			G  = mid[x];
+			Kp = ( up[x] + dn[x] + 1 ) >> 1;
+		} else {
+			K  = mid[x];
+			G  = ( up[x] + dn[x] + mid[L] + mid[R] + 2 ) >> 2;
+			Kp = ( up[L] + up[R] + dn[L] + dn[R] + 2 ) >> 2;
+		}
+		if( k_red )
+			_emit( K, G, Kp, out, o );
+		else
+			_emit( Kp, G, K, out, o );
+	}
+}
+
+
+#ifdef __SSE2__
+
+static inline __m128i _load( const uint8_t *p ) {
+	return _mm_loadu_si128( (const __m128i*)p );
+}
+
+/**
+  * Rounded average of 4 vectors of 16 bytes, via 16-bit sums.
+  */
+static inline __m128i _avg4( __m128i a, __m128i b, __m128i c, __m128i d ) {
+	const __m128i Z = _mm_setzero_si128();
+	const __m128i TWO = _mm_set1_epi16( 2 );
+	const __m128i LO = _mm_add_epi16(
+		_mm_add_epi16( _mm_unpacklo_epi8( a, Z ), _mm_unpacklo_epi8( b, Z ) ),
+		_mm_add_epi16( _mm_unpacklo_epi8( c, Z ), _mm_unpacklo_epi8( d, Z ) ) );
+	const __m128i HI = _mm_add_epi16(
+		_mm_add_epi16( _mm_unpackhi_epi8( a, Z ), _mm_unpackhi_epi8( b, Z ) ),
+		_mm_add_epi16( _mm_unpackhi_epi8( c, Z ), _mm_unpackhi_epi8( d, Z ) ) );
+	return _mm_packus_epi16(
+		_mm_srli_epi16( _mm_add_epi16( LO, TWO ), 2 ),
+		_mm_srli_epi16( _mm_add_epi16( HI, TWO ), 2 ) );
+}
+
+static inline __m128i _blend( __m128i mask, __m128i a, __m128i b ) {
+	return _mm_or_si128( _mm_and_si128( mask, a ), _mm_andnot_si128( mask, b ) );
+}
+
+
+/**
+  * Writes 16 pixels from their R, G and B.
+  */
+static inline void _emit16( __m128i R, __m128i G, __m128i B,
+		enum bayer_output out, uint8_t *o ) {
+
+	switch( out ) {
+	case BAYER_OUT_RGB24:
+		{
+			// Without pshufb, RGB24 is best written a quad at a time,
+			// each overwriting the previous quad's padding; the caller
+			// leaves room for the last.
+			const __m128i Z = _mm_setzero_si128();
+			const __m128i RG0 = _mm_unpacklo_epi8( R, G );
+			const __m128i RG1 = _mm_unpackhi_epi8( R, G );
+			const __m128i B0  = _mm_unpacklo_epi8( B, Z );
+			const __m128i B1  = _mm_unpackhi_epi8( B, Z );
+			uint32_t px[16];
+			int i;
+			_mm_storeu_si128( (__m128i*)( px +  0 ), _mm_unpacklo_epi16( RG0, B0 ) );
+			_mm_storeu_si128( (__m128i*)( px +  4 ), _mm_unpackhi_epi16( RG0, B0 ) );
+			_mm_storeu_si128( (__m128i*)( px +  8 ), _mm_unpacklo_epi16( RG1, B1 ) );
+			_mm_storeu_si128( (__m128i*)( px + 12 ), _mm_unpackhi_epi16( RG1, B1 ) );
+			for(i = 0; i < 16; i++ )
+				memcpy( o + 3*i, px + i, 4 );
+		}
+		break;
+	case BAYER_OUT_BGRX:
+		{
+			const __m128i X = _mm_set1_epi8( (char)0xFF );
+			const __m128i BG0 = _mm_unpacklo_epi8( B, G );
+			const __m128i BG1 = _mm_unpackhi_epi8( B, G );
+			const __m128i RX0 = _mm_unpacklo_epi8( R, X );
+			const __m128i RX1 = _mm_unpackhi_epi8( R, X );
+			_mm_storeu_si128( (__m128i*)( o +  0 ), _mm_unpacklo_epi16( BG0, RX0 ) );
+			_mm_storeu_si128( (__m128i*)( o + 16 ), _mm_unpackhi_epi16( BG0, RX0 ) );
+			_mm_storeu_si128( (__m128i*)( o + 32 ), _mm_unpacklo_epi16( BG1, RX1 ) );
+			_mm_storeu_si128( (__m128i*)( o + 48 ), _mm_unpackhi_epi16( BG1, RX1 ) );
+		}
+		break;
+	default:
+		{
+			const __m128i Z = _mm_setzero_si128();
+			const __m128i K = _mm_set1_epi16( 21846 );
+			const __m128i LO = _mm_add_epi16( _mm_unpacklo_epi8( R, Z ),
+				_mm_add_epi16( _mm_unpacklo_epi8( G, Z ), _mm_unpacklo_epi8( B, Z ) ) );
+			const __m128i HI = _mm_add_epi16( _mm_unpackhi_epi8( R, Z ),
+				_mm_add_epi16( _mm_unpackhi_epi8( G, Z ), _mm_unpackhi_epi8( B, Z ) ) );
+			_mm_storeu_si128( (__m128i*)o, _mm_packus_epi16(
+				_mm_mulhi_epu16( LO, K ), _mm_mulhi_epu16( HI, K ) ) );
+		}
+	}
+}
+
+#endif
+
+
+/**
+  * Demosaics pixels [x0, x1) of a row, 16 at a time where all the
+  * neighbors are inside the row. Bit-exact with _bilinear_pixels.
+  */
+static void _bilinear_row( const uint8_t *up, const uint8_t *mid, const uint8_t *dn,
+		int w, int x0, int x1, bool g_even, bool k_red,
+		enum bayer_output out, uint8_t *o ) {
+
+	const int N = bayer_output_size( out );
+	int x = x0;
+
+#ifdef __SSE2__
+	// Mirrored pixels need the scalar code, and the last vector must
+	// be followed by at least one pixel (see _emit16).
+
+	const int END = x1 < w - 1 ? x1 : w - 1;
+
+	if( x < 1 ) {
+		_bilinear_pixels( up, mid, dn, w, x, 1, g_even, k_red, out, o );
+		o += N*( 1 - x );
+		x = 1;
+	}
+	if( x + 16 < END || ( x + 16 == END && out != BAYER_OUT_RGB24 ) ) {
+
+		// Lanes at G sites: even lanes are even x if x is even.
+
+		const __m128i EVEN = _mm_set1_epi16( 0x00FF );
+		const __m128i GS = ( ( x & 1 ) == 0 ) == g_even
+			? EVEN : _mm_xor_si128( EVEN, _mm_set1_epi8( (char)0xFF ) );
+
+		for(; x + 16 < END || ( x + 16 == END && out != BAYER_OUT_RGB24 ); x += 16, o += 16*N ) {
+
+			const __m128i U  = _load( up  + x );
+			const __m128i D  = _load( dn  + x );
+			const __m128i ML = _load( mid + x - 1 );
+			const __m128i MC = _load( mid + x );
+			const __m128i MR = _load( mid + x + 1 );
+
+			const __m128i H  = _mm_avg_epu8( ML, MR );
+			const __m128i V  = _mm_avg_epu8( U, D );
+			const __m128i XX = _avg4( U, D, ML, MR );
+			const __m128i DD = _avg4( _load( up + x - 1 ), _load( up + x + 1 ),
+				_load( dn + x - 1 ), _load( dn + x + 1 ) );
+
+			const __m128i K  = _blend( GS, H, MC );
+			const __m128i G  = _blend( GS, MC, XX );
+			const __m128i Kp = _blend( GS, V, DD );
+
+			if( k_red )
+				_emit16( K, G, Kp, out, o );
+			else
+				_emit16( Kp, G, K, out, o );
+		}
+	}
+#endif
+	if( x < x1 )
+		_bilinear_pixels( up, mid, dn, w, x, x1, g_even, k_red, out, o );
+}
+
+
+int bayer_bilinear( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+
+	int y;
+
+	if( w < 2 || h < 2 )
+		return -1;
+
+	for(y = 0; y < h; y++ ) {
+		const uint8_t *mid = raw + y*stride;
+		_bilinear_row(
+			y > 0     ? mid - stride : mid + stride, // mirrored
+			mid,
+			y < h - 1 ? mid + stride : mid - stride,
+			w, 0, w, _g_even( order, y ), _k_red( order, y ),
+			out, o + y*ostride );
+	}
+	return 0;
+}
+
+
+/***************************************************************************
+  * Malvar-He-Cutler ("High-quality linear interpolation for demosaicing
+  * of Bayer-patterned color images", ICASSP 2004): bilinear estimates
+  * corrected by the Laplacian of the site's own color, which suppresses
+  * the zippering bilinear interpolation leaves along edges. With the
+  * notation above, N2/S2/W2/E2 the samples 2 away, and everything in
+  * 16ths (the paper's 8ths, doubled to keep the 1/2 weights integral):
+  *
+  *   G  at K:  8C + 4(N+S+W+E) - 2(N2+S2+W2+E2)
+  *   K  at G: 10C + 8(W+E) - 2(W2+E2) - 2(diagonals) + (N2+S2)
+  *   K' at G: 10C + 8(N+S) - 2(N2+S2) - 2(diagonals) + (W2+E2)
+  *   K' at K: 12C + 4(diagonals) - 3(N2+S2+W2+E2)
+  *
+  * each rounded, shifted and clamped. Borders mirror 2 pixels deep.
+  */
+
+#define MHC(v) ( (v) + 8 < 0 ? 0 : ( ( (v) + 8 ) >> 4 > 255 ? 255 : ( (v) + 8 ) >> 4 ) )
+
+/**
+  * The scalar reference: demosaics pixels [x0, x1) of row[2] given the
+  * rows 2 above to 2 below it (already mirrored vertically).
+  */
+static void _mhc_pixels( const uint8_t * const row[5], int w, int x0, int x1,
+		bool g_even, bool k_red, enum bayer_output out, uint8_t *o ) {
+
+	const uint8_t *u2 = row[0], *u1 = row[1], *m = row[2], *d1 = row[3], *d2 = row[4];
+	const int N = bayer_output_size( out );
+	int x;
+
+	for(x = x0; x < x1; x++, o += N ) {
+
+		const int L1 = x > 0 ? x - 1 : 1 - x;
+		const int L2 = x > 1 ? x - 2 : 2 - x;
+		const int R1 = x < w - 1 ? x + 1 : 2*(w-1) - (x+1);
+		const int R2 = x < w - 2 ? x + 2 : 2*(w-1) - (x+2);
+
+		const int C    = m[x];
+		const int DIAG = u1[L1] + u1[R1] + d1[L1] + d1[R1];
+		const int HZ   = m[L1] + m[R1];
+		const int VT   = u1[x] + d1[x];
+		const int HZ2  = m[L2] + m[R2];
+		const int VT2  = u2[x] + d2[x];
+		int K, G, Kp;
+
+		if( ( ( x & 1 ) == 0 ) == g_even ) {
+			K  = MHC( 10*C + 8*HZ - 2*HZ2 - 2*DIAG + VT2 );
+			G  = C;
+			Kp = MHC( 10*C + 8*VT - 2*VT2 - 2*DIAG + HZ2 );
+		} else {
+			K  = C;
+			G  = MHC( 8*C + 4*( HZ + VT ) - 2*( HZ2 + VT2 ) );
+			Kp = MHC( 12*C + 4*DIAG - 3*( HZ2 + VT2 ) );
+		}
+		if( k_red )
+			_emit( K, G, Kp, out, o );
+		else
+			_emit( Kp, G, K, out, o );
+	}
+}
+
+
+/**
+  * Working rows are copies of input rows with MHC_PAD bytes (2 of them
+  * mirrored) on either side, so the vector loop needs no border cases.
+  * Five of them, in a ring, hold the rows a band's output row needs;
+  * each input row is copied once as the band advances, and for any
+  * practical width the ring stays in L1/L2 cache.
+  */
+#define MHC_PAD (16)
+
+static void _mhc_load( uint8_t *slot, const uint8_t *in, int w,
+		const struct fourcc_raw *fmt, const uint8_t *lut ) {
+	uint8_t *p = slot + MHC_PAD;
+	if( fmt )
+		raw_row8( fmt, lut, in, w, p );
+	else
+		memcpy( p, in, w );
+	p[-1]  = p[1];
+	p[-2]  = p[2];
+	p[w]   = p[w-2];
+	p[w+1] = p[w-3];
+}
+
+
+#ifdef __SSE2__
+
+static inline __m128i _w8( const uint8_t *p ) {
+	return _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)p ), _mm_setzero_si128() );
+}
+
+static inline __m128i _mul( __m128i v, int k ) {
+	return _mm_mullo_epi16( v, _mm_set1_epi16( k ) );
+}
+
+/**
+  * 8 pixels' K, G and K' as 16-bit values; gs masks the G-site lanes.
+  */
+static inline void _mhc8( const uint8_t * const row[5], int x, __m128i gs,
+		__m128i *k, __m128i *g, __m128i *kp ) {
+
+	const __m128i C    = _w8( row[2] + x );
+	const __m128i DIAG = _mm_add_epi16(
+		_mm_add_epi16( _w8( row[1] + x - 1 ), _w8( row[1] + x + 1 ) ),
+		_mm_add_epi16( _w8( row[3] + x - 1 ), _w8( row[3] + x + 1 ) ) );
+	const __m128i HZ   = _mm_add_epi16( _w8( row[2] + x - 1 ), _w8( row[2] + x + 1 ) );
+	const __m128i VT   = _mm_add_epi16( _w8( row[1] + x ), _w8( row[3] + x ) );
+	const __m128i HZ2  = _mm_add_epi16( _w8( row[2] + x - 2 ), _w8( row[2] + x + 2 ) );
+	const __m128i VT2  = _mm_add_epi16( _w8( row[0] + x ), _w8( row[4] + x ) );
+	const __m128i C10D = _mm_sub_epi16( _mul( C, 10 ), _mm_add_epi16( DIAG, DIAG ) );
+	const __m128i EIGHT = _mm_set1_epi16( 8 );
+
+	const __m128i KH = _mm_add_epi16( _mm_sub_epi16(
+		_mm_add_epi16( C10D, _mm_slli_epi16( HZ, 3 ) ), _mm_add_epi16( HZ2, HZ2 ) ), VT2 );
+	const __m128i KV = _mm_add_epi16( _mm_sub_epi16(
+		_mm_add_epi16( C10D, _mm_slli_epi16( VT, 3 ) ), _mm_add_epi16( VT2, VT2 ) ), HZ2 );
+	const __m128i GK = _mm_sub_epi16(
+		_mm_add_epi16( _mm_slli_epi16( C, 3 ), _mm_slli_epi16( _mm_add_epi16( HZ, VT ), 2 ) ),
+		_mm_slli_epi16( _mm_add_epi16( HZ2, VT2 ), 1 ) );
+	const __m128i DK = _mm_sub_epi16(
+		_mm_add_epi16( _mul( C, 12 ), _mm_slli_epi16( DIAG, 2 ) ),
+		_mul( _mm_add_epi16( HZ2, VT2 ), 3 ) );
+
+	*k  = _blend( gs, _mm_srai_epi16( _mm_add_epi16( KH, EIGHT ), 4 ), C );
+	*g  = _blend( gs, C, _mm_srai_epi16( _mm_add_epi16( GK, EIGHT ), 4 ) );
+	*kp = _blend( gs, _mm_srai_epi16( _mm_add_epi16( KV, EIGHT ), 4 ),
+		_mm_srai_epi16( _mm_add_epi16( DK, EIGHT ), 4 ) );
+}
+
+#endif
+
+
+/**
+  * Demosaics pixels [x0, x1) of a row from working rows (see MHC_PAD),
+  * 16 at a time. Bit-exact with _mhc_pixels.
+  */
+static void _mhc_row( const uint8_t * const row[5], int w, int x0, int x1,
+		bool g_even, bool k_red, enum bayer_output out, uint8_t *o ) {
+
+	int x = x0;
+
+#ifdef __SSE2__
+	const int N = bayer_output_size( out );
+
+	// Lanes (16-bit) at G sites: even lanes are even x if x is even.
+
+	const __m128i EVEN = _mm_set1_epi32( 0x0000FFFF );
+	const __m128i GS = ( ( x & 1 ) == 0 ) == g_even
+		? EVEN : _mm_xor_si128( EVEN, _mm_set1_epi8( (char)0xFF ) );
+
+	// The last RGB24 vector must be followed by a pixel (see _emit16).
+
+	for(; x + 16 < x1 || ( x + 16 == x1 && out != BAYER_OUT_RGB24 ); x += 16, o += 16*N ) {
+		__m128i k0, g0, kp0, k1, g1, kp1, K, G, Kp;
+		_mhc8( row, x,     GS, &k0, &g0, &kp0 );
+		_mhc8( row, x + 8, GS, &k1, &g1, &kp1 );
+		K  = _mm_packus_epi16( k0,  k1 );
+		G  = _mm_packus_epi16( g0,  g1 );
+		Kp = _mm_packus_epi16( kp0, kp1 );
+		if( k_red )
+			_emit16( K, G, Kp, out, o );
+		else
+			_emit16( Kp, G, K, out, o );
+	}
+#endif
+	if( x < x1 )
+		_mhc_pixels( row, w, x, x1, g_even, k_red, out, o );
+}
+
+
+static inline int _mirror( int i, int n ) {
+	return i < 0 ? -i : ( i >= n ? 2*(n-1) - i : i );
+}
+
+
+/**
+  * Demosaics the region [x0, x1) x [y0, y1), writing pixel (x0, y0) at o.
+  * Input rows are unpacked by fmt (see raw.h) as they're loaded, if
+  * given, so that wider raw formats cost no extra pass over the frame.
+  */
+static int _malvar( const uint8_t *raw, size_t stride, int w, int h,
+		const struct fourcc_raw *fmt, const uint8_t *lut,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride, int x0, int x1, int y0, int y1 ) {
+
+	const size_t SLOT = ( w + 2*MHC_PAD + 15 ) & ~15;
+	int loaded[5] = { -1, -1, -1, -1, -1 };
+	uint8_t *ring;
+	int y;
+
+	if( w < 3 || h < 3 || y0 < 0 || y1 > h || x0 < 0 || x1 > w )
+		return -1;
+	if( (ring = malloc( 5*SLOT )) == NULL )
+		return -1;
+
+	for(y = y0; y < y1; y++ ) {
+
+		const uint8_t *row[5];
+		int i;
+
+		// Distinct rows in any 5-row window are distinct mod 5.
+
+		for(i = 0; i < 5; i++ ) {
+			const int Y = _mirror( y + i - 2, h );
+			uint8_t *slot = ring + ( Y % 5 )*SLOT;
+			if( loaded[ Y % 5 ] != Y ) {
+				_mhc_load( slot, raw + Y*stride, w, fmt, lut );
+				loaded[ Y % 5 ] = Y;
+			}
+			row[i] = slot + MHC_PAD;
+		}
+		_mhc_row( row, w, x0, x1, _g_even( order, y ), _k_red( order, y ),
+			out, o + ( y - y0 )*ostride );
+	}
+
+	free( ring );
+	return 0;
+}
+
+
+int bayer_malvar_band( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride, int y0, int y1 ) {
+	return _malvar( raw, stride, w, h, NULL, NULL, order, out,
+		o + y0*ostride, ostride, 0, w, y0, y1 );
+}
+
+
+/**
+  * Bilinear from unpacked rows: three of them, in a ring like Malvar's
+  * (rows 1 apart are distinct mod 3), each unpacked once.
+  */
+static int _bilinear_raw( const uint8_t *raw, size_t stride, int w, int h,
+		const struct fourcc_raw *fmt, const uint8_t *lut,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+
+	int loaded[3] = { -1, -1, -1 };
+	uint8_t *ring;
+	int y;
+
+	if( w < 2 || h < 2 )
+		return -1;
+	if( (ring = malloc( 3*(size_t)w )) == NULL )
+		return -1;
+
+	for(y = 0; y < h; y++ ) {
+
+		const uint8_t *row[3];
+		int i;
+
+		for(i = 0; i < 3; i++ ) {
+			const int Y = _mirror( y + i - 1, h );
+			uint8_t *slot = ring + ( Y % 3 )*w;
+			if( loaded[ Y % 3 ] != Y ) {
+				raw_row8( fmt, lut, raw + Y*stride, w, slot );
+				loaded[ Y % 3 ] = Y;
+			}
+			row[i] = slot;
+		}
+		_bilinear_row( row[0], row[1], row[2], w, 0, w,
+			_g_even( order, y ), _k_red( order, y ), out, o + y*ostride );
+	}
+
+	free( ring );
+	return 0;
+}
+
+
+int bayer_demosaic_raw( const uint8_t *raw, size_t stride, int w, int h,
+		const struct fourcc_raw *fmt, const uint8_t *lut,
+		enum bayer_method method, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+	if( fmt->order < 0 )
+		return -1;
+	if( method == BAYER_MALVAR )
+		return _malvar( raw, stride, w, h, fmt, lut, fmt->order, out,
+			o, ostride, 0, w, 0, h );
+	return _bilinear_raw( raw, stride, w, h, fmt, lut, fmt->order, out, o, ostride );
+}
+
+
+/**
+  * Binning: each scale x scale block (scale even, so it holds whole CFA
+  * quads) becomes one pixel, the mean of its R samples, of its G and of
+  * its B; at scale 2 that's just R, the mean of the two G, and B. Even
+  * and odd rows are summed separately, the first of each copied (in 16
+  * bits: 16 samples at most per phase and column), then reduced once
+  * per row of blocks.
+  *
+  * sum holds the even rows' sums, then the odd rows'; within a row
+  * parity, kq is the column parity of K, and red says whether the even
+  * rows' K is R. Inlined for each scale, so the inner loops unroll.
+  */
+static inline void _bin( const uint16_t *sum, int N, int W, int l,
+		const int kq[2], bool red, enum bayer_output out, uint8_t *o ) {
+
+	const int S = 1 << l;
+	const int BPP = bayer_output_size( out );
+	const unsigned NK = 1U << ( 2*l - 2 ); // R (or B) samples per block
+	int x;
+
+	for(x = 0; x < W; x++, o += BPP ) {
+
+		const uint16_t *e = sum + x*S, *d = sum + N + x*S;
+		unsigned K0 = 0, K1 = 0, G = 0;
+
+		for(int i = 0; i < S; i += 2 ) {
+			K0 += e[ i + kq[0] ];
+			G  += e[ i + ( kq[0] ^ 1 ) ];
+			K1 += d[ i + kq[1] ];
+			G  += d[ i + ( kq[1] ^ 1 ) ];
+		}
+		K0 = ( K0 + NK/2 ) >> ( 2*l - 2 );
+		K1 = ( K1 + NK/2 ) >> ( 2*l - 2 );
+		G  = ( G + NK ) >> ( 2*l - 1 );
+		if( red )
+			_emit( K0, G, K1, out, o );
+		else
+			_emit( K1, G, K0, out, o );
+	}
+}
+
+
+/**
+  * The input is read once; the full-resolution bilinear demosaic, if
+  * wanted, is done from each row while it's in cache.
   */
+int bayer_scaled( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, int scale, enum bayer_output out,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride ) {
+
+	const int W = w / scale, H = h / scale;
+	const int N = W*scale; // pixels of a row's complete blocks
+	const int ROWS = full ? h : H*scale;
+	const int KQ[2] = { _g_even( order, 0 ) ? 1 : 0, _g_even( order, 1 ) ? 1 : 0 };
+	const bool RED = _k_red( order, 0 );
+	uint16_t *sum;
+	int l, y;
+
+	switch( scale ) {
+	case 2: l = 1; break;
+	case 4: l = 2; break;
+	case 8: l = 3; break;
+	default:
+		return -1;
+	}
+	if( full && ( w < 2 || h < 2 ) )
+		return -1;
+	if( (sum = calloc( 2*N + 1, sizeof(uint16_t) )) == NULL )
+		return -1;
+
+	for(y = 0; y < ROWS; y++ ) {
+
+		const uint8_t *mid = raw + y*stride;
+		uint16_t *s = sum + ( y & 1 )*N;
+		uint8_t *oline = o + ( y >> l )*ostride;
+
+		if( full )
+			_bilinear_row(
+				y > 0     ? mid - stride : mid + stride,
+				mid,
+				y < h - 1 ? mid + stride : mid - stride,
+				w, 0, w, _g_even( order, y ), _k_red( order, y ),
+				out, full + y*fstride );
+		if( y >= H*scale )
+			continue;
+		if( ( y & ( scale - 1 ) ) < 2 )
+			for(int x = 0; x < N; x++ )
+				s[x] = mid[x];
+		else
+			for(int x = 0; x < N; x++ )
+				s[x] += mid[x];
+		if( ( y & ( scale - 1 ) ) != scale - 1 )
+			continue;
+
+		switch( l ) {
+		case 1: _bin( sum, N, W, 1, KQ, RED, out, oline ); break;
+		case 2: _bin( sum, N, W, 2, KQ, RED, out, oline ); break;
+		case 3: _bin( sum, N, W, 3, KQ, RED, out, oline ); break;
+		}
+	}
+
+	free( sum );
+	return 0;
+}
+
+
+/**
+  * Both methods' row kernels take a span [x0, x1) of a row and mirror
+  * only at the frame's edges, so a region comes out exactly as it would
+  * in the whole frame, color phase included.
+  */
+int bayer_roi( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_method method, enum bayer_output out,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride ) {
+
+	int i, y;
+
+	for(i = 0; i < n; i++ ) {
+		const struct video_rect *R = roi + i;
+		if( R->w <= 0 || R->h <= 0 || R->x < 0 || R->y < 0
+		 || R->x + R->w > w || R->y + R->h > h )
+			return -1;
+	}
+
+	for(i = 0; i < n; i++ ) {
+
+		const struct video_rect *R = roi + i;
+
+		if( method == BAYER_MALVAR ) {
+			if( _malvar( raw, stride, w, h, NULL, NULL, order, out, o[i], ostride[i],
+					R->x, R->x + R->w, R->y, R->y + R->h ) )
+				return -1;
+			continue;
+		}
+		if( w < 2 || h < 2 )
+			return -1;
+		for(y = R->y; y < R->y + R->h; y++ ) {
+			const uint8_t *mid = raw + y*stride;
+			_bilinear_row(
+				y > 0     ? mid - stride : mid + stride,
+				mid,
+				y < h - 1 ? mid + stride : mid - stride,
+				w, R->x, R->x + R->w, _g_even( order, y ), _k_red( order, y ),
+				out, o[i] + ( y - R->y )*ostride[i] );
+		}
+	}
+	return 0;
+}
+
+
+int bayer_demosaic( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_method method,
+		enum bayer_output out, uint8_t *o, size_t ostride ) {
+	if( method == BAYER_MALVAR )
+		return bayer_malvar_band( raw, stride, w, h, order, out, o, ostride, 0, h );
+	return bayer_bilinear( raw, stride, w, h, order, out, o, ostride );
+}
+
 
 int ba81_to_rgb( const uint8_t *buf, int w, int h, uint8_t *rgb ) {
+	return bayer_bilinear( buf, w, w, h, BAYER_BGGR, BAYER_OUT_GRAY, rgb, w );
+}
+
+
+#ifdef UNIT_TEST_BAYER
+
+#include <err.h>
+
+/**
+  * Checks that the vectorized rows match the scalar reference for random
+  * images of every order, output and width up to a few vectors, without
+  * writing past any row; and that flat color fields (mosaicked) come
+  * back exactly, borders included.
+  */
+
+#define GUARD (16)
 
-	int r,c;
-	unsigned R,G,B;
-
-	// Currently skipping the edges to avoid the nuisance boundary
-	// interpolation conditions.
-
-	buf += w; // skip top raster row
-	for(r = 1; r < h-1; r++ ) {
-		buf++; // skip first raster column
-		if( r & 1 ) {
-			//  0 1010
-			// [B]GBGB
-			// [G]rGRG <=
-			// [B]GBGB
-			for(c = 1; c < w-1; c++ ) {
-				if( c & 1 ) {
-					G = ( *(buf-w  ) + *(buf+w  ) + *(buf  -1) + *(buf  +1) ) / 4;
-					B = ( *(buf-w-1) + *(buf-w+1) + *(buf+w-1) + *(buf+w+1) ) / 4;
-					R = *buf++;
-				} else {
-					R = ( *(buf-1) + *(buf+1) ) / 2;
-					B = ( *(buf-w) + *(buf+w) ) / 2;
-					G = *buf++;
+static int _reference( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+	for(int y = 0; y < h; y++ ) {
+		const uint8_t *mid = raw + y*stride;
+		_bilinear_pixels(
+			y > 0 ? mid - stride : mid + stride, mid,
+			y < h - 1 ? mid + stride : mid - stride,
+			w, 0, w, _g_even( order, y ), _k_red( order, y ),
+			out, o + y*ostride );
+	}
+	return 0;
+}
+
+static int _mhc_reference( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+	for(int y = 0; y < h; y++ ) {
+		const uint8_t *row[5];
+		for(int i = 0; i < 5; i++ )
+			row[i] = raw + _mirror( y + i - 2, h )*stride;
+		_mhc_pixels( row, w, 0, w, _g_even( order, y ), _k_red( order, y ),
+			out, o + y*ostride );
+	}
+	return 0;
+}
+
+/**
+  * Malvar, in two bands split at row s, as a threaded caller would.
+  */
+static int _mhc_split( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+	const int s = h / 2;
+	return bayer_malvar_band( raw, stride, w, h, order, out, o, ostride, s, h )
+		|| bayer_malvar_band( raw, stride, w, h, order, out, o, ostride, 0, s );
+}
+
+typedef int (*demosaic_t)( const uint8_t *, size_t, int, int,
+	enum bayer_order, enum bayer_output, uint8_t *, size_t );
+
+static int _malvar_frame( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride ) {
+	return bayer_demosaic( raw, stride, w, h, order, BAYER_MALVAR, out, o, ostride );
+}
+
+static const struct {
+	const char *name;
+	int min;
+	demosaic_t reference, tested;
+} METHOD[] = {
+	{ "bilinear", 2, _reference,     bayer_bilinear },
+	{ "malvar",   3, _mhc_reference, _malvar_frame },
+	{ "banded",   3, _mhc_reference, _mhc_split },
+};
+
+#define METHODS ( sizeof(METHOD)/sizeof(METHOD[0]) )
+
+static const struct fourcc_raw PACKED[] = {
+	{ 10, FOURCC_PACK_MIPI10, BAYER_BGGR },
+	{ 12, FOURCC_PACK_MIPI12, BAYER_GRBG },
+	{ 12, FOURCC_PACK_16,     BAYER_RGGB },
+};
+
+
+int main( int argc, char *argv[] ) {
+
+	static const char *ORDER[]  = { "BGGR", "GBRG", "RGGB", "GRBG" };
+	static const char *OUTPUT[] = { "RGB24", "BGRX", "GRAY" };
+	int failures = 0, tested = 0;
+
+	srandom( 1 );
+
+	for(int m = 0; m < METHODS; m++ ) {
+		for(int order = 0; order < 4; order++ ) {
+			for(int out = 0; out < 3; out++ ) {
+
+				const int N = bayer_output_size( out );
+
+				for(int w = METHOD[m].min; w <= 80; w++ ) {
+					for(int h = METHOD[m].min; h <= 7; h++ ) {
+
+						const size_t STRIDE = w + ( w % 3 );
+						const size_t OSTRIDE = N*w + GUARD;
+						uint8_t *raw = malloc( STRIDE*h );
+						uint8_t *a = malloc( OSTRIDE*h );
+						uint8_t *b = malloc( OSTRIDE*h );
+
+						for(int i = 0; i < STRIDE*h; i++ )
+							raw[i] = random();
+						memset( a, 0xA5, OSTRIDE*h );
+						memset( b, 0xA5, OSTRIDE*h );
+						METHOD[m].reference( raw, STRIDE, w, h, order, out, a, OSTRIDE );
+						METHOD[m].tested( raw, STRIDE, w, h, order, out, b, OSTRIDE );
+						if( memcmp( a, b, OSTRIDE*h ) && failures++ < 8 )
+							warnx( "%s %s %s differs at %dx%d", METHOD[m].name,
+								ORDER[order], OUTPUT[out], w, h );
+						tested++;
+						free( raw );
+						free( a );
+						free( b );
+					}
 				}
-				// ready to emit R G B
-				rgb[w*r+c] = (uint8_t)( (R+G+B)/3.0 );
 			}
-		} else {
-			//  0 1010
-			// [G]RGRG
-			// [B]gBGB <=
-			// [G]RGRG
-			for(c = 1; c < w-1; c++ ) {
-				if( c & 1 ) {
-					R = ( *(buf-w) + *(buf+w) ) / 2;
-					B = ( *(buf-1) + *(buf+1) ) / 2;;
-					G = *buf++;
-				} else {
-					R = ( *(buf-w-1) + *(buf-w+1) + *(buf+w-1) + *(buf+w+1) ) / 4;
-					G = ( *(buf-w  ) + *(buf+w  ) + *(buf  -1) + *(buf  +1) ) / 4;
-					B = *buf++;
+		}
+	}
+	printf( "%d random images compared\n", tested );
+
+	for(int order = 0; order < 4; order++ ) {
+
+		static const uint8_t RGB[3] = { 200, 100, 50 };
+		const int W = 37, H = 7;
+		uint8_t raw[ W*H ], o[ 3*W*H ];
+
+		for(int y = 0; y < H; y++ ) {
+			for(int x = 0; x < W; x++ ) {
+				const bool G = ( ( x & 1 ) == 0 ) == _g_even( order, y );
+				const bool RED = _k_red( order, y );
+				raw[ y*W + x ] = G ? RGB[1] : ( RED ? RGB[0] : RGB[2] );
+			}
+		}
+		for(int m = 0; m < 2; m++ ) {
+			bayer_demosaic( raw, W, W, H, order, m ? BAYER_MALVAR : BAYER_BILINEAR,
+				BAYER_OUT_RGB24, o, 3*W );
+			for(int i = 0; i < W*H; i++ ) {
+				if( memcmp( o + 3*i, RGB, 3 ) ) {
+					warnx( "%s %s flat field wrong at (%d,%d)", METHOD[m].name,
+						ORDER[order], i % W, i / W );
+					failures++;
+					break;
 				}
-				// ready to emit R G B
-				rgb[w*r+c] = (uint8_t)( (R+G+B)/3.0 );
 			}
 		}
-		buf++; // skip last raster column
 	}
-	// ignore last buf raster row
-	return 0;
+
+	// Binning against block means computed sample by sample, and its
+	// full-resolution output against bilinear's.
+
+	tested = 0;
+	for(int scale = 2; scale <= 8; scale *= 2 ) {
+		for(int order = 0; order < 4; order++ ) {
+			for(int out = 0; out < 3; out++ ) {
+				for(int w = 2; w <= 3*scale + 18; w++ ) {
+					for(int h = 2; h <= 2*scale + 1; h++ ) {
+
+						const int N = bayer_output_size( out );
+						const int W = w / scale, H = h / scale;
+						const size_t STRIDE = w + ( w % 3 );
+						uint8_t *raw = malloc( STRIDE*h );
+						uint8_t *a = malloc( N*W*H + 1 ), *b = malloc( N*W*H + 1 );
+						uint8_t *fa = malloc( N*w*h ), *fb = malloc( N*w*h );
+
+						for(int i = 0; i < STRIDE*h; i++ )
+							raw[i] = random();
+						for(int y = 0; y < H; y++ ) {
+							for(int x = 0; x < W; x++ ) {
+								unsigned sum[3] = { 0, 0, 0 };
+								const unsigned NK = scale*scale/4;
+								for(int j = y*scale; j < ( y + 1 )*scale; j++ ) {
+									for(int i = x*scale; i < ( x + 1 )*scale; i++ ) {
+										const bool G = ( ( i & 1 ) == 0 ) == _g_even( order, j );
+										sum[ G ? 1 : ( _k_red( order, j ) ? 0 : 2 ) ]
+											+= raw[ j*STRIDE + i ];
+									}
+								}
+								_emit( ( sum[0] + NK/2 ) / NK, ( sum[1] + NK ) / ( 2*NK ),
+									( sum[2] + NK/2 ) / NK, out, a + N*( y*W + x ) );
+							}
+						}
+						bayer_bilinear( raw, STRIDE, w, h, order, out, fa, N*w );
+						bayer_scaled( raw, STRIDE, w, h, order, scale, out, b, N*W, fb, N*w );
+						if( ( memcmp( a, b, N*W*H ) || memcmp( fa, fb, N*w*h ) )
+						 && failures++ < 8 )
+							warnx( "1/%d %s %s binning differs at %dx%d",
+								scale, ORDER[order], OUTPUT[out], w, h );
+						tested++;
+						free( raw );
+						free( a );
+						free( b );
+						free( fa );
+						free( fb );
+					}
+				}
+			}
+		}
+	}
+	printf( "%d binned images compared\n", tested );
+
+	// Regions must be crops of the whole frame.
+
+	tested = 0;
+	for(int m = 0; m < 2; m++ ) {
+		for(int order = 0; order < 4; order++ ) {
+			for(int out = 0; out < 3; out++ ) {
+				for(int w = 3; w <= 60; w++ ) {
+
+					const int N = bayer_output_size( out ), H = 7;
+					uint8_t *raw = malloc( w*H ), *whole = malloc( N*w*H );
+					struct video_rect R[2];
+					uint8_t *o[2];
+					size_t ostride[2];
+
+					for(int i = 0; i < w*H; i++ )
+						raw[i] = random();
+					bayer_demosaic( raw, w, w, H, order, m, out, whole, N*w );
+					for(int k = 0; k < 2; k++ ) {
+						R[k].x = random() % w;
+						R[k].w = 1 + random() % ( w - R[k].x );
+						R[k].y = random() % H;
+						R[k].h = 1 + random() % ( H - R[k].y );
+						ostride[k] = N*R[k].w + k;
+						o[k] = malloc( ostride[k]*R[k].h );
+					}
+					bayer_roi( raw, w, w, H, order, m, out, R, 2, o, ostride );
+					for(int k = 0; k < 2; k++ ) {
+						bool bad = false;
+						for(int y = 0; y < R[k].h; y++ )
+							bad |= memcmp( o[k] + y*ostride[k],
+								whole + N*( ( R[k].y + y )*w + R[k].x ), N*R[k].w ) != 0;
+						if( bad && failures++ < 8 )
+							warnx( "%s %s %s region %dx%d+%d+%d of width %d differs",
+								METHOD[m].name, ORDER[order], OUTPUT[out],
+								R[k].w, R[k].h, R[k].x, R[k].y, w );
+						free( o[k] );
+					}
+					tested++;
+					free( raw );
+					free( whole );
+				}
+			}
+		}
+	}
+	printf( "%d regions compared\n", 2*tested );
+
+	// Demosaicing packed raw must be unpacking, then demosaicing.
+
+	tested = 0;
+	for(int f = 0; f < sizeof(PACKED)/sizeof(PACKED[0]); f++ ) {
+		for(int m = 0; m < 2; m++ ) {
+			for(int l = 0; l < 2; l++ ) {
+
+				const struct fourcc_raw *FMT = PACKED + f;
+				static uint8_t lut[ 1 << 12 ];
+
+				for(int i = 0; i < sizeof(lut); i++ )
+					lut[i] = random();
+
+				for(int w = 4; w <= 80; w += 4 ) {
+					for(int h = 3; h <= 6; h++ ) {
+
+						const size_t STRIDE = raw_row_bytes( FMT, w ) + ( w % 3 );
+						uint8_t *raw = malloc( STRIDE*h );
+						uint8_t *u = malloc( w*h );
+						uint8_t *a = malloc( 3*w*h );
+						uint8_t *b = malloc( 3*w*h );
+
+						for(int i = 0; i < STRIDE*h; i++ )
+							raw[i] = random();
+						raw_unpack8( FMT, l ? lut : NULL, raw, STRIDE, w, h, u, w );
+						bayer_demosaic( u, w, w, h, FMT->order, m,
+							BAYER_OUT_RGB24, a, 3*w );
+						bayer_demosaic_raw( raw, STRIDE, w, h, FMT, l ? lut : NULL, m,
+							BAYER_OUT_RGB24, b, 3*w );
+						if( memcmp( a, b, 3*w*h ) && failures++ < 8 )
+							warnx( "%s packed %d-bit%s differs at %dx%d",
+								METHOD[m].name, FMT->bits, l ? " (lut)" : "", w, h );
+						tested++;
+						free( raw );
+						free( u );
+						free( a );
+						free( b );
+					}
+				}
+			}
+		}
+	}
+	printf( "%d packed images compared\n", tested );
+
+	printf( "%s\n", failures ? "FAILED" : "passed" );
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+#endif
@@ -0,0 +1,133 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+
+#ifndef _bayer_h_
+#define _bayer_h_
+
+/**
+  * The 2x2 color filter arrays of 8-bit raw sensors, named for their
+  * first two rows. The values encode the pattern: bit 0 is set if G is
+  * at (0,0), bit 1 if row 0 holds R (rather than B).
+  */
+enum bayer_order {
+	BAYER_BGGR = 0, // BA81
+	BAYER_GBRG = 1,
+	BAYER_RGGB = 2,
+	BAYER_GRBG = 3,
+};
+
+enum bayer_output {
+	BAYER_OUT_RGB24, // R,G,B bytes
+	BAYER_OUT_BGRX,  // B,G,R,0xFF: 32-bit little-endian XRGB, as X11 wants
+	BAYER_OUT_GRAY,  // the unweighted mean of R, G and B
+};
+
+/**
+  * Returns the order of an 8-bit Bayer FOURCC (BA81, GBRG, GRBG or
+  * RGGB), or -1 for anything else.
+  */
+int bayer_order( uint32_t fcc );
+
+/**
+  * Bytes per output pixel.
+  */
+int bayer_output_size( enum bayer_output out );
+
+/**
+  * Bilinear demosaic of a w x h raw image whose rows are stride bytes
+  * apart into rows ostride bytes apart. Every pixel, borders included,
+  * is interpolated; the image is mirrored about its edges (which keeps
+  * the color pattern intact). Averages are rounded integers. Requires
+  * w, h >= 2.
+  */
+int bayer_bilinear( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride );
+
+/**
+  * The Malvar-He-Cutler 5x5 gradient-corrected demosaic of rows
+  * [y0, y1), which avoids bilinear's zippering along edges at about
+  * twice the cost. Output row y is written at o + y*ostride. The band
+  * streams through its rows once, so disjoint bands of one frame may be
+  * converted concurrently (e.g. by a thread each). Requires w, h >= 3.
+  */
+int bayer_malvar_band( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_output out,
+		uint8_t *o, size_t ostride, int y0, int y1 );
+
+enum bayer_method {
+	BAYER_BILINEAR,
+	BAYER_MALVAR,
+};
+
+/**
+  * The whole frame by the chosen method, so that each stream can pay
+  * for quality only where it's wanted.
+  */
+int bayer_demosaic( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_method method,
+		enum bayer_output out, uint8_t *o, size_t ostride );
+
+/**
+  * Demosaicing and downscaling in one pass, for previews: each
+  * scale x scale block (scale 2, 4 or 8) becomes one pixel of the means
+  * of its R, G and B samples, 2x2 binning at scale 2. The output is
+  * (w/scale) x (h/scale), partial blocks at the right and bottom being
+  * dropped. If full isn't NULL, the full-resolution bilinear demosaic
+  * (in the same output format) is written there too, from the same read
+  * of the input. Returns -1 for other scales or if out of memory.
+  */
+int bayer_scaled( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, int scale, enum bayer_output out,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride );
+
+struct video_rect;
+
+/**
+  * Demosaics only the n regions roi (see vidfmt.h), region i into o[i]
+  * with rows ostride[i] bytes apart. Each comes out exactly as the same
+  * pixels of the whole frame would. Returns -1 if a region isn't within
+  * the w x h frame.
+  */
+int bayer_roi( const uint8_t *raw, size_t stride, int w, int h,
+		enum bayer_order order, enum bayer_method method, enum bayer_output out,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+
+struct fourcc_raw;
+
+/**
+  * The same, from a raw Bayer format of more than 8 bits (e.g. pBAA,
+  * MIPI-packed 10-bit BGGR, as described by fourcc_raw). Samples are
+  * reduced to 8 bits as raw_row8 does, by shift or by lut, row by row as
+  * the demosaic reaches them, so there's no separate unpacking pass.
+  * Returns -1 if fmt isn't Bayer.
+  */
+int bayer_demosaic_raw( const uint8_t *raw, size_t stride, int w, int h,
+		const struct fourcc_raw *fmt, const uint8_t *lut,
+		enum bayer_method method, enum bayer_output out,
+		uint8_t *o, size_t ostride );
+
+/**
+  * BA81 (BGGR) to gray, one byte per pixel; kept for compatibility.
+  */
+int ba81_to_rgb( const uint8_t *buf, int w, int h, uint8_t *rgb );
+
+#endif
+
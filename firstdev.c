@@ -19,13 +19,36 @@
   */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
 
 const static char *VIDEO_DEVICE_PATH_TEMPLATE = "/dev/video%d";
 const int MAX_VIDEO_DEVICE_COUNT = 8;
 
+static const char *SYSFS_V4L = "/sys/class/video4linux";
+
+/**
+  * How long video_discover waits for all its queries; nodes that haven't
+  * answered by then are left out.
+  */
+#define DISCOVER_TIMEOUT_MS (500)
+
 /**
   * "A return value of maxlen or more indicates truncation.
   */
@@ -34,7 +57,244 @@ int video_path( int i, char *buf, int maxlen ) {
 }
 
 
+struct survey;
+
+/**
+  * A discovery candidate, queried by its own thread.
+  */
+struct candidate {
+	unsigned minor;          // N of videoN, for ordering
+	pthread_t thread;
+	bool      threaded;
+	bool      capture;
+	struct video_device dev;
+	struct survey *survey;
+};
+
+/**
+  * All the candidates of one video_discover call. A query thread that
+  * outlives the call (see DISCOVER_TIMEOUT_MS) still owns its candidate,
+  * so the survey is freed by whichever of the call and its threads
+  * finishes last.
+  */
+struct survey {
+	int refs; // atomic
+	struct candidate c[];
+};
+
+
+static void _release( struct survey *s ) {
+	if( __atomic_sub_fetch( &s->refs, 1, __ATOMIC_ACQ_REL ) == 0 )
+		free( s );
+}
+
+
+/**
+  * Reads a one-line sysfs attribute of node into buf (without the
+  * newline). Returns 0 on success.
+  */
+static int _attribute( const char *node, const char *name, char *buf, int maxlen ) {
+
+	char path[ 128 ];
+	FILE *fp;
+	int econd = -1;
+
+	snprintf( path, sizeof(path), "%s/%.32s/%.32s", SYSFS_V4L, node, name );
+	if( (fp = fopen( path, "r" )) == NULL )
+		return -1;
+	if( fgets( buf, maxlen, fp ) ) {
+		buf[ strcspn( buf, "\n" ) ] = '\0';
+		econd = 0;
+	}
+	fclose( fp );
+	return econd;
+}
+
+
+/**
+  * Whether sysfs alone shows that node can't capture, sparing it the
+  * open: every uvcvideo interface has its capture node at index 0 and
+  * its metadata node at index 1.
+  */
+static bool _excluded( const char *node, unsigned index ) {
+
+	char path[ 128 ], link[ 256 ];
+	const char *driver;
+	ssize_t n;
+
+	snprintf( path, sizeof(path), "%s/%.32s/device/driver", SYSFS_V4L, node );
+	if( (n = readlink( path, link, sizeof(link) - 1 )) < 0 )
+		return false;
+	link[n] = '\0';
+	driver = strrchr( link, '/' );
+	driver = driver ? driver + 1 : link;
+	return strcmp( driver, "uvcvideo" ) == 0 && index != 0;
+}
+
+
+static void *_query( void *arg ) {
+
+	struct candidate *c = arg;
+	struct v4l2_capability cap;
+	uint32_t caps;
+	int fd;
+
+	// Non-blocking so that the open itself can't stall on a busy node.
+
+	if( (fd = open( c->dev.path, O_RDWR | O_NONBLOCK | O_CLOEXEC )) < 0 )
+		return NULL;
+
+	memset( &cap, 0, sizeof(cap) );
+	if( ioctl( fd, VIDIOC_QUERYCAP, &cap ) == 0 ) {
+		caps = ( cap.capabilities & V4L2_CAP_DEVICE_CAPS )
+			? cap.device_caps : cap.capabilities;
+		c->capture
+			=  ( caps & ( V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE ) )
+			&& ( caps & V4L2_CAP_STREAMING );
+		c->dev.caps = caps;
+		snprintf( c->dev.card,     sizeof(c->dev.card),     "%s", (const char*)cap.card );
+		snprintf( c->dev.driver,   sizeof(c->dev.driver),   "%s", (const char*)cap.driver );
+		snprintf( c->dev.bus_info, sizeof(c->dev.bus_info), "%s", (const char*)cap.bus_info );
+		snprintf( c->dev.id, sizeof(c->dev.id), "%s-%s-index%u",
+			c->dev.driver, c->dev.bus_info, c->dev.index );
+	}
+	close( fd );
+	return NULL;
+}
+
+
+static void *_query_thread( void *arg ) {
+	struct candidate *c = arg;
+	_query( c );
+	_release( c->survey );
+	return NULL;
+}
+
+
+static int _by_minor( const void *pvl, const void *pvr ) {
+	const struct candidate *l = *(const struct candidate * const *)pvl;
+	const struct candidate *r = *(const struct candidate * const *)pvr;
+	return ( l->minor > r->minor ) - ( l->minor < r->minor );
+}
+
+
+int video_discover( struct video_device *dev, int max ) {
+
+	struct survey *s = NULL;
+	struct candidate **done;
+	struct timespec deadline;
+	struct dirent *e;
+	int i, n = 0, size = 0, answered = 0, found = 0;
+	DIR *dir;
+
+	if( (dir = opendir( SYSFS_V4L )) == NULL )
+		return -1;
+
+	while( (e = readdir( dir )) ) {
+
+		struct candidate *k;
+		struct stat info;
+		char index[ 16 ];
+		unsigned minor;
+
+		// Only videoN nodes capture; skip v4l-subdev*, vbi*, radio*...
+
+		if( sscanf( e->d_name, "video%u", &minor ) != 1 )
+			continue;
+		if( n == size ) {
+			void *p = realloc( s, sizeof(*s)
+				+ ( size = size ? 2*size : 16 )*sizeof(s->c[0]) );
+			if( p == NULL ) {
+				warn( "allocating discovery state" );
+				break;
+			}
+			s = p;
+		}
+		k = s->c + n;
+		memset( k, 0, sizeof(*k) );
+		k->minor = minor;
+		snprintf( k->dev.path, sizeof(k->dev.path), "/dev/%.32s", e->d_name );
+		if( _attribute( e->d_name, "index", index, sizeof(index) ) == 0 )
+			k->dev.index = strtoul( index, NULL, 10 );
+		if( _excluded( e->d_name, k->dev.index ) )
+			continue;
+		if( stat( k->dev.path, &info ) == 0 && S_ISCHR( info.st_mode ) )
+			n++;
+	}
+	closedir( dir );
+
+	if( n == 0 ) {
+		free( s );
+		return 0;
+	}
+	if( (done = calloc( n, sizeof(*done) )) == NULL ) {
+		warn( "allocating discovery state" );
+		free( s );
+		return 0;
+	}
+
+	// Query every candidate at once; if a thread can't be had, just
+	// query that one inline. Each thread holds a reference to s.
+
+	s->refs = 1;
+	for(i = 0; i < n; i++ ) {
+		s->c[i].survey = s;
+		__atomic_add_fetch( &s->refs, 1, __ATOMIC_RELAXED );
+		s->c[i].threaded
+			= pthread_create( &s->c[i].thread, NULL, _query_thread, s->c + i ) == 0;
+		if( ! s->c[i].threaded ) {
+			__atomic_sub_fetch( &s->refs, 1, __ATOMIC_RELAXED );
+			_query( s->c + i );
+		}
+	}
+
+	// ...but wait for them only so long; stragglers are abandoned to
+	// finish (and release s) on their own.
+
+	clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec  += DISCOVER_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += ( DISCOVER_TIMEOUT_MS % 1000 )*1000000L;
+	if( deadline.tv_nsec >= 1000000000L ) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	for(i = 0; i < n; i++ ) {
+		if( s->c[i].threaded
+				&& pthread_timedjoin_np( s->c[i].thread, NULL, &deadline ) ) {
+			warnx( "%s didn't answer in %dms, skipped",
+				s->c[i].dev.path, DISCOVER_TIMEOUT_MS );
+			pthread_detach( s->c[i].thread );
+			continue;
+		}
+		done[ answered++ ] = s->c + i;
+	}
+
+	qsort( done, answered, sizeof(*done), _by_minor );
+	for(i = 0; i < answered; i++ ) {
+		if( done[i]->capture && found < max )
+			dev[ found++ ] = done[i]->dev;
+	}
+	free( done );
+	_release( s );
+	return found;
+}
+
+
 int first_video_dev( char *path, int maxlen ) {
+
+	struct video_device dev;
+	const int N = video_discover( &dev, 1 );
+
+	if( N >= 0 ) {
+		if( N == 0 || snprintf( path, maxlen, "%s", dev.path ) >= maxlen ) {
+			path[0] = '\0';
+			return -1;
+		}
+		return 0;
+	}
+
+	// No sysfs (e.g. in some containers): the first character device.
+
 	for(int i = 0; i < MAX_VIDEO_DEVICE_COUNT; i++ ) {
 		struct stat info;
 		snprintf( path, maxlen, VIDEO_DEVICE_PATH_TEMPLATE, i );
@@ -42,3 +42,78 @@ uint32_t fourcc_integer( const char *s ) {
 	return val;
 }
 
+#define FOURCC(a,b,c,d) \
+	( (uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24) )
+
+int fourcc_planes( uint32_t fcc, unsigned height, unsigned *rows ) {
+
+	rows[0] = height;
+
+	switch( fcc ) {
+	case FOURCC('N','V','1','2'): // 4:2:0, Y plane then interleaved CbCr
+	case FOURCC('N','V','2','1'):
+	case FOURCC('N','M','1','2'): // ...in separate buffers
+	case FOURCC('N','M','2','1'):
+		rows[1] = ( height + 1 ) / 2;
+		return 2;
+	case FOURCC('N','V','1','6'): // 4:2:2
+	case FOURCC('N','V','6','1'):
+	case FOURCC('N','M','1','6'):
+	case FOURCC('N','M','6','1'):
+		rows[1] = height;
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+
+/**
+  * Orders as in enum bayer_order: BGGR, GBRG, RGGB, GRBG.
+  */
+static const struct {
+	uint32_t fcc;
+	struct fourcc_raw raw;
+} _raw[] = {
+	{ FOURCC('G','R','E','Y'), {  8, FOURCC_PACK_8,      -1 } },
+	{ FOURCC('B','A','8','1'), {  8, FOURCC_PACK_8,       0 } },
+	{ FOURCC('G','B','R','G'), {  8, FOURCC_PACK_8,       1 } },
+	{ FOURCC('R','G','G','B'), {  8, FOURCC_PACK_8,       2 } },
+	{ FOURCC('G','R','B','G'), {  8, FOURCC_PACK_8,       3 } },
+	{ FOURCC('Y','1','0',' '), { 10, FOURCC_PACK_16,     -1 } },
+	{ FOURCC('B','G','1','0'), { 10, FOURCC_PACK_16,      0 } },
+	{ FOURCC('G','B','1','0'), { 10, FOURCC_PACK_16,      1 } },
+	{ FOURCC('R','G','1','0'), { 10, FOURCC_PACK_16,      2 } },
+	{ FOURCC('B','A','1','0'), { 10, FOURCC_PACK_16,      3 } },
+	{ FOURCC('Y','1','2',' '), { 12, FOURCC_PACK_16,     -1 } },
+	{ FOURCC('B','G','1','2'), { 12, FOURCC_PACK_16,      0 } },
+	{ FOURCC('G','B','1','2'), { 12, FOURCC_PACK_16,      1 } },
+	{ FOURCC('R','G','1','2'), { 12, FOURCC_PACK_16,      2 } },
+	{ FOURCC('B','A','1','2'), { 12, FOURCC_PACK_16,      3 } },
+	{ FOURCC('Y','1','6',' '), { 16, FOURCC_PACK_16,     -1 } },
+	{ FOURCC('B','Y','R','2'), { 16, FOURCC_PACK_16,      0 } },
+	{ FOURCC('G','B','1','6'), { 16, FOURCC_PACK_16,      1 } },
+	{ FOURCC('R','G','1','6'), { 16, FOURCC_PACK_16,      2 } },
+	{ FOURCC('G','R','1','6'), { 16, FOURCC_PACK_16,      3 } },
+	{ FOURCC('Y','1','0','P'), { 10, FOURCC_PACK_MIPI10, -1 } },
+	{ FOURCC('p','B','A','A'), { 10, FOURCC_PACK_MIPI10,  0 } },
+	{ FOURCC('p','G','A','A'), { 10, FOURCC_PACK_MIPI10,  1 } },
+	{ FOURCC('p','R','A','A'), { 10, FOURCC_PACK_MIPI10,  2 } },
+	{ FOURCC('p','g','A','A'), { 10, FOURCC_PACK_MIPI10,  3 } },
+	{ FOURCC('Y','1','2','P'), { 12, FOURCC_PACK_MIPI12, -1 } },
+	{ FOURCC('p','B','C','C'), { 12, FOURCC_PACK_MIPI12,  0 } },
+	{ FOURCC('p','G','C','C'), { 12, FOURCC_PACK_MIPI12,  1 } },
+	{ FOURCC('p','R','C','C'), { 12, FOURCC_PACK_MIPI12,  2 } },
+	{ FOURCC('p','g','C','C'), { 12, FOURCC_PACK_MIPI12,  3 } },
+};
+
+int fourcc_raw( uint32_t fcc, struct fourcc_raw *raw ) {
+	for(int i = 0; i < sizeof(_raw)/sizeof(_raw[0]); i++ ) {
+		if( _raw[i].fcc == fcc ) {
+			*raw = _raw[i].raw;
+			return 0;
+		}
+	}
+	return -1;
+}
+
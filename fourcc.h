@@ -24,4 +24,33 @@
 const char *fourcc_string( uint32_t fcc );
 uint32_t fourcc_integer( const char *s );
 
+/**
+  * Returns the number of image planes of a frame in the given format and
+  * the rows of each for a frame of the given height. Every plane of the
+  * supported planar formats has the same stride as the first.
+  */
+int fourcc_planes( uint32_t fcc, unsigned height, unsigned *rows );
+
+/**
+  * How the samples of a raw (sensor) format are stored.
+  */
+enum fourcc_packing {
+	FOURCC_PACK_8,      // a byte per sample
+	FOURCC_PACK_16,     // a little-endian word per sample, low-aligned (Y10, BG12...)
+	FOURCC_PACK_MIPI10, // CSI-2: 4 samples' high bytes, then their low 2 bits (pBAA, Y10P...)
+	FOURCC_PACK_MIPI12, // CSI-2: 2 samples' high bytes, then their low 4 bits (pBCC, Y12P...)
+};
+
+struct fourcc_raw {
+	int bits;                    // significant bits per sample
+	enum fourcc_packing packing;
+	int order;                   // enum bayer_order, or -1 if monochrome
+};
+
+/**
+  * Describes a raw Bayer or monochrome format of 8 to 16 bits in raw;
+  * returns -1 if fcc is none of them.
+  */
+int fourcc_raw( uint32_t fcc, struct fourcc_raw *raw );
+
 #endif
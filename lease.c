@@ -0,0 +1,74 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only) 
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Reference counting of frame leases. This is independent of the
+  * video_capture implementation that issued the lease; the buffer is
+  * simply handed back through its enqueue1.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <err.h>
+
+#include "video.h"
+#include "vidfrm.h"
+
+struct video_lease *video_lease_issue( struct video_lease *lease, int count,
+		struct video_capture *vci, const struct video_frame *fr ) {
+
+	struct video_lease *l;
+
+	if( fr->buffer_id < 0 || fr->buffer_id >= count )
+		return NULL;
+
+	l = lease + fr->buffer_id;
+	if( __atomic_load_n( &l->refs, __ATOMIC_ACQUIRE ) != 0 ) {
+		warnx( "buffer %d is already leased", fr->buffer_id );
+		return NULL;
+	}
+
+	l->vci       = vci;
+	l->buffer_id = fr->buffer_id;
+	l->mem       = fr->mem;
+	l->bytesused = fr->bytesused;
+	l->planes    = fr->planes;
+	memcpy( l->plane, fr->plane, sizeof(l->plane) );
+	__atomic_store_n( &l->refs, 1, __ATOMIC_RELEASE );
+	return l;
+}
+
+
+struct video_lease *video_lease_retain( struct video_lease *l ) {
+	assert( __atomic_load_n( &l->refs, __ATOMIC_RELAXED ) > 0 );
+	__atomic_add_fetch( &l->refs, 1, __ATOMIC_RELAXED );
+	return l;
+}
+
+
+void video_lease_release( struct video_lease *l ) {
+	// Acquire/release so that every holder's reads of the frame happen
+	// before the buffer goes back to the driver.
+	if( __atomic_sub_fetch( &l->refs, 1, __ATOMIC_ACQ_REL ) == 0 )
+		l->vci->enqueue1( l->vci, l->buffer_id );
+}
+
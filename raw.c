@@ -0,0 +1,459 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * MIPI CSI-2 packing, per
+  * https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/pixfmt-srggb10p.html
+  * and ...-srggb12p.html. Each cell is one byte:
+  *
+  *   10-bit:  S0[9:2]  S1[9:2]  S2[9:2]  S3[9:2]  S3[1:0]S2[1:0]S1[1:0]S0[1:0]
+  *   12-bit:  S0[11:4] S1[11:4] S1[3:0]S0[3:0]
+  *
+  * So the 8-bit reduction of either is a matter of skipping every 5th
+  * (3rd) byte, and on x86 both directions are a pshufb or two.
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fourcc.h"
+#include "raw.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+  * Row kernels, indexed by enum fourcc_packing. The 8-bit ones reduce
+  * 16-bit words by shift (bits - 8); the MIPI ones need no shift, their
+  * high bytes being the answer.
+  */
+typedef void (*row16_t)( const uint8_t *in, int w, uint16_t *o );
+typedef void (*row8_t)( const uint8_t *in, int w, int shift, uint8_t *o );
+
+struct kernels {
+	row16_t row16[4];
+	row8_t  row8[4];
+};
+
+/**
+  * Scalar references, from sample x on (a multiple of the group).
+  */
+static void _mipi10_16_pixels( const uint8_t *in, int x, int w, uint16_t *o ) {
+	for(; x < w; x++ ) {
+		const uint8_t *g = in + 5*( x >> 2 );
+		o[x] = g[ x & 3 ] << 2 | ( ( g[4] >> 2*( x & 3 ) ) & 3 );
+	}
+}
+
+static void _mipi12_16_pixels( const uint8_t *in, int x, int w, uint16_t *o ) {
+	for(; x < w; x++ ) {
+		const uint8_t *g = in + 3*( x >> 1 );
+		o[x] = g[ x & 1 ] << 4 | ( ( g[2] >> 4*( x & 1 ) ) & 15 );
+	}
+}
+
+static void _le16_16_pixels( const uint8_t *in, int x, int w, uint16_t *o ) {
+	for(; x < w; x++ )
+		o[x] = in[2*x] | in[2*x+1] << 8;
+}
+
+static void _mipi10_8_pixels( const uint8_t *in, int x, int w, uint8_t *o ) {
+	for(; x < w; x++ )
+		o[x] = in[ 5*( x >> 2 ) + ( x & 3 ) ];
+}
+
+static void _mipi12_8_pixels( const uint8_t *in, int x, int w, uint8_t *o ) {
+	for(; x < w; x++ )
+		o[x] = in[ 3*( x >> 1 ) + ( x & 1 ) ];
+}
+
+/**
+  * Saturates, should the unused high bits not be 0.
+  */
+static void _le16_8_pixels( const uint8_t *in, int x, int w, int shift, uint8_t *o ) {
+	for(; x < w; x++ ) {
+		const unsigned V = ( in[2*x] | in[2*x+1] << 8 ) >> shift;
+		o[x] = V > 255 ? 255 : V;
+	}
+}
+
+
+static void _8_16_scalar( const uint8_t *in, int w, uint16_t *o ) {
+	for(int x = 0; x < w; x++ )
+		o[x] = in[x];
+}
+
+static void _16_16_scalar( const uint8_t *in, int w, uint16_t *o ) {
+	_le16_16_pixels( in, 0, w, o );
+}
+
+static void _mipi10_16_scalar( const uint8_t *in, int w, uint16_t *o ) {
+	_mipi10_16_pixels( in, 0, w, o );
+}
+
+static void _mipi12_16_scalar( const uint8_t *in, int w, uint16_t *o ) {
+	_mipi12_16_pixels( in, 0, w, o );
+}
+
+static void _8_8_scalar( const uint8_t *in, int w, int shift, uint8_t *o ) {
+	memcpy( o, in, w );
+}
+
+static void _16_8_scalar( const uint8_t *in, int w, int shift, uint8_t *o ) {
+	_le16_8_pixels( in, 0, w, shift, o );
+}
+
+static void _mipi10_8_scalar( const uint8_t *in, int w, int shift, uint8_t *o ) {
+	_mipi10_8_pixels( in, 0, w, o );
+}
+
+static void _mipi12_8_scalar( const uint8_t *in, int w, int shift, uint8_t *o ) {
+	_mipi12_8_pixels( in, 0, w, o );
+}
+
+static const struct kernels _scalar = {
+	{ _8_16_scalar, _16_16_scalar, _mipi10_16_scalar, _mipi12_16_scalar },
+	{ _8_8_scalar,  _16_8_scalar,  _mipi10_8_scalar,  _mipi12_8_scalar },
+};
+
+
+#ifdef HAVE_X86_SIMD
+
+/**
+  * Each vector loop runs only while its (16-byte) loads stay within the
+  * row; the scalar code finishes the rest.
+  *
+  * To 16 bits, pshufb spreads 8 samples' high bytes, and copies of the
+  * byte(s) holding their low bits, into words. Multiplying the copies
+  * lines each sample's low bits up at the same position, so a single
+  * shift and mask extract them all.
+  */
+
+__attribute__((target("ssse3")))
+static void _mipi10_16_ssse3( const uint8_t *in, int w, uint16_t *o ) {
+
+	const __m128i HI = _mm_setr_epi8( 0,-1, 1,-1, 2,-1, 3,-1, 5,-1, 6,-1, 7,-1, 8,-1 );
+	const __m128i LO = _mm_setr_epi8( 4,-1, 4,-1, 4,-1, 4,-1, 9,-1, 9,-1, 9,-1, 9,-1 );
+	const __m128i ALIGN = _mm_setr_epi16( 64, 16, 4, 1, 64, 16, 4, 1 );
+	const __m128i MASK  = _mm_set1_epi16( 3 );
+	int x;
+
+	for(x = 0; x + 16 <= w; x += 8 ) {
+		const __m128i A = _mm_loadu_si128( (const __m128i*)( in + 5*x/4 ) );
+		const __m128i H = _mm_slli_epi16( _mm_shuffle_epi8( A, HI ), 2 );
+		const __m128i L = _mm_and_si128( _mm_srli_epi16(
+			_mm_mullo_epi16( _mm_shuffle_epi8( A, LO ), ALIGN ), 6 ), MASK );
+		_mm_storeu_si128( (__m128i*)( o + x ), _mm_or_si128( H, L ) );
+	}
+	_mipi10_16_pixels( in, x, w, o );
+}
+
+
+__attribute__((target("ssse3")))
+static void _mipi12_16_ssse3( const uint8_t *in, int w, uint16_t *o ) {
+
+	const __m128i HI = _mm_setr_epi8( 0,-1, 1,-1, 3,-1, 4,-1, 6,-1, 7,-1, 9,-1, 10,-1 );
+	const __m128i LO = _mm_setr_epi8( 2,-1, 2,-1, 5,-1, 5,-1, 8,-1, 8,-1, 11,-1, 11,-1 );
+	const __m128i ALIGN = _mm_setr_epi16( 16, 1, 16, 1, 16, 1, 16, 1 );
+	const __m128i MASK  = _mm_set1_epi16( 15 );
+	int x;
+
+	for(x = 0; x + 16 <= w; x += 8 ) {
+		const __m128i A = _mm_loadu_si128( (const __m128i*)( in + 3*x/2 ) );
+		const __m128i H = _mm_slli_epi16( _mm_shuffle_epi8( A, HI ), 4 );
+		const __m128i L = _mm_and_si128( _mm_srli_epi16(
+			_mm_mullo_epi16( _mm_shuffle_epi8( A, LO ), ALIGN ), 4 ), MASK );
+		_mm_storeu_si128( (__m128i*)( o + x ), _mm_or_si128( H, L ) );
+	}
+	_mipi12_16_pixels( in, x, w, o );
+}
+
+
+/**
+  * To 8 bits, two loads of 2 (10-bit) or 4 (12-bit) groups each, their
+  * high bytes gathered into either half of the result.
+  */
+
+__attribute__((target("ssse3")))
+static void _mipi10_8_ssse3( const uint8_t *in, int w, int shift, uint8_t *o ) {
+
+	const __m128i LO = _mm_setr_epi8( 0, 1, 2, 3, 5, 6, 7, 8, -1,-1,-1,-1,-1,-1,-1,-1 );
+	const __m128i HI = _mm_setr_epi8( -1,-1,-1,-1,-1,-1,-1,-1, 0, 1, 2, 3, 5, 6, 7, 8 );
+	int x;
+
+	for(x = 0; x + 24 <= w; x += 16 ) {
+		const uint8_t *p = in + 5*x/4;
+		const __m128i A = _mm_loadu_si128( (const __m128i*)p );
+		const __m128i B = _mm_loadu_si128( (const __m128i*)( p + 10 ) );
+		_mm_storeu_si128( (__m128i*)( o + x ),
+			_mm_or_si128( _mm_shuffle_epi8( A, LO ), _mm_shuffle_epi8( B, HI ) ) );
+	}
+	_mipi10_8_pixels( in, x, w, o );
+}
+
+
+__attribute__((target("ssse3")))
+static void _mipi12_8_ssse3( const uint8_t *in, int w, int shift, uint8_t *o ) {
+
+	const __m128i LO = _mm_setr_epi8( 0, 1, 3, 4, 6, 7, 9, 10, -1,-1,-1,-1,-1,-1,-1,-1 );
+	const __m128i HI = _mm_setr_epi8( -1,-1,-1,-1,-1,-1,-1,-1, 0, 1, 3, 4, 6, 7, 9, 10 );
+	int x;
+
+	for(x = 0; x + 24 <= w; x += 16 ) {
+		const uint8_t *p = in + 3*x/2;
+		const __m128i A = _mm_loadu_si128( (const __m128i*)p );
+		const __m128i B = _mm_loadu_si128( (const __m128i*)( p + 12 ) );
+		_mm_storeu_si128( (__m128i*)( o + x ),
+			_mm_or_si128( _mm_shuffle_epi8( A, LO ), _mm_shuffle_epi8( B, HI ) ) );
+	}
+	_mipi12_8_pixels( in, x, w, o );
+}
+
+
+/**
+  * Shifted words are under 2^14 (shift is at least 2), so packuswb's
+  * signed saturation is the scalar code's.
+  */
+__attribute__((target("sse2")))
+static void _16_8_sse2( const uint8_t *in, int w, int shift, uint8_t *o ) {
+
+	const __m128i SHIFT = _mm_cvtsi32_si128( shift );
+	int x;
+
+	for(x = 0; x + 16 <= w; x += 16 ) {
+		const __m128i A = _mm_loadu_si128( (const __m128i*)( in + 2*x ) );
+		const __m128i B = _mm_loadu_si128( (const __m128i*)( in + 2*x + 16 ) );
+		_mm_storeu_si128( (__m128i*)( o + x ), _mm_packus_epi16(
+			_mm_srl_epi16( A, SHIFT ), _mm_srl_epi16( B, SHIFT ) ) );
+	}
+	_le16_8_pixels( in, x, w, shift, o );
+}
+
+
+static const struct kernels _ssse3 = {
+	{ _8_16_scalar, _16_16_scalar, _mipi10_16_ssse3, _mipi12_16_ssse3 },
+	{ _8_8_scalar,  _16_8_sse2,    _mipi10_8_ssse3,  _mipi12_8_ssse3 },
+};
+
+#endif
+
+static const struct kernels *_kernels = NULL;
+
+static const struct kernels *_select_kernels( void ) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "ssse3" ) )
+		return &_ssse3;
+#endif
+	return &_scalar;
+}
+
+
+static inline const struct kernels *_get_kernels( void ) {
+
+	const struct kernels *k
+		= __atomic_load_n( &_kernels, __ATOMIC_RELAXED );
+
+	if( k == NULL ) {
+		k = _select_kernels();
+		__atomic_store_n( &_kernels, k, __ATOMIC_RELAXED );
+	}
+	return k;
+}
+
+
+size_t raw_row_bytes( const struct fourcc_raw *fmt, int w ) {
+	switch( fmt->packing ) {
+	case FOURCC_PACK_16:     return 2*(size_t)w;
+	case FOURCC_PACK_MIPI10: return 5*( ( (size_t)w + 3 ) / 4 );
+	case FOURCC_PACK_MIPI12: return 3*( ( (size_t)w + 1 ) / 2 );
+	default:
+		return w;
+	}
+}
+
+
+void raw_row16( const struct fourcc_raw *fmt, const uint8_t *in, int w, uint16_t *o ) {
+	_get_kernels()->row16[ fmt->packing ]( in, w, o );
+}
+
+
+/**
+  * With a lut, samples are unpacked to 16 bits a chunk at a time (on the
+  * stack, a multiple of every group) and looked up from there.
+  */
+#define LUT_CHUNK (256)
+
+void raw_row8( const struct fourcc_raw *fmt, const uint8_t *lut,
+		const uint8_t *in, int w, uint8_t *o ) {
+
+	const struct kernels *k = _get_kernels();
+	const unsigned MASK = ( 1U << fmt->bits ) - 1;
+	uint16_t chunk[ LUT_CHUNK ];
+
+	if( lut == NULL ) {
+		k->row8[ fmt->packing ]( in, w, fmt->bits - 8, o );
+		return;
+	}
+	for(int x = 0; x < w; x += LUT_CHUNK ) {
+		const int N = w - x < LUT_CHUNK ? w - x : LUT_CHUNK;
+		k->row16[ fmt->packing ]( in + raw_row_bytes( fmt, x ), N, chunk );
+		for(int i = 0; i < N; i++ )
+			o[ x + i ] = lut[ chunk[i] & MASK ];
+	}
+}
+
+
+void raw_unpack16( const struct fourcc_raw *fmt, const uint8_t *in, size_t stride,
+		int w, int h, uint16_t *o, size_t ostride ) {
+	const row16_t ROW = _get_kernels()->row16[ fmt->packing ];
+	for(int y = 0; y < h; y++ )
+		ROW( in + y*stride, w, (uint16_t*)( (uint8_t*)o + y*ostride ) );
+}
+
+
+void raw_unpack8( const struct fourcc_raw *fmt, const uint8_t *lut,
+		const uint8_t *in, size_t stride, int w, int h, uint8_t *o, size_t ostride ) {
+	for(int y = 0; y < h; y++ )
+		raw_row8( fmt, lut, in + y*stride, w, o + y*ostride );
+}
+
+
+#ifdef UNIT_TEST_RAW
+
+#include <stdlib.h>
+#include <err.h>
+
+/**
+  * Packs random samples into every packing, then checks that every row
+  * kernel recovers them (or their reduction) for widths up to several
+  * vectors, reading only the packed row (whose buffer is exactly sized,
+  * so ASAN would catch more) and writing only the output row.
+  */
+
+#define GUARD (16)
+
+static void _pack( const struct fourcc_raw *fmt, const uint16_t *s, int w, uint8_t *o ) {
+	for(int x = 0; x < w; x++ ) {
+		switch( fmt->packing ) {
+		case FOURCC_PACK_8:
+			o[x] = s[x];
+			break;
+		case FOURCC_PACK_16:
+			o[2*x]   = s[x];
+			o[2*x+1] = s[x] >> 8;
+			break;
+		case FOURCC_PACK_MIPI10:
+			o[ 5*( x >> 2 ) + ( x & 3 ) ] = s[x] >> 2;
+			o[ 5*( x >> 2 ) + 4 ] |= ( s[x] & 3 ) << 2*( x & 3 );
+			break;
+		case FOURCC_PACK_MIPI12:
+			o[ 3*( x >> 1 ) + ( x & 1 ) ] = s[x] >> 4;
+			o[ 3*( x >> 1 ) + 2 ] |= ( s[x] & 15 ) << 4*( x & 1 );
+			break;
+		}
+	}
+}
+
+
+int main( int argc, char *argv[] ) {
+
+	static const char *NAME[] = { "8", "16", "MIPI10", "MIPI12" };
+	static const struct fourcc_raw FORMAT[] = {
+		{  8, FOURCC_PACK_8,      -1 },
+		{ 10, FOURCC_PACK_16,     -1 },
+		{ 12, FOURCC_PACK_16,     -1 },
+		{ 16, FOURCC_PACK_16,     -1 },
+		{ 10, FOURCC_PACK_MIPI10, -1 },
+		{ 12, FOURCC_PACK_MIPI12, -1 },
+	};
+	static uint8_t lut[ 1 << 16 ];
+	int failures = 0, tested = 0;
+
+	srandom( 1 );
+	for(int i = 0; i < sizeof(lut); i++ )
+		lut[i] = random();
+
+	// The scalar kernels, then the best the CPU has.
+
+	for(int k = 0; k < 2; k++ ) {
+
+		_kernels = k ? _select_kernels() : &_scalar;
+
+		for(int f = 0; f < sizeof(FORMAT)/sizeof(FORMAT[0]); f++ ) {
+
+			const struct fourcc_raw *FMT = FORMAT + f;
+			const int GROUP = FMT->packing == FOURCC_PACK_MIPI10
+				? 4 : ( FMT->packing == FOURCC_PACK_MIPI12 ? 2 : 1 );
+
+			for(int w = GROUP; w <= 600; w += GROUP ) {
+
+				const size_t BYTES = raw_row_bytes( FMT, w );
+				uint16_t *s   = malloc( w*sizeof(uint16_t) );
+				uint8_t  *in  = calloc( BYTES, 1 );
+				uint16_t *o16 = malloc( ( w + GUARD )*sizeof(uint16_t) );
+				uint8_t  *o8  = malloc( w + GUARD );
+				uint8_t  *l8  = malloc( w + GUARD );
+				bool bad = false;
+
+				for(int x = 0; x < w; x++ )
+					s[x] = random() & ( ( 1 << FMT->bits ) - 1 );
+				_pack( FMT, s, w, in );
+				memset( o16, 0xA5, ( w + GUARD )*sizeof(uint16_t) );
+				memset( o8,  0xA5, w + GUARD );
+				memset( l8,  0xA5, w + GUARD );
+
+				raw_row16( FMT, in, w, o16 );
+				raw_row8( FMT, NULL, in, w, o8 );
+				raw_row8( FMT, lut, in, w, l8 );
+
+				for(int x = 0; x < w; x++ ) {
+					bad |= o16[x] != s[x];
+					bad |= o8[x]  != s[x] >> ( FMT->bits - 8 );
+					bad |= l8[x]  != lut[ s[x] ];
+				}
+				for(int x = w; x < w + GUARD; x++ )
+					bad |= o16[x] != 0xA5A5 || o8[x] != 0xA5 || l8[x] != 0xA5;
+
+				if( bad && failures++ < 8 )
+					warnx( "%s (%d bits) wrong at width %d", NAME[ FMT->packing ], FMT->bits, w );
+				tested++;
+				free( s );
+				free( in );
+				free( o16 );
+				free( o8 );
+				free( l8 );
+			}
+		}
+
+		printf( "%d rows (%s kernels) compared\n", tested,
+			_kernels == &_scalar ? "scalar" : "SSSE3" );
+		tested = 0;
+	}
+
+	printf( "%s\n", failures ? "FAILED" : "passed" );
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
+
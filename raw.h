@@ -0,0 +1,61 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+
+#ifndef _raw_h_
+#define _raw_h_
+
+/**
+  * Unpacking of the raw formats fourcc_raw describes (requires fourcc.h).
+  *
+  * Widths of MIPI-packed rows should be multiples of the packing's group
+  * (4 samples for 10-bit, 2 for 12-bit), as V4L2 requires; a partial
+  * last group is read as if it were whole.
+  */
+
+/**
+  * Bytes a row of w samples occupies, unpadded.
+  */
+size_t raw_row_bytes( const struct fourcc_raw *fmt, int w );
+
+/**
+  * A row of w samples to 16 bits, the significant bits low-aligned as
+  * in Y10 and Y12.
+  */
+void raw_row16( const struct fourcc_raw *fmt, const uint8_t *in, int w, uint16_t *o );
+
+/**
+  * A row of w samples to 8 bits: the top 8 significant bits, or given a
+  * lut of 1 << fmt->bits entries (e.g. a gamma or window/level curve),
+  * lut[sample].
+  */
+void raw_row8( const struct fourcc_raw *fmt, const uint8_t *lut,
+		const uint8_t *in, int w, uint8_t *o );
+
+/**
+  * Whole frames, rows stride bytes apart in the input and ostride bytes
+  * apart in the output.
+  */
+void raw_unpack16( const struct fourcc_raw *fmt, const uint8_t *in, size_t stride,
+		int w, int h, uint16_t *o, size_t ostride );
+void raw_unpack8( const struct fourcc_raw *fmt, const uint8_t *lut,
+		const uint8_t *in, size_t stride, int w, int h, uint8_t *o, size_t ostride );
+
+#endif
+
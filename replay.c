@@ -0,0 +1,421 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * The "replay" mode for offline analysis: a recorded series of images is
+  * delivered as if the frames were being dequeued from a camera.
+  *
+  * Two kinds of recording are supported:
+  * 1. a single file of raw, back-to-back frames (YUYV, BA81 or GREY) whose
+  *    dimensions and format are taken from the first workable preference
+  *    passed to config, or
+  * 2. a directory of (binary, 8-bit) PGM files, replayed in name order.
+  *
+  * Either is mmap'd, and dequeued frames point directly into the mapping
+  * (privately, so consumers may scribble on them harmlessly).
+  *
+  * If <path>.ts exists it holds one timestamp (in seconds) per frame.
+  * Those are reported as the frames' timestamps (relative to the start of
+  * streaming) and, with VIDEO_REPLAY_REALTIME, pace delivery. Otherwise
+  * frames are delivered as fast as they are dequeued.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <err.h>
+
+#include "video.h"
+#include "vidfrm.h"
+#include "vidfmt.h"
+#include "fourcc.h"
+#include "vidstats.h"
+#include "softcap.h"
+
+struct mapping {
+	void  *address;
+	size_t length;
+};
+
+struct replay {
+
+	char path[ PATH_MAX ];
+	bool loop;
+	bool raw;
+
+	/**
+	  * A raw recording is one mapping; a PGM directory is one per file.
+	  */
+	int nmaps;
+	struct mapping *map;
+
+	/**
+	  * Frame i is at frame[i] and is framesize bytes.
+	  */
+	int       nframes;
+	uint8_t **frame;
+	size_t    framesize;
+
+	/**
+	  * Recorded timestamps, in nanoseconds relative to the first frame,
+	  * or NULL.
+	  */
+	int64_t *ts;
+};
+
+
+static void *_map( const char *path, size_t *length ) {
+
+	struct stat st;
+	void *address;
+	const int fd
+		= open( path, O_RDONLY );
+
+	if( fd < 0 ) {
+		warn( "opening %s", path );
+		return NULL;
+	}
+	if( fstat( fd, &st ) < 0 || st.st_size == 0 ) {
+		warnx( "%s is empty or unreadable", path );
+		close( fd );
+		return NULL;
+	}
+	address = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( MAP_FAILED == address ) {
+		warn( "mmap'ing %s", path );
+		return NULL;
+	}
+	*length = st.st_size;
+	return address;
+}
+
+
+/**
+  * Returns the raster of a binary 8-bit PGM, or NULL.
+  */
+static uint8_t *_pgm_raster( uint8_t *p, size_t length, unsigned *w, unsigned *h ) {
+
+	const uint8_t *END = p + length;
+	unsigned v[3];
+	int i;
+
+	if( length < 2 || p[0] != 'P' || p[1] != '5' )
+		return NULL;
+	p += 2;
+
+	for(i = 0; i < 3; i++ ) {
+		// Skip whitespace and comments.
+		while( p < END && ( *p == '#' || *p <= ' ' ) ) {
+			if( *p == '#' )
+				while( p < END && *p != '\n' ) p++;
+			else
+				p++;
+		}
+		if( p >= END || *p < '0' || *p > '9' )
+			return NULL;
+		v[i] = 0;
+		while( p < END && *p >= '0' && *p <= '9' )
+			v[i] = 10*v[i] + ( *p++ - '0' );
+	}
+	p++; // exactly one whitespace character precedes the raster
+
+	if( v[2] > 255 || p + (size_t)v[0]*v[1] > END )
+		return NULL;
+	*w = v[0];
+	*h = v[1];
+	return p;
+}
+
+
+static int _pgm_filter( const struct dirent *e ) {
+	const size_t L = strlen( e->d_name );
+	return L > 4 && strcmp( e->d_name + L - 4, ".pgm" ) == 0;
+}
+
+
+static int _load_pgm_directory( struct softcap *sc, struct replay *rp ) {
+
+	struct dirent **names = NULL;
+	int i, n;
+
+	n = scandir( rp->path, &names, _pgm_filter, alphasort );
+	if( n <= 0 ) {
+		warnx( "no PGM files in %s", rp->path );
+		return -1;
+	}
+
+	rp->map   = calloc( n, sizeof(struct mapping) );
+	rp->frame = calloc( n, sizeof(uint8_t*) );
+	if( rp->map == NULL || rp->frame == NULL )
+		goto done;
+
+	for(i = 0; i < n; i++ ) {
+		char path[ PATH_MAX + sizeof(names[i]->d_name) + 1 ];
+		unsigned w, h;
+		snprintf( path, sizeof(path), "%s/%s", rp->path, names[i]->d_name );
+		rp->map[i].address = _map( path, &rp->map[i].length );
+		if( rp->map[i].address == NULL )
+			break;
+		rp->nmaps++;
+		rp->frame[i] = _pgm_raster( rp->map[i].address, rp->map[i].length, &w, &h );
+		if( rp->frame[i] == NULL ) {
+			warnx( "%s is not a binary 8-bit PGM", path );
+			break;
+		}
+		if( i == 0 ) {
+			sc->format.width  = w;
+			sc->format.height = h;
+			strcpy( sc->format.pixel_format, "GREY" );
+		} else
+		if( w != sc->format.width || h != sc->format.height ) {
+			warnx( "%s is %dx%d; expected %dx%d", path, w, h,
+				sc->format.width, sc->format.height );
+			break;
+		}
+	}
+	if( i == n ) {
+		rp->nframes   = n;
+		rp->framesize = sc->format.width * sc->format.height;
+	}
+done:
+	for(i = 0; i < n; i++ )
+		free( names[i] );
+	free( names );
+	return rp->nframes > 0 ? 0 : -1;
+}
+
+
+/**
+  * Loads <path>.ts if it exists and has (at least) one timestamp per
+  * frame. Its absence is not an error.
+  */
+static void _load_timestamps( struct replay *rp ) {
+
+	char path[ PATH_MAX + 4 ];
+	double t, t0 = 0;
+	FILE *fp;
+	int i;
+
+	snprintf( path, sizeof(path), "%s.ts", rp->path );
+	if( (fp = fopen( path, "r" )) == NULL )
+		return;
+
+	rp->ts = calloc( rp->nframes, sizeof(int64_t) );
+	for(i = 0; rp->ts && i < rp->nframes && fscanf( fp, "%lf", &t ) == 1; i++ ) {
+		if( i == 0 )
+			t0 = t;
+		rp->ts[i] = (int64_t)( ( t - t0 ) * 1e9 );
+	}
+	fclose( fp );
+
+	if( rp->ts && i < rp->nframes ) {
+		warnx( "%s has %d timestamps for %d frames; ignoring it",
+			path, i, rp->nframes );
+		free( rp->ts );
+		rp->ts = NULL;
+	}
+}
+
+
+/***************************************************************************
+  * softcap_source implementation
+  */
+
+static int _config( struct softcap *sc, struct video_format *pref, int n ) {
+
+	struct replay *rp = sc->context;
+	int i, selection = -1;
+
+	if( rp->raw ) {
+
+		// A raw recording: the first preference in a known format that
+		// evenly divides the file wins.
+
+		for(i = 0; i < n && selection < 0; i++ ) {
+			const uint32_t FOURCC_CODE
+				= fourcc_integer( pref[i].pixel_format );
+			size_t bpp = 0;
+			if( FOURCC_CODE == fourcc_integer( "YUYV" ) )
+				bpp = 2;
+			else
+			if( FOURCC_CODE == fourcc_integer( "BA81" )
+			 || FOURCC_CODE == fourcc_integer( "GREY" ) )
+				bpp = 1;
+			if( bpp == 0 || pref[i].width*pref[i].height == 0 )
+				continue;
+			rp->framesize = bpp * pref[i].width * pref[i].height;
+			if( rp->map[0].length % rp->framesize == 0 )
+				selection = i;
+		}
+		if( selection < 0 ) {
+			warnx( "no preference fits %s (%ld bytes)",
+				rp->path, rp->map[0].length );
+			return -1;
+		}
+
+		free( rp->frame );
+		free( rp->ts );
+		rp->ts      = NULL;
+		rp->nframes = rp->map[0].length / rp->framesize;
+		rp->frame   = calloc( rp->nframes, sizeof(uint8_t*) );
+		if( rp->frame == NULL )
+			return -1;
+		for(i = 0; i < rp->nframes; i++ )
+			rp->frame[i] = (uint8_t*)rp->map[0].address + i*rp->framesize;
+		sc->format = pref[ selection ];
+		sc->format.fps = 0; // the timestamps (if any) govern
+		_load_timestamps( rp );
+
+	} else {
+
+		// A PGM series' format is what it is.
+
+		for(i = 0; i < n && selection < 0; i++ ) {
+			if( pref[i].width  == sc->format.width
+			 && pref[i].height == sc->format.height
+			 && strcmp( pref[i].pixel_format, sc->format.pixel_format ) == 0 )
+				selection = i;
+		}
+	}
+
+	if( softcap_buffers( sc, sc->buffer_count, 0 ) <= 0 )
+		return -2;
+	for(i = 0; i < sc->frame_count; i++ )
+		sc->buffer[i].length = sc->buffer[i].bytesused = rp->framesize;
+
+	return selection;
+}
+
+
+static int _fill( struct softcap *sc, uint32_t sequence, int buffer_id ) {
+
+	struct replay *rp = sc->context;
+
+	if( sequence >= rp->nframes && ! rp->loop )
+		return -1;
+	sc->buffer[ buffer_id ].mem = rp->frame[ sequence % rp->nframes ];
+	return 0;
+}
+
+
+static bool _due( struct softcap *sc, uint32_t sequence, struct timespec *offset ) {
+
+	struct replay *rp = sc->context;
+	const uint32_t I
+		= sequence % rp->nframes;
+	int64_t ns;
+
+	if( rp->ts == NULL || ( sequence >= rp->nframes && ! rp->loop ) )
+		return false;
+
+	ns = rp->ts[ I ];
+	if( sequence >= rp->nframes ) {
+		// Each further pass is offset by the recording's duration plus
+		// one mean frame interval.
+		const int64_t SPAN = rp->ts[ rp->nframes-1 ];
+		const int64_t GAP  = rp->nframes > 1 ? SPAN / ( rp->nframes-1 ) : 0;
+		ns += ( sequence / rp->nframes ) * ( SPAN + GAP );
+	}
+	offset->tv_sec  = ns / 1000000000;
+	offset->tv_nsec = ns % 1000000000;
+	return true;
+}
+
+
+static void _destroy( struct softcap *sc ) {
+
+	struct replay *rp = sc->context;
+	int i;
+
+	for(i = 0; i < rp->nmaps; i++ )
+		munmap( rp->map[i].address, rp->map[i].length );
+	free( rp->map );
+	free( rp->frame );
+	free( rp->ts );
+	free( rp );
+}
+
+
+static const struct softcap_source _source = {
+	.config  = _config,
+	.fill    = _fill,
+	.due     = _due,
+	.destroy = _destroy,
+};
+
+
+struct video_capture *video_replay_open( const char *path, int flags ) {
+
+	struct video_capture *vci = NULL;
+	struct replay *rp;
+	struct stat st;
+
+	if( stat( path, &st ) < 0 ) {
+		warn( "stat'ing %s", path );
+		return NULL;
+	}
+
+	rp = calloc( 1, sizeof(struct replay) );
+	if( rp == NULL )
+		return NULL;
+	snprintf( rp->path, sizeof(rp->path), "%s", path );
+	rp->loop = ( flags & VIDEO_REPLAY_LOOP ) != 0;
+
+	vci = softcap_create( &_source, rp,
+		( flags & VIDEO_REPLAY_REALTIME ) != 0 );
+	if( vci == NULL ) {
+		free( rp );
+		return NULL;
+	}
+
+	if( S_ISDIR( st.st_mode ) ) {
+		if( _load_pgm_directory( (struct softcap*)vci, rp ) )
+			goto failure;
+		_load_timestamps( rp );
+	} else {
+		rp->map = calloc( 1, sizeof(struct mapping) );
+		if( rp->map == NULL )
+			goto failure;
+		rp->map[0].address = _map( path, &rp->map[0].length );
+		if( rp->map[0].address == NULL )
+			goto failure;
+		rp->nmaps = 1;
+		rp->raw   = true;
+		// Frames (and timestamps) are established by config.
+	}
+
+	return vci;
+
+failure:
+	vci->destroy( vci );
+	return NULL;
+}
+
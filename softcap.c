@@ -0,0 +1,575 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * struct video_capture for non-V4L2 frame sources; see softcap.h.
+  *
+  * Dequeued frames are described exactly as video.c describes them
+  * (V4L2 flags included), so consumers cannot tell the difference.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <err.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
+#include "vidfrm.h"
+#include "vidfmt.h"
+#include "vidstats.h"
+#include "vidtrace.h"
+#include "softcap.h"
+#include "fourcc.h"
+
+static inline uint64_t _queued( const struct softcap *sc ) {
+	return __atomic_load_n( &sc->queued, __ATOMIC_RELAXED );
+}
+
+
+static inline void _add( struct timespec *t, const struct timespec *d ) {
+	t->tv_sec  += d->tv_sec;
+	t->tv_nsec += d->tv_nsec;
+	if( t->tv_nsec >= 1000000000L ) {
+		t->tv_nsec -= 1000000000L;
+		t->tv_sec  += 1;
+	}
+}
+
+
+/**
+  * Arms the timer for the frame at sc->sequence or, if nothing is queued,
+  * disarms it so the descriptor doesn't poll readable with nothing to
+  * deliver. May race with enqueues on other threads, hence the re-check
+  * after disarming: whoever changes queued last also arms last.
+  */
+static void _arm( struct softcap *sc ) {
+
+	struct itimerspec its;
+	struct timespec offset;
+	int flags = 0;
+
+	if( ! sc->streaming )
+		return;
+
+	memset( &its, 0, sizeof(its) );
+
+	if( _queued( sc ) == 0 ) {
+		timerfd_settime( sc->timer, 0, &its, NULL );
+		if( _queued( sc ) == 0 )
+			return;
+	}
+
+	if( sc->realtime
+			&& sc->source->due
+			&& sc->source->due( sc, sc->sequence, &offset ) ) {
+		its.it_value = sc->epoch;
+		_add( &its.it_value, &offset );
+		flags = TFD_TIMER_ABSTIME;
+	} else
+		its.it_value.tv_nsec = 1; // i.e. now
+
+	if( timerfd_settime( sc->timer, flags, &its, NULL ) < 0 )
+		warn( "timerfd_settime" );
+}
+
+
+/**
+  * The next queued buffer in round-robin order, or -1.
+  */
+static int _next( const struct softcap *sc ) {
+	const uint64_t Q = _queued( sc );
+	uint64_t above;
+	if( Q == 0 )
+		return -1;
+	above = Q & ~( ( (uint64_t)1 << sc->cursor ) - 1 );
+	return __builtin_ctzll( above ? above : Q );
+}
+
+
+/***************************************************************************
+  * video_capture implementation
+  */
+
+static const struct video_format *_format( struct video_capture *vci ) {
+	struct softcap *sc
+		= (struct softcap*)vci;
+	return & sc->format;
+}
+
+
+/**
+  * Sources fill buffers tightly, so the stride follows from the frame
+  * size; the planes of planar formats are all (8-bit luma) width wide.
+  */
+static int _config( struct video_capture *vci, struct video_format *pref, int n ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	const int selection
+		= sc->source->config( sc, pref, n );
+	const unsigned H = sc->format.height;
+	unsigned rows[ VIDEO_FRAME_PLANES ];
+
+	if( sc->frame_count > 0 && H > 0 )
+		sc->format.stride
+			= fourcc_planes( fourcc_integer( sc->format.pixel_format ), H, rows ) > 1
+			? sc->format.width
+			: sc->buffer[0].bytesused / H;
+	return selection;
+}
+
+
+static int _start( struct video_capture *vci ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+
+	if( sc->frame_count <= 0 ) {
+		warnx( "not configured" );
+		return -1;
+	}
+	clock_gettime( CLOCK_MONOTONIC, &sc->epoch );
+	sc->sequence  = 0;
+	sc->cursor    = 0;
+	sc->streaming = true;
+	_arm( sc );
+	return 0;
+}
+
+
+static int _stop( struct video_capture *vci ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+
+	sc->streaming = false;
+	__atomic_store_n( &sc->queued, 0, __ATOMIC_RELAXED );
+	{
+		const struct itimerspec DISARM = { { 0, 0 }, { 0, 0 } };
+		timerfd_settime( sc->timer, 0, &DISARM, NULL );
+	}
+	return 0;
+}
+
+
+static int _enqueue( struct video_capture *vci, uint64_t flags ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	uint64_t was;
+
+	if( sc->frame_count < 64 )
+		flags &= ( (uint64_t)1 << sc->frame_count ) - 1;
+	if( flags == 0 )
+		return 0;
+
+	for(was = flags; was; was &= was - 1 )
+		VIDEO_TRACE( VIDEO_TRACE_QBUF, __builtin_ctzll( was ) );
+	was = __atomic_fetch_or( &sc->queued, flags, __ATOMIC_RELAXED );
+	if( was == 0 )
+		_arm( sc );
+	return 0;
+}
+
+
+static int _enqueue1( struct video_capture *vci, int buffer_id ) {
+	struct softcap *sc
+		= (struct softcap*)vci;
+	if( buffer_id < 0 || buffer_id >= sc->frame_count )
+		return -1;
+	return _enqueue( vci, (uint64_t)1 << buffer_id );
+}
+
+
+/**
+  * The planes of planar formats follow each other (see _config).
+  */
+static void _planes( const struct softcap *sc, struct video_frame *fr ) {
+
+	const unsigned H = sc->format.height;
+	unsigned rows[ VIDEO_FRAME_PLANES ];
+	uint8_t *p = fr->mem;
+	uint32_t left = fr->bytesused;
+	int i;
+
+	fr->planes = fourcc_planes(
+		fourcc_integer( sc->format.pixel_format ), H, rows );
+
+	for(i = 0; i < fr->planes; i++ ) {
+		struct video_plane *pl
+			= fr->plane + i;
+		uint32_t size = left;
+		pl->stride = sc->format.stride;
+		if( fr->planes > 1 && size > pl->stride * rows[i] )
+			size = pl->stride * rows[i];
+		pl->mem       = p;
+		pl->bytesused = size;
+		p    += size;
+		left -= size;
+	}
+}
+
+
+/**
+  * What _dequeue returns at the end of the stream (besides setting errno
+  * to ENODATA, as video.h promises); other failures return line numbers.
+  */
+#define END_OF_STREAM (-2)
+
+static int _dequeue( struct video_capture *vci,
+		int timeout, struct video_frame *fr ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	struct timespec ts, now;
+	uint64_t expirations;
+	int id;
+
+	if( _queued( sc ) == 0 && timeout != VIDEO_DEQ_TIMEOUT_NONE )
+		return -1;
+
+	if( timeout == VIDEO_DEQ_TIMEOUT_DEFAULT )
+		timeout = sc->dequeue_timeout;
+
+	if( timeout > 0 ) {
+		struct pollfd pfd = { .fd = sc->timer, .events = POLLIN };
+		const int nfd = poll( &pfd, 1, timeout );
+		if( nfd < 0 ) {
+			warn( "waiting on frame timer" );
+			return __LINE__;
+		}
+		if( 0 == nfd ) {
+			video_stats_count( &sc->stats.timeouts );
+			warnx( "frame wait timeout (%dms)", timeout );
+			return __LINE__;
+		}
+		VIDEO_TRACE( VIDEO_TRACE_WAKEUP, nfd );
+	}
+
+	// Pick the buffer before consuming the timer so that a due frame is
+	// not lost for want of a buffer.
+
+	if( (id = _next( sc )) < 0 ) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if( read( sc->timer, &expirations, sizeof(expirations) ) < 0 )
+		return __LINE__; // EAGAIN: not due yet
+
+	if( sc->source->fill( sc, sc->sequence, id ) ) {
+		_arm( sc ); // ...so that every subsequent dequeue says the same.
+		errno = ENODATA;
+		return END_OF_STREAM;
+	}
+
+	VIDEO_TRACE( VIDEO_TRACE_DQBUF, id );
+	__atomic_fetch_and( &sc->queued, ~((uint64_t)1 << id), __ATOMIC_RELAXED );
+	sc->cursor = ( id + 1 ) % sc->frame_count;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	if( ! ( sc->source->due && sc->source->due( sc, sc->sequence, &ts ) ) ) {
+		ts = now;
+	} else {
+		struct timespec offset = ts;
+		ts = sc->epoch;
+		_add( &ts, &offset );
+	}
+
+	memset( fr, 0, sizeof(*fr) );
+	fr->buffer_id = id;
+	fr->bytesused = sc->buffer[ id ].bytesused;
+	fr->flags     = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	fr->field     = V4L2_FIELD_NONE;
+	fr->timestamp.tv_sec  = ts.tv_sec;
+	fr->timestamp.tv_usec = ts.tv_nsec / 1000;
+	fr->sequence  = sc->sequence++;
+	fr->mem       = sc->buffer[ id ].mem;
+	fr->length    = sc->buffer[ id ].length;
+	fr->gap       = 0; // late frames are delayed, never dropped
+	fr->monotonic = ts;
+	fr->latency_ns
+		= ( now.tv_sec - ts.tv_sec )*1000000000LL
+		+ ( now.tv_nsec - ts.tv_nsec );
+	_planes( sc, fr );
+	video_stats_frame( &sc->stats, fr );
+
+	_arm( sc );
+	return 0;
+}
+
+
+static int _dequeue_many( struct video_capture *vci,
+		int timeout, struct video_frame *fr, int max ) {
+
+	int n = 0;
+
+	if( max <= 0 )
+		return 0;
+	switch( _dequeue( vci, timeout, fr ) ) {
+	case 0:
+		break;
+	case END_OF_STREAM:
+		return -1;
+	default:
+		return 0;
+	}
+	n = 1;
+	while( n < max && _dequeue( vci, VIDEO_DEQ_TIMEOUT_NONE, fr + n ) == 0 )
+		n++;
+	return n;
+}
+
+
+/**
+  * Only paced frames can fall due while the consumer is busy; unpaced
+  * ones are produced on demand, so the first is already the newest.
+  */
+static int _dequeue_latest( struct video_capture *vci,
+		int timeout, struct video_frame *fr, int *skipped ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	const bool PACED
+		= sc->realtime && sc->source->due;
+	struct video_frame next;
+
+	if( skipped )
+		*skipped = 0;
+	if( _dequeue( vci, timeout, fr ) )
+		return __LINE__;
+	while( PACED && _dequeue( vci, VIDEO_DEQ_TIMEOUT_NONE, &next ) == 0 ) {
+		_enqueue1( vci, fr->buffer_id );
+		*fr = next;
+		if( skipped )
+			(*skipped)++;
+	}
+	return 0;
+}
+
+
+static int _snap( struct video_capture *vci, int timeout, size_t *len, uint8_t **ubuf ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	struct video_frame fr;
+	int econd = 0;
+
+	_enqueue1( vci, 0 );
+	if( _start( vci ) < 0 )
+		return -1;
+	if( _dequeue( vci, timeout, &fr ) )
+		econd = -1;
+	_stop( vci );
+
+	if( econd == 0 && (NULL != ubuf) && (NULL != len) ) {
+		if( *len < fr.bytesused ) {
+			void *p = realloc( *ubuf, fr.bytesused );
+			if( p == NULL )
+				return -1;
+			*ubuf = p;
+		}
+		memcpy( *ubuf, sc->buffer[ fr.buffer_id ].mem, fr.bytesused );
+		*len = fr.bytesused;
+	}
+	return econd;
+}
+
+
+static int _descriptor( struct video_capture *vci ) {
+	struct softcap *sc
+		= (struct softcap*)vci;
+	return sc->timer;
+}
+
+
+static int _export( struct video_capture *vci,
+		const struct video_frame *fr, struct video_export *ex ) {
+	return -1; // there is no DMABUF behind these frames
+}
+
+
+static int _userptr( struct video_capture *vci, void *arena, size_t size ) {
+	warnx( "USERPTR capture is only supported by V4L2 devices" );
+	return -1;
+}
+
+
+/**
+  * A late consumer only delays software frames rather than losing them,
+  * so there is never a reason to grow and max is ignored.
+  */
+static int _buffers( struct video_capture *vci, int count, int max ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+
+	if( sc->frame_count > 0 ) {
+		warnx( "buffers must precede config" );
+		return -1;
+	}
+	if( count < 1 || count > VIDEO_MAX_BUFFERS ) {
+		warnx( "buffer count %d not in [1,%d]", count, VIDEO_MAX_BUFFERS );
+		return -1;
+	}
+	sc->buffer_count = count;
+	return 0;
+}
+
+
+static struct video_lease *_lease( struct video_capture *vci,
+		const struct video_frame *fr ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+
+	return video_lease_issue( sc->lease, sc->frame_count, vci, fr );
+}
+
+
+static void _destroy( struct video_capture *vci ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+
+	if( sc->source->destroy )
+		sc->source->destroy( sc );
+	close( sc->timer );
+	free( sc->storage );
+	free( sc );
+}
+
+
+/**
+  * The one format a source delivers, once known.
+  */
+static int _modes( struct video_capture *vci, const struct video_format **mode ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	*mode = & sc->format;
+	return sc->format.width > 0 ? 1 : 0;
+}
+
+
+static int _stats( struct video_capture *vci, struct video_stats *st ) {
+
+	struct softcap *sc
+		= (struct softcap*)vci;
+	video_stats_copy( st, &sc->stats );
+	st->queued  = __builtin_popcountll( _queued( sc ) );
+	st->buffers = sc->frame_count;
+	return 0;
+}
+
+
+static const struct video_capture _interface = {
+	.format  = _format,
+	.config  = _config,
+	.snap    = _snap,
+	.start   = _start,
+	.enqueue1 = _enqueue1,
+	.enqueue = _enqueue,
+	.dequeue = _dequeue,
+	.dequeue_many = _dequeue_many,
+	.dequeue_latest = _dequeue_latest,
+	.stop    = _stop,
+	.destroy = _destroy,
+	.descriptor = _descriptor,
+	.export  = _export,
+	.userptr = _userptr,
+	.lease   = _lease,
+	.buffers = _buffers,
+	.modes   = _modes,
+	.stats   = _stats,
+};
+
+
+/***************************************************************************
+  * Source support
+  */
+
+int softcap_buffers( struct softcap *sc, int count, size_t size ) {
+
+	const size_t PAGE
+		= sysconf( _SC_PAGESIZE );
+	const size_t SLOT
+		= ( size + PAGE - 1 ) & ~( PAGE - 1 );
+	int i;
+
+	if( count > VIDEO_MAX_BUFFERS )
+		count = VIDEO_MAX_BUFFERS;
+
+	free( sc->storage );
+	sc->storage = NULL;
+
+	if( SLOT > 0 && posix_memalign( &sc->storage, PAGE, count*SLOT ) ) {
+		warnx( "allocating %d buffers of %ld bytes", count, size );
+		sc->frame_count = 0;
+		return -1;
+	}
+
+	for(i = 0; i < count; i++ ) {
+		sc->buffer[i].mem       = SLOT ? (uint8_t*)sc->storage + i*SLOT : NULL;
+		sc->buffer[i].length    = size;
+		sc->buffer[i].bytesused = size;
+	}
+	sc->frame_count = count;
+	return count;
+}
+
+
+struct video_capture *softcap_create( const struct softcap_source *source,
+		void *context, bool realtime ) {
+
+	struct softcap *sc
+		= calloc( 1, sizeof(struct softcap) );
+
+	if( NULL == sc ) {
+		warn( "allocating capture state" );
+		return NULL;
+	}
+
+	sc->timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if( sc->timer < 0 ) {
+		warn( "timerfd_create" );
+		free( sc );
+		return NULL;
+	}
+
+	sc->interface = _interface;
+	sc->source    = source;
+	sc->context   = context;
+	sc->realtime  = realtime;
+	sc->dequeue_timeout = 2000 /* milliseconds */;
+	sc->buffer_count = VIDEO_DEFAULT_BUFFERS;
+
+	return & sc->interface;
+}
+
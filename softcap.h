@@ -0,0 +1,137 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+
+#ifndef _softcap_h_
+#define _softcap_h_
+
+/**
+  * The common implementation of struct video_capture for frame sources
+  * that are not V4L2 devices. It emulates the driver's buffer ring,
+  * (de)queue semantics, sequence numbers and timestamps; a concrete
+  * source only produces frame content.
+  *
+  * Frame pacing is driven by a timerfd that becomes readable when the
+  * next frame is due (immediately unless pacing is realtime), and that
+  * timerfd is also the capture's descriptor, so these sources work with
+  * video_loop like any device.
+  */
+
+struct softcap;
+
+struct softcap_source {
+
+	/**
+	  * Chooses a format among n preferences and establishes the frame
+	  * buffers (see softcap_buffers). Returns the index of the preference
+	  * satisfied, or -1 if none was (in which case the format is still
+	  * set to whatever the source delivers).
+	  */
+	int  (*config)( struct softcap *, struct video_format *, int n );
+
+	/**
+	  * Makes buffer_id hold frame <sequence>. Sources that already hold
+	  * their frames in memory may simply repoint the buffer's mem.
+	  * Returns non-zero at the end of the stream.
+	  */
+	int  (*fill)( struct softcap *, uint32_t sequence, int buffer_id );
+
+	/**
+	  * Offset of frame <sequence> from the start of the stream, if the
+	  * source knows it. May be NULL.
+	  */
+	bool (*due)( struct softcap *, uint32_t sequence, struct timespec * );
+
+	void (*destroy)( struct softcap * );
+};
+
+struct softcap_buffer {
+	void  *mem;
+	size_t length;
+	size_t bytesused;
+};
+
+struct softcap {
+
+	struct video_capture interface;
+
+	const struct softcap_source *source;
+
+	/**
+	  * The source's private state.
+	  */
+	void *context;
+
+	struct video_format format;
+
+	/**
+	  * Deliver frames when due rather than as fast as they're dequeued.
+	  */
+	bool realtime;
+
+	int dequeue_timeout;
+
+	/**
+	  * The pacing timerfd and the stream's start (CLOCK_MONOTONIC).
+	  */
+	int timer;
+	bool streaming;
+	struct timespec epoch;
+
+	/**
+	  * Sequence number of the next frame to be produced.
+	  */
+	uint32_t sequence;
+
+	/**
+	  * Bit flags of queued buffers, modified atomically as in video.c.
+	  * Buffers are filled round-robin starting from cursor.
+	  */
+	uint64_t queued;
+	int cursor;
+
+	/**
+	  * What config should pass to softcap_buffers (video_capture.buffers).
+	  */
+	int buffer_count;
+
+	int frame_count;
+	struct softcap_buffer buffer[ VIDEO_MAX_BUFFERS ];
+
+	/**
+	  * Backing store allocated by softcap_buffers, if any.
+	  */
+	void *storage;
+
+	struct video_lease lease[ VIDEO_MAX_BUFFERS ];
+
+	struct video_stats stats;
+};
+
+struct video_capture *softcap_create( const struct softcap_source *,
+		void *context, bool realtime );
+
+/**
+  * Establishes count buffers of size bytes each, page-aligned. A size of
+  * 0 allocates nothing; the source's fill must then supply each mem.
+  */
+int softcap_buffers( struct softcap *, int count, size_t size );
+
+#endif
+
@@ -0,0 +1,409 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * A synthetic camera generating deterministic test patterns, for load
+  * testing and for verifying conversion code on machines without any
+  * video hardware. Its spec (following "synthetic:" in video_open) is:
+  *
+  *     <width>x<height>:<FOURCC>[@<fps>][:<pattern>]
+  *
+  * e.g. "1920x1080:YUYV@240:counter". FOURCC is one of YUYV, GREY, BA81,
+  * NV12 or NV16.
+  * Without @<fps> (or with @0) frames are produced as fast as they are
+  * dequeued. Patterns are:
+  *
+  *   bars    - the 8 standard (100%) color bars, scrolling 4 pixels left
+  *             per frame (the default)
+  *   counter - bars with the frame's sequence number overlaid across the
+  *             top 16 rows as 32 binary blocks, MSB first (white = 1)
+  *   noise   - uniformly random bytes, seeded by the sequence number
+  *
+  * Frame n of a given spec is always identical, so pixel values are known
+  * exactly.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <err.h>
+
+#include "video.h"
+#include "vidfrm.h"
+#include "vidfmt.h"
+#include "fourcc.h"
+#include "vidstats.h"
+#include "softcap.h"
+
+#define SCROLL_PER_FRAME (4)
+#define COUNTER_ROWS (16)
+
+enum pattern {
+	PATTERN_BARS,
+	PATTERN_COUNTER,
+	PATTERN_NOISE
+};
+
+struct synthetic {
+	struct video_format spec;
+	unsigned fps;
+	enum pattern pattern;
+};
+
+/**
+  * White, yellow, cyan, green, magenta, red, blue, black as BT.601
+  * (studio range) YUV and as full range RGB.
+  */
+static const uint8_t BAR_YUV[8][3] = {
+	{ 235, 128, 128 },
+	{ 210,  16, 146 },
+	{ 170, 166,  16 },
+	{ 145,  54,  34 },
+	{ 106, 202, 222 },
+	{  81,  90, 240 },
+	{  41, 240, 110 },
+	{  16, 128, 128 },
+};
+
+static const uint8_t BAR_RGB[8][3] = {
+	{ 255, 255, 255 },
+	{ 255, 255,   0 },
+	{   0, 255, 255 },
+	{   0, 255,   0 },
+	{ 255,   0, 255 },
+	{ 255,   0,   0 },
+	{   0,   0, 255 },
+	{   0,   0,   0 },
+};
+
+
+static inline int _bar( unsigned c, unsigned w, uint32_t sequence ) {
+	return ( ( ( c + sequence*SCROLL_PER_FRAME ) % w ) * 8 ) / w;
+}
+
+
+/**
+  * Non-zero if column c of the counter overlay is a set bit.
+  */
+static inline bool _bit( unsigned c, unsigned w, uint32_t sequence ) {
+	const unsigned B = ( c * 32 ) / w;
+	return ( sequence >> ( 31 - B ) ) & 1;
+}
+
+
+static void _yuyv( const struct synthetic *sy, uint32_t sequence, uint8_t *o ) {
+
+	const unsigned W = sy->spec.width;
+	const unsigned H = sy->spec.height;
+	unsigned r, c;
+
+	// Bars are constant down the frame, so generate one row...
+
+	for(c = 0; c + 1 < W; c += 2 ) {
+		const uint8_t *b0 = BAR_YUV[ _bar( c+0, W, sequence ) ];
+		const uint8_t *b1 = BAR_YUV[ _bar( c+1, W, sequence ) ];
+		o[2*c+0] = b0[0];
+		o[2*c+1] = b0[1];
+		o[2*c+2] = b1[0];
+		o[2*c+3] = b0[2];
+	}
+
+	// ...and replicate it.
+
+	for(r = 1; r < H; r++ )
+		memcpy( o + r*2*W, o, 2*W );
+
+	if( sy->pattern == PATTERN_COUNTER ) {
+		for(c = 0; c + 1 < W; c += 2 ) {
+			const uint8_t Y = _bit( c, W, sequence ) ? 235 : 16;
+			o[2*c+0] = Y;
+			o[2*c+1] = 128;
+			o[2*c+2] = Y;
+			o[2*c+3] = 128;
+		}
+		for(r = 1; r < COUNTER_ROWS && r < H; r++ )
+			memcpy( o + r*2*W, o, 2*W );
+	}
+}
+
+
+static void _grey( const struct synthetic *sy, uint32_t sequence, uint8_t *o ) {
+
+	const unsigned W = sy->spec.width;
+	const unsigned H = sy->spec.height;
+	unsigned r, c;
+
+	for(c = 0; c < W; c++ )
+		o[c] = BAR_YUV[ _bar( c, W, sequence ) ][0];
+	for(r = 1; r < H; r++ )
+		memcpy( o + r*W, o, W );
+
+	if( sy->pattern == PATTERN_COUNTER ) {
+		for(c = 0; c < W; c++ )
+			o[c] = _bit( c, W, sequence ) ? 255 : 0;
+		for(r = 1; r < COUNTER_ROWS && r < H; r++ )
+			memcpy( o + r*W, o, W );
+	}
+}
+
+
+/**
+  * NV12 and NV16: the bars' luma plane followed by their interleaved CbCr
+  * plane, of half (NV12) or full (NV16) the height.
+  */
+static void _nv( const struct synthetic *sy, uint32_t sequence, uint8_t *o ) {
+
+	const unsigned W = sy->spec.width;
+	const unsigned H = sy->spec.height;
+	uint8_t *uv = o + W*H;
+	unsigned rows[ VIDEO_FRAME_PLANES ];
+	unsigned r, c;
+
+	fourcc_planes( fourcc_integer( sy->spec.pixel_format ), H, rows );
+
+	for(c = 0; c < W; c++ )
+		o[c] = BAR_YUV[ _bar( c, W, sequence ) ][0];
+	for(r = 1; r < H; r++ )
+		memcpy( o + r*W, o, W );
+
+	for(c = 0; c + 1 < W; c += 2 ) {
+		const uint8_t *b = BAR_YUV[ _bar( c, W, sequence ) ];
+		uv[c+0] = b[1];
+		uv[c+1] = b[2];
+	}
+	for(r = 1; r < rows[1]; r++ )
+		memcpy( uv + r*W, uv, W );
+
+	if( sy->pattern == PATTERN_COUNTER ) {
+		for(c = 0; c < W; c++ )
+			o[c] = _bit( c, W, sequence ) ? 235 : 16;
+		for(r = 1; r < COUNTER_ROWS && r < H; r++ )
+			memcpy( o + r*W, o, W );
+		for(r = 0; r < rows[1] && r*H < COUNTER_ROWS*rows[1]; r++ )
+			memset( uv + r*W, 128, W );
+	}
+}
+
+
+/**
+  * BGGR (BA81) mosaic of the RGB bars: B G on even rows, G R on odd.
+  */
+static void _ba81( const struct synthetic *sy, uint32_t sequence, uint8_t *o ) {
+
+	const unsigned W = sy->spec.width;
+	const unsigned H = sy->spec.height;
+	unsigned r, c;
+
+	for(r = 0; r < 2; r++ ) {
+		for(c = 0; c < W; c++ ) {
+			const uint8_t *rgb = BAR_RGB[ _bar( c, W, sequence ) ];
+			const int CH = ( r & 1 ) == 0
+				? ( ( c & 1 ) ? 1 : 2 )
+				: ( ( c & 1 ) ? 0 : 1 );
+			o[ r*W + c ] = rgb[ CH ];
+		}
+	}
+	for(r = 2; r < H; r++ )
+		memcpy( o + r*W, o + (r & 1)*W, W );
+
+	if( sy->pattern == PATTERN_COUNTER ) {
+		for(c = 0; c < W; c++ )
+			o[c] = _bit( c, W, sequence ) ? 255 : 0;
+		for(r = 1; r < COUNTER_ROWS && r < H; r++ )
+			memcpy( o + r*W, o, W );
+	}
+}
+
+
+static void _noise( uint32_t sequence, uint8_t *o, size_t n ) {
+
+	uint32_t x = ( sequence + 1 ) * 2654435761U;
+	size_t i;
+
+	for(i = 0; i < n; i++ ) {
+		// xorshift32
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		o[i] = (uint8_t)x;
+	}
+}
+
+
+/***************************************************************************
+  * softcap_source implementation
+  */
+
+static int _config( struct softcap *sc, struct video_format *pref, int n ) {
+
+	struct synthetic *sy = sc->context;
+	const uint32_t FOURCC_CODE
+		= fourcc_integer( sy->spec.pixel_format );
+	unsigned rows[ VIDEO_FRAME_PLANES ];
+	const int PLANES
+		= fourcc_planes( FOURCC_CODE, sy->spec.height, rows );
+	const size_t SIZE
+		= sy->spec.width * ( PLANES > 1 ? rows[0] + rows[1] : rows[0] )
+		* ( FOURCC_CODE == fourcc_integer( "YUYV" ) ? 2 : 1 );
+	int i, selection = -1;
+
+	for(i = 0; i < n && selection < 0; i++ ) {
+		if( pref[i].width  == sy->spec.width
+		 && pref[i].height == sy->spec.height
+		 && strcmp( pref[i].pixel_format, sy->spec.pixel_format ) == 0 )
+			selection = i;
+	}
+
+	sc->format = sy->spec;
+	if( softcap_buffers( sc, sc->buffer_count, SIZE ) <= 0 )
+		return -2;
+	return selection;
+}
+
+
+static int _fill( struct softcap *sc, uint32_t sequence, int buffer_id ) {
+
+	struct synthetic *sy = sc->context;
+	struct softcap_buffer *b
+		= sc->buffer + buffer_id;
+	const uint32_t FOURCC_CODE
+		= fourcc_integer( sy->spec.pixel_format );
+
+	if( sy->pattern == PATTERN_NOISE )
+		_noise( sequence, b->mem, b->length );
+	else
+	if( FOURCC_CODE == fourcc_integer( "YUYV" ) )
+		_yuyv( sy, sequence, b->mem );
+	else
+	if( FOURCC_CODE == fourcc_integer( "BA81" ) )
+		_ba81( sy, sequence, b->mem );
+	else
+	if( FOURCC_CODE == fourcc_integer( "NV12" )
+	 || FOURCC_CODE == fourcc_integer( "NV16" ) )
+		_nv( sy, sequence, b->mem );
+	else
+		_grey( sy, sequence, b->mem );
+	return 0;
+}
+
+
+static bool _due( struct softcap *sc, uint32_t sequence, struct timespec *offset ) {
+
+	const struct synthetic *sy = sc->context;
+	uint64_t ns;
+
+	if( sy->fps == 0 )
+		return false;
+	ns = ( (uint64_t)sequence * 1000000000ULL ) / sy->fps;
+	offset->tv_sec  = ns / 1000000000ULL;
+	offset->tv_nsec = ns % 1000000000ULL;
+	return true;
+}
+
+
+static void _destroy( struct softcap *sc ) {
+	free( sc->context );
+}
+
+
+static const struct softcap_source _source = {
+	.config  = _config,
+	.fill    = _fill,
+	.due     = _due,
+	.destroy = _destroy,
+};
+
+
+struct video_capture *video_synthetic_open( const char *spec ) {
+
+	struct video_capture *vci = NULL;
+	struct synthetic *sy;
+	char fcc[5], pattern[16] = "bars";
+	unsigned w, h, fps = 0;
+	const char *p;
+	int n = 0;
+
+	if( sscanf( spec, "%ux%u:%4[A-Z0-9]%n", &w, &h, fcc, &n ) != 3 ) {
+		warnx( "bad synthetic spec \"%s\"", spec );
+		return NULL;
+	}
+	p = spec + n;
+	if( *p == '@' ) {
+		if( sscanf( p, "@%u%n", &fps, &n ) != 1 ) {
+			warnx( "bad frame rate in \"%s\"", spec );
+			return NULL;
+		}
+		p += n;
+	}
+	if( *p == ':' )
+		snprintf( pattern, sizeof(pattern), "%s", p + 1 );
+	else
+	if( *p != '\0' ) {
+		warnx( "trailing garbage in \"%s\"", spec );
+		return NULL;
+	}
+
+	if( strcmp( fcc, "YUYV" ) && strcmp( fcc, "GREY" ) && strcmp( fcc, "BA81" )
+	 && strcmp( fcc, "NV12" ) && strcmp( fcc, "NV16" ) ) {
+		warnx( "unsupported synthetic format %s", fcc );
+		return NULL;
+	}
+	if( w < 2 || h < 2 || ( w & 1 ) ) {
+		warnx( "unsupported synthetic size %ux%u", w, h );
+		return NULL;
+	}
+
+	sy = calloc( 1, sizeof(struct synthetic) );
+	if( sy == NULL )
+		return NULL;
+	sy->spec.width  = w;
+	sy->spec.height = h;
+	strcpy( sy->spec.pixel_format, fcc );
+	sy->fps = fps;
+	sy->spec.fps = fps;
+
+	if( strcmp( pattern, "bars" ) == 0 )
+		sy->pattern = PATTERN_BARS;
+	else
+	if( strcmp( pattern, "counter" ) == 0 )
+		sy->pattern = PATTERN_COUNTER;
+	else
+	if( strcmp( pattern, "noise" ) == 0 )
+		sy->pattern = PATTERN_NOISE;
+	else {
+		warnx( "unknown synthetic pattern \"%s\"", pattern );
+		free( sy );
+		return NULL;
+	}
+
+	vci = softcap_create( &_source, sy, fps > 0 );
+	if( vci == NULL ) {
+		free( sy );
+		return NULL;
+	}
+	// The format is known before config, as if it were the driver's
+	// default.
+	((struct softcap*)vci)->format = sy->spec;
+	return vci;
+}
+
@@ -29,9 +29,10 @@
   * directly related to V4L2 management of a video stream, is kept OUT of
   * this module.
   *
-  * It also provides the implementation of the "replay" mode for offline
-  * analysis of images. That is, it can read in a series of PGM images
-  * and deliver them to sm.c as if they were dequeued video frame.
+  * It also routes "replay:" paths to the implementation of the "replay"
+  * mode for offline analysis of images (replay.c). That is, a series of
+  * PGM images can be delivered to sm.c as if they were dequeued video
+  * frames.
   *
   * Finally, the unit test for this module constitutes just about the
   * simplest possible code to stream video to an X11 window...useful in
@@ -92,6 +93,8 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 #include <fcntl.h>     // for O_RDWR | O_NONBLOCK
 #include <sys/types.h>
@@ -99,6 +102,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 
 #include <errno.h>
 #include <err.h>
@@ -109,23 +113,72 @@
 #include "video.h"
 #include "vidfrm.h"
 #include "vidfmt.h"
+#include "vidstats.h"
+#include "vidtrace.h"
 #include "fourcc.h"
 
-#define USE_SELECT (1)
-
 /**
   * externs
   */
 
+/**
+  * Compile-time checks of the struct video_frame overlay (see vidfrm.h).
+  */
+#define STATIC_ASSERT(cond,tag) typedef char static_assert_##tag[ (cond) ? 1 : -1 ]
+#define SAME_OFFSET(a,b) \
+	( offsetof( struct video_frame, a ) == offsetof( struct v4l2_buffer, b ) )
+
+STATIC_ASSERT( SAME_OFFSET( buffer_id, index ),     buffer_id );
+STATIC_ASSERT( SAME_OFFSET( bytesused, bytesused ), bytesused );
+STATIC_ASSERT( SAME_OFFSET( flags,     flags ),     flags );
+STATIC_ASSERT( SAME_OFFSET( field,     field ),     field );
+STATIC_ASSERT( SAME_OFFSET( timestamp, timestamp ), timestamp );
+STATIC_ASSERT( SAME_OFFSET( sequence,  sequence ),  sequence );
+STATIC_ASSERT( SAME_OFFSET( mem,       m ),         mem );
+STATIC_ASSERT( SAME_OFFSET( length,    length ),    length );
+STATIC_ASSERT( sizeof(void*) <= sizeof(((struct v4l2_buffer*)0)->m), mem_size );
+STATIC_ASSERT( offsetof( struct video_frame, gap ) >= sizeof(struct v4l2_buffer), overlay );
+
+/**
+  * ...and that the members of the single- and multi-planar pixel formats
+  * that everything but buffer layout deals in coincide, so that fmt.pix
+  * serves for both.
+  */
+#define SAME_PIX(a) \
+	( offsetof( struct v4l2_pix_format, a ) == offsetof( struct v4l2_pix_format_mplane, a ) )
+
+STATIC_ASSERT( SAME_PIX( width ),       pix_width );
+STATIC_ASSERT( SAME_PIX( height ),      pix_height );
+STATIC_ASSERT( SAME_PIX( pixelformat ), pix_pixelformat );
+STATIC_ASSERT( SAME_PIX( field ),       pix_field );
+
 
 /**
   * The minimal information returned by VIDIOC_QUERYBUF necessary
-  * to support buffer (un)mapping via mmap and munmap.
+  * to support buffer (un)mapping via mmap and munmap, plus the DMABUF
+  * descriptor (if the driver supports VIDIOC_EXPBUF) through which the
+  * same memory can be handed to other components without copying.
+  * Multi-planar drivers may give a buffer several separately mapped
+  * planes; otherwise only plane[0] is used.
   */
 struct frame_buffer {
 	int    index;
-	void  *address;
-	size_t length;
+	struct {
+		void  *address;
+		size_t length;
+		int    dmabuf;
+	} plane[ VIDEO_FRAME_PLANES ];
+};
+
+/**
+  * Where an image plane lies: in which of a frame_buffer's planes, and
+  * where within it.
+  */
+struct plane_layout {
+	int      buffer;
+	size_t   offset;
+	uint32_t stride;
+	size_t   size;
 };
 
 #define MAXLEN_DEVPATH (63)
@@ -144,27 +197,99 @@ struct video_state {
 	  */
 	int fd;
 
+	/**
+	  * V4L2_BUF_TYPE_VIDEO_CAPTURE or, for devices that only offer the
+	  * multi-planar API, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE.
+	  */
+	enum v4l2_buf_type type;
+
 	/**
 	  * Configured video.
 	  */
 	struct video_format format;
 
-	long dequeue_timeout;
+	/**
+	  * Image planes of the configured format and the buffer planes
+	  * (1 unless the multi-planar driver separates them) they lie in.
+	  */
+	int planes;
+	int buffer_planes;
+	struct plane_layout layout[ VIDEO_FRAME_PLANES ];
+
+	/**
+	  * Every mode (format, size and frame rate) the device enumerated at
+	  * open, so that config can choose without trial and error. Empty if
+	  * the driver doesn't support enumeration.
+	  */
+	struct video_format *mode;
+	int mode_count;
+
+	/**
+	  * Parallel to mode: the stepwise or continuous frame size range a
+	  * mode is an extreme of, all zero for discrete sizes.
+	  */
+	struct v4l2_frmsize_stepwise *range;
+
+	/**
+	  * V4L2_MEMORY_MMAP (driver buffers) unless the client provided an
+	  * arena via video_capture.userptr, in which case frames are carved
+	  * out of [arena, arena+arena_size).
+	  */
+	enum v4l2_memory memory;
+	uint8_t *arena;
+	size_t   arena_size;
+
+	/**
+	  * Milliseconds _dequeue waits when called with
+	  * VIDEO_DEQ_TIMEOUT_DEFAULT.
+	  */
+	int dequeue_timeout;
+
+	/**
+	  * The epoll instance _dequeue waits on, created once by _start
+	  * so that nothing is rebuilt per frame. -1 when not streaming.
+	  */
+	int epfd;
 
 	/**
 	  * bit flags indicating which of frames are queued
 	  * (owned by kernel)
+	  * Leases may be released (and so buffers enqueued) from any thread,
+	  * so this is only modified with atomic read-modify-writes.
+	  */
+	uint64_t queued;
+
+	/**
+	  * The sequence number expected of the next frame dequeued, once
+	  * any has been, from which frame gaps are computed.
+	  */
+	uint32_t next_sequence;
+	bool     sequenced;
+
+	struct video_stats stats;
+
+	/**
+	  * Buffers config requests, and how many _dequeue may grow that to
+	  * when the consumer falls behind (see video_capture.buffers).
 	  */
-	uint32_t queued;
+	int buffer_count;
+	int buffer_max;
 
 	/**
 	  * The items in .frame correspond (in index) to items in a similar
 	  * array maintained in the V4L2 kernel driver. We use the indices
 	  * when communicating (de)queue intentions to the kernel.
+	  * Only ever grows while streaming, and then only after the new
+	  * frame_buffer is complete.
 	  */
 	int frame_count;
 
-	struct frame_buffer frame[ VIDEO_MAX_FRAME ];
+	struct frame_buffer frame[ VIDEO_MAX_BUFFERS ];
+
+	/**
+	  * At most one lease per buffer exists at a time.
+	  */
+	struct video_lease lease[ VIDEO_MAX_BUFFERS ];
 };
 typedef struct video_state video_state_t;
 typedef const video_state_t VIDEO_STATE_T;
@@ -185,8 +310,8 @@ static void _dump( struct video_state *vs, FILE *fp) {
 		"\t  height: %d\n"
 		"\t  format: %s\n"
 		"\t}\n"
-		"deq.timeout: %ld\n"
-		"     queued: %08X\n"
+		"deq.timeout: %dms\n"
+		"     queued: %016lX\n"
 		"frame_count: %d\n",
 		vs->name,
 		vs->fd,
@@ -194,10 +319,10 @@ static void _dump( struct video_state *vs, FILE *fp) {
 		vs->format.height,
 		vs->format.pixel_format,
 		vs->dequeue_timeout,
-		vs->queued,
+		(unsigned long)vs->queued,
 		vs->frame_count );
 	for(int i = 0; i < vs->frame_count; i++ ) {
-		fprintf( fp, "frames[%d].length: %ld\n", i, vs->frame[i].length );
+		fprintf( fp, "frames[%d].length: %ld\n", i, vs->frame[i].plane[0].length );
 	}
 	fprintf( fp, "}\n" );
 }
@@ -219,32 +344,140 @@ static inline int iioctl( int fh, int request, void *arg ) {
 static int _unmap_frames( int n, struct frame_buffer *arr ) {
 	int err = 0;
 	while( n-- > 0 ) {
-		void *address
-			= arr[n].address;
-		off_t length
-			= arr[n].length;
-		if( munmap( address, length ) < 0 ) {
-			warn( "munmap( %p, %ld )", 
-				address, length ); // ...but keep going.
-			err = -1;
+		int j;
+		for(j = 0; j < VIDEO_FRAME_PLANES; j++ ) {
+			void *address
+				= arr[n].plane[j].address;
+			off_t length
+				= arr[n].plane[j].length;
+			if( address && munmap( address, length ) < 0 ) {
+				warn( "munmap( %p, %ld )", 
+					address, length ); // ...but keep going.
+				err = -1;
+			}
+			arr[n].plane[j].address = NULL;
+			if( arr[n].plane[j].dmabuf >= 0 ) {
+				close( arr[n].plane[j].dmabuf );
+				arr[n].plane[j].dmabuf = -1;
+			}
 		}
 	}
 	return err;
 }
 
 
+/**
+  * Maps kernel buffer n (already created by VIDIOC_REQBUFS or
+  * VIDIOC_CREATE_BUFS) into user space and exports its DMABUF, one of
+  * each per plane of a multi-planar buffer.
+  */
+static int _map_frame( VIDEO_STATE_T *vs, int n, struct frame_buffer *frame ) {
+
+	const bool MPLANE
+		= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type;
+	struct v4l2_plane planes[ VIDEO_FRAME_PLANES ];
+	struct v4l2_buffer buf = {
+		.index = n,
+		.type = vs->type,
+		//.bytesused = 0,
+		//.flags = 0,
+		//.field = 0,
+		//.timestamp, // struct timeval
+		//.timecode,  // struct v4l2_timecode	
+		//.sequence = 0,
+		.memory = V4L2_MEMORY_MMAP,
+		//.m.offset = 0,
+		//.length   = 0,
+		//.input    = 0,
+		//.reserved = 0
+	};
+	int j, count = 1;
+
+	for(j = 0; j < VIDEO_FRAME_PLANES; j++ ) {
+		frame->plane[j].address = NULL;
+		frame->plane[j].length  = 0;
+		frame->plane[j].dmabuf  = -1;
+	}
+	if( MPLANE ) {
+		memset( planes, 0, sizeof(planes) );
+		buf.m.planes = planes;
+		buf.length   = VIDEO_FRAME_PLANES;
+	}
+
+	if( iioctl( vs->fd, VIDIOC_QUERYBUF, &buf ) < 0 ) {
+		warn("VIDIOC_QUERYBUF");
+		return -1;
+	}
+
+	//assert( (buf.flags & V4L2_BUF_FLAG_MAPPED ) != 0 );
+	assert( (buf.flags & V4L2_BUF_FLAG_QUEUED ) == 0 );
+	assert( (buf.flags & V4L2_BUF_FLAG_DONE   ) == 0 );
+
+	if( MPLANE && (count = buf.length) != vs->buffer_planes ) {
+		warnx( "buffer %d has %d planes, expected %d",
+			n, count, vs->buffer_planes );
+		return -1;
+	}
+
+	for(j = 0; j < count; j++ ) {
+
+		const uint32_t LENGTH
+			= MPLANE ? planes[j].length : buf.length;
+		const uint32_t OFFSET
+			= MPLANE ? planes[j].m.mem_offset : buf.m.offset;
+		void *address
+			= mmap(NULL,                // start anywhere (in userspace)
+				LENGTH,                 // dictated by driver
+				PROT_READ | PROT_WRITE, // required
+				MAP_SHARED,             // recommended
+				vs->fd, 
+				OFFSET );               // a "handle" provided by driver
+
+		if( MAP_FAILED == address ) {
+			warn( "mmap( NULL, length=%d,..., fd=%d, offset=%d )", 
+				LENGTH, vs->fd, OFFSET );
+			_unmap_frames( 1, frame ); // ...planes already mapped
+			return -1;
+		}
+		frame->plane[j].address = address;
+		frame->plane[j].length  = LENGTH;
+
+		/**
+		  * Export once, here, so that per-frame handles are free.
+		  * Not all drivers support this, and it is not an error if
+		  * they don't.
+		  */
+		{
+			struct v4l2_exportbuffer exp = {
+				.type  = vs->type,
+				.index = n,
+				.plane = j,
+				.flags = O_RDONLY | O_CLOEXEC,
+			};
+			if( iioctl( vs->fd, VIDIOC_EXPBUF, &exp ) < 0 ) {
+				if( n == 0 && j == 0 )
+					warn( "VIDIOC_EXPBUF (DMABUF export unavailable)" );
+			} else
+				frame->plane[j].dmabuf = exp.fd;
+		}
+	}
+	frame->index = n;
+	return 0;
+}
+
+
 /**
   * This requests V4L2 to create some number of kernel buffers
   * and then maps those buffers into user space for copy-free
   * access to video frames.
   */
-static int _map_frames( int fd, int count, struct frame_buffer *frame ) {
+static int _map_frames( VIDEO_STATE_T *vs, int count, struct frame_buffer *frame ) {
 
 	int n = 0;
 
 	struct v4l2_requestbuffers req = {
 		.count  = count,
-		.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.type   = vs->type,
 		.memory = V4L2_MEMORY_MMAP,
 		.reserved = {
 			0,
@@ -252,56 +485,17 @@ static int _map_frames( int fd, int count, struct frame_buffer *frame ) {
 		}
 	};
 
-	if( iioctl( fd, VIDIOC_REQBUFS, &req) < 0 ) {
+	if( iioctl( vs->fd, VIDIOC_REQBUFS, &req) < 0 ) {
 		warn( "VIDIOC_REQBUFS(%d)\n", count );
 		return -1;
 	}
 
-	for(n = 0; n < req.count; ++n ) {
+	// Drivers may insist on more than requested; any beyond what we
+	// can track simply go unused.
 
-		struct v4l2_buffer buf = {
-			.index = n,
-			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			//.bytesused = 0,
-			//.flags = 0,
-			//.field = 0,
-			//.timestamp, // struct timeval
-			//.timecode,  // struct v4l2_timecode	
-			//.sequence = 0,
-			.memory = V4L2_MEMORY_MMAP,
-			//.m.offset = 0,
-			//.length   = 0,
-			//.input    = 0,
-			//.reserved = 0
-		};
-		/*memset( &buf, 0, sizeof(buf) );
-		buf.index = n;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;*/
-
-		if( iioctl( fd, VIDIOC_QUERYBUF, &buf ) < 0 ) {
-			warn("VIDIOC_QUERYBUF");
+	for(n = 0; n < req.count && n < VIDEO_MAX_BUFFERS; ++n ) {
+		if( _map_frame( vs, n, frame + n ) )
 			goto failure;
-		}
-
-		//assert( (buf.flags & V4L2_BUF_FLAG_MAPPED ) != 0 );
-		assert( (buf.flags & V4L2_BUF_FLAG_QUEUED ) == 0 );
-		assert( (buf.flags & V4L2_BUF_FLAG_DONE   ) == 0 );
-
-		frame[ n ].address
-			= mmap(NULL,                // start anywhere (in userspace)
-				buf.length,             // dictated by driver
-				PROT_READ | PROT_WRITE, // required
-				MAP_SHARED,             // recommended
-				fd, 
-				buf.m.offset );         // a "handle" provided by driver
-
-		if( MAP_FAILED == frame[ n ].address ) {
-			warn( "mmap( NULL, length=%d,..., fd=%d, offset=%d )", 
-				buf.length, fd, buf.m.offset );
-			goto failure;
-		}
-		frame[ n ].length = buf.length;
 	}
 
 	return n;
@@ -314,14 +508,161 @@ failure:
 }
 
 
-static inline bool _is_queued( VIDEO_STATE_T *vs, int i ) {
-	assert( 0 <= i && i < VIDEO_MAX_FRAME );
-	return ( vs->queued & (1<<i) ) != 0;
+/**
+  * The USERPTR counterpart of _map_frames: requests up to count buffers
+  * and assigns each a page-aligned slot of sizeimage bytes in the arena.
+  */
+static int _slice_arena( video_state_t *vs, int count, size_t sizeimage ) {
+
+	const size_t PAGE
+		= sysconf( _SC_PAGESIZE );
+	const size_t SLOT
+		= ( sizeimage + PAGE - 1 ) & ~( PAGE - 1 );
+	const uintptr_t BASE
+		= ( (uintptr_t)vs->arena + PAGE - 1 ) & ~( PAGE - 1 );
+	const size_t USABLE
+		= vs->arena_size - ( BASE - (uintptr_t)vs->arena );
+
+	struct v4l2_requestbuffers req = {
+		.type   = vs->type,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+	int n;
+
+	if( vs->buffer_planes > 1 ) {
+		warnx( "arenas only support formats with single-buffer planes" );
+		return -1;
+	}
+	if( sizeimage == 0 || vs->arena_size < ( BASE - (uintptr_t)vs->arena ) ) {
+		warnx( "unusable arena" );
+		return -1;
+	}
+	req.count = USABLE / SLOT < count ? USABLE / SLOT : count;
+	if( req.count == 0 ) {
+		warnx( "arena (%zu bytes) too small for a %zu-byte frame",
+			vs->arena_size, sizeimage );
+		return -1;
+	}
+
+	if( iioctl( vs->fd, VIDIOC_REQBUFS, &req) < 0 ) {
+		warn( "VIDIOC_REQBUFS(%d, USERPTR)\n", req.count );
+		return -1;
+	}
+
+	// Drivers may raise the count to their minimum, which the arena (or
+	// frame[]) may not have room for.
+
+	if( req.count > USABLE / SLOT || req.count > VIDEO_MAX_BUFFERS ) {
+		warnx( "arena too small for the driver's minimum of %d buffers",
+			req.count );
+		req.count = 0;
+		if( iioctl( vs->fd, VIDIOC_REQBUFS, &req ) < 0 )
+			warn( "VIDIOC_REQBUFS(0, USERPTR)" );
+		return -1;
+	}
+
+	for(n = 0; n < req.count; ++n ) {
+		int j;
+		memset( vs->frame + n, 0, sizeof(vs->frame[n]) );
+		vs->frame[ n ].index = n;
+		vs->frame[ n ].plane[0].address = (void*)( BASE + n*SLOT );
+		vs->frame[ n ].plane[0].length  = sizeimage;
+		for(j = 0; j < VIDEO_FRAME_PLANES; j++ )
+			vs->frame[ n ].plane[j].dmabuf = -1;
+	}
+
+	return n;
+}
+
+
+/**
+  * Fills in the memory- and buffer-type-dependent fields of a v4l2_buffer
+  * about to be passed to VIDIOC_QBUF. Multi-planar buffers describe their
+  * planes in the caller's planes (of VIDEO_FRAME_PLANES).
+  */
+static inline void _prepare_qbuf( VIDEO_STATE_T *vs, struct v4l2_buffer *buf,
+		struct v4l2_plane *planes ) {
+
+	const struct frame_buffer *f
+		= vs->frame + buf->index;
+
+	buf->memory = vs->memory;
+	if( V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type ) {
+		memset( planes, 0, VIDEO_FRAME_PLANES*sizeof(*planes) );
+		buf->m.planes = planes;
+		buf->length   = vs->buffer_planes;
+		if( V4L2_MEMORY_USERPTR == vs->memory ) {
+			planes[0].m.userptr = (unsigned long)f->plane[0].address;
+			planes[0].length    = f->plane[0].length;
+		}
+	} else
+	if( V4L2_MEMORY_USERPTR == vs->memory ) {
+		buf->m.userptr = (unsigned long)f->plane[0].address;
+		buf->length    = f->plane[0].length;
+	}
+}
+
+
+/**
+  * Computes where each image plane of the format in effect lies in a
+  * frame_buffer. Formats whose planes the driver puts in separate
+  * buffers must have as many buffers as image planes.
+  */
+static int _layout( video_state_t *vs, const struct v4l2_format *fmt ) {
+
+	const bool MPLANE
+		= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type;
+	unsigned rows[ VIDEO_FRAME_PLANES ];
+	size_t offset = 0;
+	int i;
+
+	vs->planes = fourcc_planes( fmt->fmt.pix.pixelformat,
+		fmt->fmt.pix.height, rows );
+	vs->buffer_planes = MPLANE ? fmt->fmt.pix_mp.num_planes : 1;
+
+	if( vs->buffer_planes < 1 || vs->buffer_planes > VIDEO_FRAME_PLANES
+	 || ( vs->buffer_planes > 1 && vs->buffer_planes != vs->planes ) ) {
+		warnx( "unsupported layout: %d image planes in %d buffer planes",
+			vs->planes, vs->buffer_planes );
+		return -1;
+	}
+
+	for(i = 0; i < vs->planes; i++ ) {
+		struct plane_layout *L
+			= vs->layout + i;
+		if( vs->buffer_planes > 1 ) {
+			L->buffer = i;
+			L->offset = 0;
+			L->stride = fmt->fmt.pix_mp.plane_fmt[i].bytesperline;
+		} else {
+			L->buffer = 0;
+			L->offset = offset;
+			L->stride = MPLANE
+				? fmt->fmt.pix_mp.plane_fmt[0].bytesperline
+				: fmt->fmt.pix.bytesperline;
+		}
+		L->size = (size_t)L->stride * rows[i];
+		offset += L->size;
+	}
+	return 0;
+}
+
+
+/**
+  * Marks a buffer queued before it's handed to the driver, so that a
+  * dequeue on another thread can't clear the bit before it's set.
+  * Returns false if the buffer was already marked (queued, or being
+  * queued by another thread).
+  */
+static inline bool _claim_queued( video_state_t *vs, int i ) {
+	const uint64_t BIT = (uint64_t)1 << i;
+	assert( 0 <= i && i < VIDEO_MAX_BUFFERS );
+	return ( __atomic_fetch_or( &vs->queued, BIT, __ATOMIC_RELAXED ) & BIT ) == 0;
 }
 
 static inline void _set_unqueued( video_state_t *vs, int i ) {
-	assert( 0 <= i && i < VIDEO_MAX_FRAME );
-	vs->queued &= (~(1 << i));
+	assert( 0 <= i && i < VIDEO_MAX_BUFFERS );
+	__atomic_fetch_and( &vs->queued, ~((uint64_t)1 << i), __ATOMIC_RELAXED );
 }
 
 /***************************************************************************
@@ -335,15 +676,177 @@ const struct video_format * _format( struct video_capture *vci ) {
 }
 
 
-static int _config( struct video_capture *vci, struct video_format *pref, int n ) {
+/**
+  * Appends a mode to the cache. range is the size range it belongs to,
+  * or NULL if its size is discrete.
+  */
+static int _add_mode( video_state_t *vs, uint32_t fourcc,
+		unsigned w, unsigned h, unsigned fps,
+		const struct v4l2_frmsize_stepwise *range ) {
+
+	struct video_format *m;
+
+	if( ( vs->mode_count & 15 ) == 0 ) {
+		struct v4l2_frmsize_stepwise *r;
+		m = realloc( vs->mode, ( vs->mode_count + 16 )*sizeof(*m) );
+		if( m == NULL ) {
+			warn( "caching video modes" );
+			return -1;
+		}
+		vs->mode = m;
+		r = realloc( vs->range, ( vs->mode_count + 16 )*sizeof(*r) );
+		if( r == NULL ) {
+			warn( "caching video modes" );
+			return -1;
+		}
+		vs->range = r;
+	}
+	if( range )
+		vs->range[ vs->mode_count ] = *range;
+	else
+		memset( vs->range + vs->mode_count, 0, sizeof(*range) );
+	m = vs->mode + vs->mode_count++;
+	m->width  = w;
+	m->height = h;
+	m->fps    = fps;
+	strcpy( m->pixel_format, fourcc_string( fourcc ) );
+	return 0;
+}
 
-	struct video_state *vs
-		= (struct video_state*)vci;
-	int i, selection = -1;
-	struct v4l2_format fmt;
 
-	memset(&fmt, 0, sizeof(fmt));
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+static inline unsigned _fps( const struct v4l2_fract *interval ) {
+	return interval->numerator
+		? ( interval->denominator + interval->numerator/2 ) / interval->numerator
+		: 0;
+}
+
+
+/**
+  * Caches the frame rates of one frame size. Stepwise and continuous
+  * ranges are represented by their extremes; so are size ranges, but
+  * those modes also carry the range (see _fit).
+  */
+static int _enumerate_intervals( video_state_t *vs, uint32_t fourcc,
+		unsigned w, unsigned h, const struct v4l2_frmsize_stepwise *range ) {
+
+	struct v4l2_frmivalenum fi;
+	int found = 0;
+
+	memset( &fi, 0, sizeof(fi) );
+	fi.pixel_format = fourcc;
+	fi.width  = w;
+	fi.height = h;
+
+	while( iioctl( vs->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi ) == 0 ) {
+		if( V4L2_FRMIVAL_TYPE_DISCRETE == fi.type ) {
+			if( _add_mode( vs, fourcc, w, h, _fps( &fi.discrete ), range ) )
+				return -1;
+		} else {
+			if( _add_mode( vs, fourcc, w, h, _fps( &fi.stepwise.min ), range )
+			 || _add_mode( vs, fourcc, w, h, _fps( &fi.stepwise.max ), range ) )
+				return -1;
+			break;
+		}
+		found++;
+		fi.index++;
+	}
+
+	// No rates enumerated still leaves a usable size.
+
+	return found ? 0 : _add_mode( vs, fourcc, w, h, 0, range );
+}
+
+
+/**
+  * Enumerates (once, at open) every pixel format, frame size and frame
+  * interval the device offers.
+  */
+static void _enumerate( video_state_t *vs ) {
+
+	struct v4l2_fmtdesc fd;
+
+	memset( &fd, 0, sizeof(fd) );
+	fd.type = vs->type;
+
+	while( iioctl( vs->fd, VIDIOC_ENUM_FMT, &fd ) == 0 ) {
+
+		struct v4l2_frmsizeenum fs;
+
+		memset( &fs, 0, sizeof(fs) );
+		fs.pixel_format = fd.pixelformat;
+
+		while( iioctl( vs->fd, VIDIOC_ENUM_FRAMESIZES, &fs ) == 0 ) {
+			if( V4L2_FRMSIZE_TYPE_DISCRETE == fs.type ) {
+				if( _enumerate_intervals( vs, fd.pixelformat,
+						fs.discrete.width, fs.discrete.height, NULL ) )
+					return;
+			} else {
+				if( V4L2_FRMSIZE_TYPE_CONTINUOUS == fs.type ) {
+					fs.stepwise.step_width  = 1;
+					fs.stepwise.step_height = 1;
+				}
+				if( _enumerate_intervals( vs, fd.pixelformat,
+						fs.stepwise.min_width, fs.stepwise.min_height,
+						&fs.stepwise )
+				 || _enumerate_intervals( vs, fd.pixelformat,
+						fs.stepwise.max_width, fs.stepwise.max_height,
+						&fs.stepwise ) )
+					return;
+				break;
+			}
+			fs.index++;
+		}
+		fd.index++;
+	}
+}
+
+
+/**
+  * How poorly mode <have> satisfies preference <want>; 0 is an exact
+  * match. Shortfalls in resolution or frame rate are weighted well above
+  * surpluses, which only cost bandwidth and conversion time in proportion
+  * to the excess pixel rate. A zero dimension or rate in <want> means any.
+  */
+static double _misfit( const struct video_format *want,
+		const struct video_format *have ) {
+
+	const double WANT_W = want->width  ? want->width  : have->width;
+	const double WANT_H = want->height ? want->height : have->height;
+	const double SCALE_W = have->width  / WANT_W;
+	const double SCALE_H = have->height / WANT_H;
+	double cost = 0.0, pixels;
+
+	// Fraction of the wanted area that is missing...
+
+	cost += 4.0 * ( 1.0
+		- ( SCALE_W < 1.0 ? SCALE_W : 1.0 )
+		* ( SCALE_H < 1.0 ? SCALE_H : 1.0 ) );
+
+	// ...and the relative excess pixel rate.
+
+	pixels = SCALE_W * SCALE_H;
+	if( want->fps ) {
+		const double RATE = have->fps ? (double)have->fps / want->fps : 0.5;
+		if( RATE < 1.0 )
+			cost += 4.0 * ( 1.0 - RATE );
+		else
+			pixels *= RATE;
+	}
+	if( pixels > 1.0 )
+		cost += pixels - 1.0;
+
+	return cost;
+}
+
+
+/**
+  * The fallback for drivers that don't enumerate: VIDIOC_S_FMT each
+  * preference in turn until one is accepted exactly.
+  */
+static int _trial( video_state_t *vs, struct video_format *pref, int n,
+		struct v4l2_format *fmt ) {
+
+	int i;
 
 	for(i = 0; i < n; i++ ) {
 
@@ -352,16 +855,16 @@ static int _config( struct video_capture *vci, struct video_format *pref, int n
 		const uint32_t FOURCC_CODE
 			= fourcc_integer( vf->pixel_format );
 
-		fmt.fmt.pix.width	    = vf->width;
-		fmt.fmt.pix.height	    = vf->height;
-		fmt.fmt.pix.pixelformat = FOURCC_CODE;
-		fmt.fmt.pix.field	    = V4L2_FIELD_NONE;
-		//fmt.fmt.pix.bytesperline u32
-		//fmt.fmt.pix.sizeimage    u32
-		//fmt.fmt.pix.colorspace   enum
-		//fmt.fmt.pix.priv         u32
+		fmt->fmt.pix.width	     = vf->width;
+		fmt->fmt.pix.height	     = vf->height;
+		fmt->fmt.pix.pixelformat = FOURCC_CODE;
+		fmt->fmt.pix.field	     = V4L2_FIELD_NONE;
+		//fmt->fmt.pix.bytesperline u32
+		//fmt->fmt.pix.sizeimage    u32
+		//fmt->fmt.pix.colorspace   enum
+		//fmt->fmt.pix.priv         u32
 
-		if( iioctl( vs->fd, VIDIOC_S_FMT, &fmt) < 0 ) {
+		if( iioctl( vs->fd, VIDIOC_S_FMT, fmt) < 0 ) {
 			warn("setting video format: %dx%d,%s", 
 				vf->width, 
 				vf->height, 
@@ -382,28 +885,182 @@ static int _config( struct video_capture *vci, struct video_format *pref, int n
 			= "requested %s: 0x%08x, received 0x%08x";
 
 		if( true /* exact */ ) {
-			if( vf->width != fmt.fmt.pix.width ) {
-				warnx( REQRCV, "width", vf->width, fmt.fmt.pix.width );
+			if( vf->width != fmt->fmt.pix.width ) {
+				warnx( REQRCV, "width", vf->width, fmt->fmt.pix.width );
 				continue;
 			}
-			if( vf->height != fmt.fmt.pix.height ) {
-				warnx( REQRCV, "height", vf->height, fmt.fmt.pix.height );
+			if( vf->height != fmt->fmt.pix.height ) {
+				warnx( REQRCV, "height", vf->height, fmt->fmt.pix.height );
 				continue;
 			}
-			if( FOURCC_CODE != fmt.fmt.pix.pixelformat ) {
-				warnx( REQRCV, "pixel format", vf->pixel_format, fmt.fmt.pix.pixelformat );
+			if( FOURCC_CODE != fmt->fmt.pix.pixelformat ) {
+				warnx( REQRCV, "pixel format", vf->pixel_format, fmt->fmt.pix.pixelformat );
 				continue;
 			}
 		}
 
 		// TODO: Revisit: Validate following struct v4l2_format members:
-		// fmt.fmt.pix.bytesperline
 		// fmt.fmt.pix.sizeimage
 		// fmt.fmt.pix.colorspace
+		// (bytesperline, which drivers may pad, is left to _layout
+		// and reported as format().stride.)
 
-		selection = i;
-		break;
+		return i;
 	}
+	return -1;
+}
+
+
+/**
+  * The size within [lo,hi] on the grid lo + k*step nearest to want, or
+  * the mode's own extreme if want is 0 (any).
+  */
+static unsigned _to_grid( unsigned want, unsigned lo, unsigned hi,
+		unsigned step, unsigned extreme ) {
+
+	if( want == 0 )
+		return extreme;
+	if( want <= lo )
+		return lo;
+	if( want >= hi )
+		return hi;
+	if( step > 1 ) {
+		want = lo + ( want - lo + step/2 ) / step * step;
+		if( want > hi )
+			want -= step;
+	}
+	return want;
+}
+
+
+/**
+  * Mode j as the best candidate for preference <want>: the cached mode
+  * itself, or for a size range the size in it nearest to what's wanted.
+  */
+static struct video_format _fit( VIDEO_STATE_T *vs, int j,
+		const struct video_format *want ) {
+
+	const struct v4l2_frmsize_stepwise *r
+		= vs->range + j;
+	struct video_format m
+		= vs->mode[ j ];
+
+	if( r->max_width > 0 ) {
+		m.width  = _to_grid( want->width,
+			r->min_width, r->max_width, r->step_width, m.width );
+		m.height = _to_grid( want->height,
+			r->min_height, r->max_height, r->step_height, m.height );
+	}
+	return m;
+}
+
+
+/**
+  * Chooses the cached mode best fitting any of the preferences (ties go
+  * to the earlier preference) and sets it with a single VIDIOC_S_FMT.
+  * Only the pixel format must match exactly. Should the driver refuse
+  * what it enumerated, falls back to _trial. Returns the index of the
+  * preference fitted, leaving the chosen mode in *chosen, or -1.
+  */
+static int _negotiate( video_state_t *vs, struct video_format *pref, int n,
+		struct v4l2_format *fmt, struct video_format *chosen ) {
+
+	double best = 0.0;
+	int i, j, selection = -1;
+
+	for(i = 0; i < n; i++ ) {
+		for(j = 0; j < vs->mode_count; j++ ) {
+			struct video_format m;
+			double cost;
+			if( strcmp( vs->mode[j].pixel_format, pref[i].pixel_format ) )
+				continue;
+			m = _fit( vs, j, pref + i );
+			cost = _misfit( pref + i, &m );
+			if( selection < 0 || cost < best ) {
+				best = cost;
+				selection = i;
+				*chosen = m;
+			}
+		}
+	}
+	if( selection < 0 )
+		return -1;
+
+	// A specified rate within a range is better than the range's extreme.
+
+	if( pref[ selection ].fps && chosen->fps > pref[ selection ].fps )
+		chosen->fps = pref[ selection ].fps;
+
+	fmt->fmt.pix.width       = chosen->width;
+	fmt->fmt.pix.height      = chosen->height;
+	fmt->fmt.pix.pixelformat = fourcc_integer( chosen->pixel_format );
+	fmt->fmt.pix.field       = V4L2_FIELD_NONE;
+
+	if( iioctl( vs->fd, VIDIOC_S_FMT, fmt ) < 0 ) {
+		warn( "setting video format: %dx%d,%s",
+			chosen->width,
+			chosen->height,
+			chosen->pixel_format );
+		if( (selection = _trial( vs, pref, n, fmt )) >= 0 )
+			*chosen = pref[ selection ];
+		return selection;
+	}
+	if( fmt->fmt.pix.width != chosen->width
+	 || fmt->fmt.pix.height != chosen->height ) {
+		warnx( "driver adjusted enumerated %dx%d to %dx%d",
+			chosen->width, chosen->height,
+			fmt->fmt.pix.width, fmt->fmt.pix.height );
+	}
+	return selection;
+}
+
+
+/**
+  * Requests fps (if non-zero) and returns the rate in effect, or 0 if
+  * the driver doesn't say.
+  */
+static unsigned _frame_rate( video_state_t *vs, unsigned fps ) {
+
+	struct v4l2_streamparm parm;
+
+	memset( &parm, 0, sizeof(parm) );
+	parm.type = vs->type;
+
+	if( iioctl( vs->fd, VIDIOC_G_PARM, &parm ) < 0 )
+		return 0;
+	if( fps && ( parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME ) ) {
+		parm.parm.capture.timeperframe.numerator   = 1;
+		parm.parm.capture.timeperframe.denominator = fps;
+		if( iioctl( vs->fd, VIDIOC_S_PARM, &parm ) < 0 )
+			warn( "setting frame rate %d", fps );
+	}
+	return _fps( &parm.parm.capture.timeperframe );
+}
+
+
+/**
+  * Negotiates the best fit among n preferences (in decreasing order of
+  * preference) with the enumerated modes, which may differ from the
+  * preference in size or frame rate; compare format() with the request.
+  * Returns the index of the preference fitted or -1 if no pixel format
+  * matched. Drivers that don't enumerate only accept exact matches.
+  */
+static int _config( struct video_capture *vci, struct video_format *pref, int n ) {
+
+	struct video_state *vs
+		= (struct video_state*)vci;
+	struct video_format chosen;
+	int selection = -1;
+	struct v4l2_format fmt;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = vs->type;
+
+	if( vs->mode_count > 0 )
+		selection = _negotiate( vs, pref, n, &fmt, &chosen );
+	else
+	if( (selection = _trial( vs, pref, n, &fmt )) >= 0 )
+		chosen = pref[ selection ];
 
 	if( 0 <= selection ) {
 		// Set the video format
@@ -412,6 +1069,7 @@ static int _config( struct video_capture *vci, struct video_format *pref, int n
 		strcpy(
 			vs->format.pixel_format,
 			fourcc_string( fmt.fmt.pix.pixelformat ) );
+		vs->format.fps = _frame_rate( vs, chosen.fps );
 	}
 
 #if 0
@@ -423,8 +1081,26 @@ static int _config( struct video_capture *vci, struct video_format *pref, int n
 	}
 #endif
 
-	vs->frame_count
-		= _map_frames( vs->fd, VIDEO_MAX_FRAME, vs->frame );
+	// Whichever preference won (if any), what matters is the
+	// format now in effect.
+
+	if( iioctl( vs->fd, VIDIOC_G_FMT, &fmt ) < 0 ) {
+		warn("getting video format");
+		return -2;
+	}
+	if( _layout( vs, &fmt ) )
+		return -2;
+	vs->format.stride = vs->layout[0].stride;
+
+	if( V4L2_MEMORY_USERPTR == vs->memory )
+		vs->frame_count
+			= _slice_arena( vs, vs->buffer_count,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type
+				? fmt.fmt.pix_mp.plane_fmt[0].sizeimage
+				: fmt.fmt.pix.sizeimage );
+	else
+		vs->frame_count
+			= _map_frames( vs, vs->buffer_count, vs->frame );
 
 	if( vs->frame_count <= 0 )
 		return -2;
@@ -461,7 +1137,28 @@ static int _start( struct video_capture *vci ) {
 	struct video_state *vs
 		= ( struct video_state*)vci;
 
-	int argv = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int argv = vs->type;
+
+	vs->sequenced = false;
+
+	if( vs->epfd < 0 ) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.fd = vs->fd
+		};
+		vs->epfd = epoll_create1( EPOLL_CLOEXEC );
+		if( vs->epfd < 0 ) {
+			warn( "epoll_create1" );
+			return -1;
+		}
+		if( epoll_ctl( vs->epfd, EPOLL_CTL_ADD, vs->fd, &ev ) < 0 ) {
+			warn( "epoll_ctl( ADD, %d )", vs->fd );
+			close( vs->epfd );
+			vs->epfd = -1;
+			return -1;
+		}
+	}
+
 	if( iioctl( vs->fd, VIDIOC_STREAMON, &argv ) < 0 ) {
 		warn( "VIDIOC_STREAMON" );
 		return -1;
@@ -484,12 +1181,16 @@ static int _stop( struct video_capture *vci ) {
 	struct video_state *vs
 		= ( struct video_state*)vci;
 
-	int argv = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int argv = vs->type;
 	if( iioctl( vs->fd, VIDIOC_STREAMOFF, &argv ) < 0 ) {
 		warn( "VIDIOC_STREAMOFF" );
 		return -1;
 	}
-	vs->queued = 0;
+	__atomic_store_n( &vs->queued, 0, __ATOMIC_RELAXED );
+	if( vs->epfd >= 0 ) {
+		close( vs->epfd );
+		vs->epfd = -1;
+	}
 	return 0; 
 }
 
@@ -533,12 +1234,10 @@ static int _enqueue1( struct video_capture *vci, int buffer_id ) {
 	struct video_state *vs
 		= ( struct video_state*)vci;
 
-	const unsigned int BIT
-		= 1 << buffer_id;
-
+	struct v4l2_plane planes[ VIDEO_FRAME_PLANES ];
 	struct v4l2_buffer buf = {
 		.index = 0,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.type = vs->type,
 		//.bytesused = 0,
 		//.flags = 0,
 		//.field = 0,
@@ -552,14 +1251,16 @@ static int _enqueue1( struct video_capture *vci, int buffer_id ) {
 		//.reserved = 0
 	};
 
-	assert( 0 <= buffer_id && buffer_id < VIDEO_MAX_FRAME );
+	assert( 0 <= buffer_id && buffer_id < VIDEO_MAX_BUFFERS );
 
-	if( (BIT & vs->queued ) == 0 ) {
+	if( _claim_queued( vs, buffer_id ) ) {
 		buf.index = buffer_id;
-		if( iioctl( vs->fd, VIDIOC_QBUF, &buf ) < 0 )
+		_prepare_qbuf( vs, &buf, planes );
+		if( iioctl( vs->fd, VIDIOC_QBUF, &buf ) < 0 ) {
 			warn( "%s:%d: enqueueing buffer %d", __FILE__, __LINE__, buf.index );
-		else 
-			vs->queued |= BIT;
+			_set_unqueued( vs, buffer_id );
+		} else
+			VIDEO_TRACE( VIDEO_TRACE_QBUF, buffer_id );
 	}
 
 #if 0
@@ -571,14 +1272,15 @@ static int _enqueue1( struct video_capture *vci, int buffer_id ) {
 }
 
 
-static int _enqueue( struct video_capture *vci, unsigned int flags ) {
+static int _enqueue( struct video_capture *vci, uint64_t flags ) {
 
 	struct video_state *vs
 		= ( struct video_state*)vci;
 
+	struct v4l2_plane planes[ VIDEO_FRAME_PLANES ];
 	struct v4l2_buffer buf = {
 		.index = 0,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.type = vs->type,
 		//.bytesused = 0,
 		//.flags = 0,
 		//.field = 0,
@@ -592,27 +1294,178 @@ static int _enqueue( struct video_capture *vci, unsigned int flags ) {
 		//.reserved = 0
 	};
 
-	flags &= (~vs->queued);
+	// Bits beyond the buffers that exist (e.g. ALL_AVAILABLE_BUFFERS)
+	// are ignored rather than attempted.
+
+	if( vs->frame_count < 64 )
+		flags &= ( (uint64_t)1 << vs->frame_count ) - 1;
+	flags &= (~__atomic_load_n( &vs->queued, __ATOMIC_RELAXED ));
+
+	while( flags ) {
+		buf.index = __builtin_ctzll( flags );
+		flags ^= ((uint64_t)1<<buf.index);
+		if( ! _claim_queued( vs, buf.index ) )
+			continue;
+		_prepare_qbuf( vs, &buf, planes );
+		if( iioctl( vs->fd, VIDIOC_QBUF, &buf ) < 0 ) {
+			warn( "%s:%d: enqueueing buffer %d", __FILE__, __LINE__, buf.index );
+			_set_unqueued( vs, buf.index );
+			break;
+		}
+		VIDEO_TRACE( VIDEO_TRACE_QBUF, buf.index );
+	}
+
+#if 0
+	assert( ( buf.flags & V4L2_BUF_FLAG_MAPPED ) != 0 );
+	assert( ( buf.flags & V4L2_BUF_FLAG_QUEUED ) != 0 );
+	assert( ( buf.flags & V4L2_BUF_FLAG_DONE   ) == 0 );
+#endif
+	return 0;
+}
+
+
+/**
+  * Waits up to timeout ms for the V4L2 driver to signal buffer/frame
+  * availability. Returns 0 if a buffer should be ready (or no waiting was
+  * requested), -1 if waiting failed, otherwise (timed out or interrupted)
+  * a positive value.
+  */
+static int _wait( video_state_t *vs, int timeout ) {
+
+	struct epoll_event ev;
+	int nfd = 0;
+
+	if( timeout <= 0 || vs->epfd < 0 )
+		return 0;
+
+	// EPOLLERR is always reported, so errors also end the wait and
+	// surface from VIDIOC_DQBUF.
+
+	nfd = epoll_wait( vs->epfd, &ev, 1, timeout );
+
+	// Negative returns imply error; 0 implies timeout.
+
+	if( nfd < 0 ) {
+		if( EINTR == errno ) // should only happen for Ctrl-C
+			warn( "waiting for a frame interrupted" );
+		else {
+			video_stats_count( &vs->stats.errors );
+			warn( "waiting for a frame" );
+			return -1;
+		}
+		return __LINE__;
+	}
+
+	if( 0 == nfd ) {
+		video_stats_count( &vs->stats.timeouts );
+		warnx( "frame wait timeout (%dms)", timeout );
+		return __LINE__; // timed out
+	}
+
+	VIDEO_TRACE( VIDEO_TRACE_WAKEUP, nfd );
+
+	return 0;
+}
+
+
+/**
+  * Adds one buffer, of the format in effect, to a streaming device with
+  * VIDIOC_CREATE_BUFS and enqueues it. USERPTR arenas are sliced once by
+  * config, so only driver (MMAP) buffers can grow. Failure isn't an
+  * error; growth just stops where it is.
+  */
+static void _grow( video_state_t *vs ) {
+
+	struct v4l2_create_buffers cb = {
+		.count  = 1,
+		.memory = V4L2_MEMORY_MMAP,
+		.format.type = vs->type,
+	};
+	const int n = vs->frame_count;
+
+	if( V4L2_MEMORY_MMAP != vs->memory || vs->epfd < 0 )
+		return;
+
+	if( iioctl( vs->fd, VIDIOC_G_FMT, &cb.format ) < 0
+	 || iioctl( vs->fd, VIDIOC_CREATE_BUFS, &cb ) < 0 ) {
+		warn( "VIDIOC_CREATE_BUFS (staying at %d buffers)", n );
+		vs->buffer_max = n;
+		return;
+	}
+	if( cb.count < 1 || cb.index != n || _map_frame( vs, n, vs->frame + n ) ) {
+		warnx( "can't use created buffer %d (staying at %d buffers)",
+			cb.index, n );
+		vs->buffer_max = n;
+		return;
+	}
+
+	// Other threads (lease releases) only touch buffers below
+	// frame_count, so publish the new buffer before counting it.
+
+	__atomic_store_n( &vs->frame_count, n + 1, __ATOMIC_RELEASE );
+	_enqueue1( &vs->interface, n );
+}
+
+
+static inline void _shift( struct timespec *t, int64_t ns ) {
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+	if( t->tv_nsec < 0 ) {
+		t->tv_nsec += 1000000000L;
+		t->tv_sec  -= 1;
+	}
+}
+
 
-	while( flags ) {
-		buf.index = __builtin_ctz( flags );
-		if( iioctl( vs->fd, VIDIOC_QBUF, &buf ) < 0 ) {
-			warn( "%s:%d: enqueueing buffer %d", __FILE__, __LINE__, buf.index );
-			break;
-		} else {
-			unsigned int BIT
-				= (1<<buf.index);
-			vs->queued |= BIT;
-			flags      ^= BIT;
+/**
+  * Fills in the plane views of a just dequeued frame from the layout
+  * and, for multi-planar buffers, the driver's per-plane payload (planes).
+  * bytesused becomes the total of the planes' and mem the first plane's.
+  */
+static void _planes( VIDEO_STATE_T *vs, struct video_frame *fr,
+		const struct v4l2_plane *planes ) {
+
+	const bool MPLANE
+		= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type;
+	const struct frame_buffer *f
+		= vs->frame + fr->buffer_id;
+	uint32_t total = 0;
+	int i;
+
+	for(i = 0; i < vs->planes; i++ ) {
+
+		const struct plane_layout *L
+			= vs->layout + i;
+		struct video_plane *p
+			= fr->plane + i;
+		size_t start = L->offset;
+		uint32_t used = fr->bytesused;
+
+		// data_offset is included in the plane's bytesused.
+
+		if( MPLANE ) {
+			start += planes[ L->buffer ].data_offset;
+			used   = planes[ L->buffer ].bytesused;
 		}
+		used = used > start ? used - start : 0;
+		if( vs->planes > 1 && used > L->size )
+			used = L->size;
+
+		p->mem       = (uint8_t*)f->plane[ L->buffer ].address + start;
+		p->stride    = L->stride;
+		p->bytesused = used;
+		total += used;
+	}
+	fr->planes = vs->planes;
+	fr->mem    = fr->plane[0].mem;
+
+	if( MPLANE ) {
+		fr->bytesused = total;
+		fr->length    = 0;
+		for(i = 0; i < vs->buffer_planes; i++ )
+			fr->length += f->plane[i].length;
 	}
-
-#if 0
-	assert( ( buf.flags & V4L2_BUF_FLAG_MAPPED ) != 0 );
-	assert( ( buf.flags & V4L2_BUF_FLAG_QUEUED ) != 0 );
-	assert( ( buf.flags & V4L2_BUF_FLAG_DONE   ) == 0 );
-#endif
-	return 0;
 }
 
 
@@ -627,96 +1480,212 @@ static int _enqueue( struct video_capture *vci, unsigned int flags ) {
   * When the O_NONBLOCK flag was given to the open() function, VIDIOC_DQBUF
   * returns immediately with an EAGAIN error code when no buffer is
   * available.
+  *
+  * Returns 0 or -1 with errno set; in particular EAGAIN means nothing
+  * was ready.
   */
+static int _dqbuf( video_state_t *vs, struct video_frame *fr ) {
+
+	struct v4l2_buffer *buf
+		= (struct v4l2_buffer *)fr;
+	struct v4l2_plane planes[ VIDEO_FRAME_PLANES ];
+	struct timespec now;
+
+	buf->type   = vs->type;
+	buf->memory = vs->memory;
+	if( V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vs->type ) {
+		memset( planes, 0, sizeof(planes) );
+		buf->m.planes = planes;
+		buf->length   = VIDEO_FRAME_PLANES;
+	}
+
+	if( iioctl( vs->fd, VIDIOC_DQBUF, buf ) < 0 ) {
+		if( EAGAIN != errno )
+			video_stats_count( &vs->stats.errors );
+		return -1;
+	}
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	VIDEO_TRACE( VIDEO_TRACE_DQBUF, buf->index );
+	_set_unqueued( vs, buf->index );
+
+	_planes( vs, fr, planes );
+	fr->gap = vs->sequenced ? buf->sequence - vs->next_sequence : 0;
+	vs->next_sequence = buf->sequence + 1;
+	vs->sequenced = true;
+
+	fr->monotonic.tv_sec  = buf->timestamp.tv_sec;
+	fr->monotonic.tv_nsec = buf->timestamp.tv_usec * 1000L;
+	if( ( buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK )
+			!= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ) {
+		// Older drivers stamp frames with gettimeofday().
+		struct timespec real;
+		clock_gettime( CLOCK_REALTIME, &real );
+		_shift( &fr->monotonic,
+			( now.tv_sec - real.tv_sec )*1000000000LL
+			+ ( now.tv_nsec - real.tv_nsec ) );
+	}
+	fr->latency_ns
+		= ( now.tv_sec - fr->monotonic.tv_sec )*1000000000LL
+		+ ( now.tv_nsec - fr->monotonic.tv_nsec );
+
+	if( buf->flags & V4L2_BUF_FLAG_ERROR )
+		video_stats_count( &vs->stats.errors );
+	video_stats_frame( &vs->stats, fr );
+
+	// The driver now has nothing to fill, so the next frame would be
+	// dropped: the consumer is holding more buffers than we have.
+
+	if( __atomic_load_n( &vs->queued, __ATOMIC_RELAXED ) == 0
+			&& vs->frame_count < vs->buffer_max )
+		_grow( vs );
+	return 0;
+}
+
+
 static int _dequeue( struct video_capture *vci, 
 		int timeout, struct video_frame *fr ) {
 
 	struct video_state *vs
 		= (struct video_state*)vci;
-	struct v4l2_buffer *buf
-		= (struct v4l2_buffer *)fr;
 
 	// Make no assumptions about callers, in particular thread structure.
 	// If the device does not appear to have any frames queued, don't even
-	// wait for select unless caller specified "no timeout" since, in that
+	// wait for epoll unless caller specified "no timeout" since, in that
 	// case, it may be that another thread is going to queue a frame.
 
-	if( vs->queued == 0 && timeout != VIDEO_DEQ_TIMEOUT_NONE )
+	if( __atomic_load_n( &vs->queued, __ATOMIC_RELAXED ) == 0
+			&& timeout != VIDEO_DEQ_TIMEOUT_NONE )
 		return -1;
 
 	if( timeout == VIDEO_DEQ_TIMEOUT_DEFAULT )
 		timeout = vs->dequeue_timeout;
 
-	/*
-	   Just for references...
-		struct v4l2_buffer buf = {
-			.index    = index,
-			.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			.bytesused = 0,
-			.flags    = 0,
-			.field    = 0,
-			.timestamp, // struct timeval
-			.timecode,  // struct v4l2_timecode	
-			.sequence = 0,
-			.memory = v4l2_memory_mmap,
-			.m.offset = 0,
-			.length   = 0,
-			.input    = 0,
-			.reserved = 0
-		};
-	*/
+	if( _wait( vs, timeout ) )
+		return __LINE__;
+
+	if( _dqbuf( vs, fr ) < 0 ) {
+		warn( "%s:%d: VIDIOC_DQBUF", __FILE__, __LINE__ );
+		return __LINE__;
+	}
+
+	// At least dequeueing was successful...but whether or not the
+	// buffer's content is valid is a separate issue...
+
+	if( fr->flags & V4L2_BUF_FLAG_ERROR ) {
+		warnx( "V4L2_BUF_FLAG_ERROR in buffer %d", fr->buffer_id );
+		return __LINE__;
+	}
+
+	return 0;
+}
 
-	buf->type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
 
-	if( timeout > 0 ) {
+/**
+  * Waits (once) as _dequeue does, then drains every completed buffer
+  * without waiting again. Buffers flagged V4L2_BUF_FLAG_ERROR are
+  * immediately requeued rather than returned. The frames are returned in
+  * sequence order.
+  */
+static int _dequeue_many( struct video_capture *vci, 
+		int timeout, struct video_frame *fr, int max ) {
+
+	struct video_state *vs
+		= (struct video_state*)vci;
+	int i, n = 0, waited;
 
-		int nfd = 0;
-		fd_set rfds,efds;
-		struct timeval tv = { timeout, 0 };
-		FD_ZERO( &rfds );
-		FD_ZERO( &efds );
-		FD_SET( vs->fd, &rfds );
-		FD_SET( vs->fd, &efds );
+	if( __atomic_load_n( &vs->queued, __ATOMIC_RELAXED ) == 0
+			&& timeout != VIDEO_DEQ_TIMEOUT_NONE )
+		return -1;
 
-		// Wait for the V4L2 driver to signal buffer/frame availability.
+	if( timeout == VIDEO_DEQ_TIMEOUT_DEFAULT )
+		timeout = vs->dequeue_timeout;
 
-		nfd = select( vs->fd + 1, &rfds, NULL, &efds, &tv );
+	if( (waited = _wait( vs, timeout )) != 0 )
+		return waited < 0 ? -1 : 0;
 
-		// Negative returns imply error; 0 implies timeout.
+	while( n < max ) {
 
-		if( nfd < 0 ) {
-			if( EINTR == errno ) { // should only happen for Ctrl-C
-				warn( "monitor_loop interrupted" );
-				return __LINE__;
-			} else
-				err( 0, "waiting on input" );
+		if( _dqbuf( vs, fr + n ) < 0 ) {
+			if( EAGAIN != errno ) {
+				warn( "%s:%d: VIDIOC_DQBUF", __FILE__, __LINE__ );
+				if( n == 0 )
+					return -1;
+			}
+			break;
 		}
 
-		if( 0 == nfd ) {
-			warn( "monitor_loop timeout (%lds)", vs->dequeue_timeout );
-			return __LINE__; // timed out
+		if( fr[n].flags & V4L2_BUF_FLAG_ERROR ) {
+			warnx( "V4L2_BUF_FLAG_ERROR in buffer %d", fr[n].buffer_id );
+			_enqueue1( vci, fr[n].buffer_id );
+			continue;
 		}
+
+		n++;
 	}
 
-	if( iioctl( vs->fd, VIDIOC_DQBUF, buf ) < 0 ) {
-		warn( "%s:%d: VIDIOC_DQBUF", __FILE__, __LINE__ );
-		return __LINE__;
+	// Drivers complete buffers in order, so this is almost always a
+	// no-op, but it's cheap insurance for a short array.
+
+	for(i = 1; i < n; i++ ) {
+		const struct video_frame T = fr[i];
+		int j = i;
+		while( j > 0 && (int32_t)( T.sequence - fr[j-1].sequence ) < 0 ) {
+			fr[j] = fr[j-1];
+			j--;
+		}
+		fr[j] = T;
 	}
 
-	// At least dequeueing was successful...
+	return n;
+}
+
 
-	_set_unqueued( vs, buf->index );
+/**
+  * Waits (once) as _dequeue does, then drains every completed buffer,
+  * keeping only the newest. Older frames, and any flagged
+  * V4L2_BUF_FLAG_ERROR, go straight back to the driver.
+  */
+static int _dequeue_latest( struct video_capture *vci, 
+		int timeout, struct video_frame *fr, int *skipped ) {
+
+	struct video_state *vs
+		= (struct video_state*)vci;
+	struct video_frame next;
+	int n = 0;
 
-	// ...but whether or not the buffer's content is valid is a separate
-	// issue...
+	if( skipped )
+		*skipped = 0;
 
-	if( buf->flags & V4L2_BUF_FLAG_ERROR ) {
-		warnx( "V4L2_BUF_FLAG_ERROR in buffer %d", buf->index );
+	if( __atomic_load_n( &vs->queued, __ATOMIC_RELAXED ) == 0
+			&& timeout != VIDEO_DEQ_TIMEOUT_NONE )
+		return -1;
+
+	if( timeout == VIDEO_DEQ_TIMEOUT_DEFAULT )
+		timeout = vs->dequeue_timeout;
+
+	if( _wait( vs, timeout ) )
 		return __LINE__;
+
+	while( _dqbuf( vs, &next ) == 0 ) {
+		if( next.flags & V4L2_BUF_FLAG_ERROR ) {
+			warnx( "V4L2_BUF_FLAG_ERROR in buffer %d", next.buffer_id );
+			_enqueue1( vci, next.buffer_id );
+			continue;
+		}
+		if( n++ > 0 ) {
+			_enqueue1( vci, fr->buffer_id );
+			if( skipped )
+				(*skipped)++;
+			next.gap += fr->gap; // ...since the previous frame *returned*.
+		}
+		*fr = next;
 	}
+	if( EAGAIN != errno )
+		warn( "%s:%d: VIDIOC_DQBUF", __FILE__, __LINE__ );
 
-	fr->mem = vs->frame[ buf->index ].address;
+	if( n == 0 )
+		return __LINE__;
 
 	return 0;
 }
@@ -737,21 +1706,9 @@ static int _snap( struct video_capture *vci, int timeout, size_t *len, uint8_t *
 
 	int econd = 0;
 
-	struct v4l2_buffer buf = {
-		//.index = index,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		//.bytesused = 0,
-		//.flags = 0,
-		//.field = 0,
-		//.timestamp, // struct timeval
-		//.timecode,  // struct v4l2_timecode	
-		//.sequence = 0,
-		.memory = V4L2_MEMORY_MMAP,
-		//.m.offset = 0,
-		//.length   = 0,
-		//.input    = 0,
-		//.reserved = 0
-	};
+	struct video_frame fr;
+
+	memset( &fr, 0, sizeof(fr) );
 
 	// Enqueue all available buffers
 
@@ -771,7 +1728,7 @@ static int _snap( struct video_capture *vci, int timeout, size_t *len, uint8_t *
 
 	while( vs->queued ) {
 
-		if( _dequeue( vci, timeout, (struct video_frame*)&buf ) ) {
+		if( _dequeue( vci, timeout, &fr ) ) {
 			if( errno == EAGAIN )
 				continue;
 			if( errno == EIO )
@@ -793,23 +1750,30 @@ static int _snap( struct video_capture *vci, int timeout, size_t *len, uint8_t *
 	  */
 
 	if( (NULL != ubuf) && (NULL != len) ) {
-		if( *len < buf.bytesused ) {
+		if( *len < fr.bytesused ) {
 #ifdef _DEBUG
 			fprintf( stdout, "realloc( %p, %ld => %d )\n",
-				*ubuf, *len, buf.bytesused );
+				*ubuf, *len, fr.bytesused );
 #endif
-			void *p = realloc( *ubuf, buf.bytesused );
+			void *p = realloc( *ubuf, fr.bytesused );
 			if( p )
 				*ubuf = p;
 			else
 				return -1;
 		}
 		if( *ubuf ) {
-			memcpy(
-				*ubuf, 
-				vs->frame[ buf.index ].address, 
-				buf.bytesused );
-			*len  = buf.bytesused;
+			size_t n = 0;
+			int i;
+			// The planes, back to back (only multi-planar buffers'
+			// are not already).
+			for(i = 0; i < fr.planes; i++ ) {
+				memcpy(
+					*ubuf + n, 
+					fr.plane[i].mem, 
+					fr.plane[i].bytesused );
+				n += fr.plane[i].bytesused;
+			}
+			*len  = n;
 		} else {
 			*len = 0;
 			econd = -1;
@@ -824,42 +1788,143 @@ static void _destroy( struct video_capture *vci ) {
 	
 	struct video_state *vs
 		= ( struct video_state*)vci;
-	_unmap_frames( vs->frame_count, vs->frame );
+	free( vs->mode );
+	free( vs->range );
+	if( V4L2_MEMORY_MMAP == vs->memory )
+		_unmap_frames( vs->frame_count, vs->frame );
+	if( vs->epfd >= 0 )
+		close( vs->epfd );
 	close( vs->fd );
-
-#ifndef HAVE_SINGLETON_DEVICE
 	free( vs );
-#endif
 }
 
 
-#ifdef HAVE_SINGLETON_DEVICE
-static struct video_state _singleton_state = {
-	.interface = {
-		.format  = _format,
-		.config  = _config,
-		.snap    = _snap,
-		.start   = _start,
-		.enqueue1 = _enqueue1,
-		.enqueue = _enqueue,
-		.dequeue = _dequeue,
-		.stop    = _stop,
-		.destroy = _destroy,
-	},
-	.dequeue_timeout = 2 /* seconds */,
-/*	.name[ MAXLEN_DEVPATH+1 ],
-	.fd,
-	.format = {},
-
-	.queued,
-	.frame_count,
-	.frame[ VIDEO_MAX_FRAME ]
-*/
+static int _descriptor( struct video_capture *vci ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+	return vs->fd;
+}
+
+
+/**
+  * Fills in a handle carrying the DMABUF descriptor of a dequeued frame's
+  * buffer. The descriptor remains owned by this module; consumers that
+  * outlive the capture session must dup() it. Of a multi-planar buffer
+  * with separate planes, this exports only the first.
+  */
+static int _export( struct video_capture *vci,
+		const struct video_frame *fr, struct video_export *ex ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+
+	if( fr->buffer_id < 0 || fr->buffer_id >= vs->frame_count )
+		return -1;
+	if( vs->frame[ fr->buffer_id ].plane[0].dmabuf < 0 )
+		return -1;
+
+	ex->buffer_id = fr->buffer_id;
+	ex->fd        = vs->frame[ fr->buffer_id ].plane[0].dmabuf;
+	ex->length    = vs->frame[ fr->buffer_id ].plane[0].length;
+	ex->bytesused = vs->buffer_planes > 1
+		? fr->plane[0].bytesused : fr->bytesused;
+	return 0;
+}
+
+
+/**
+  * Hands ownership of a dequeued frame's buffer to a lease holding one
+  * reference. The buffer is enqueued (by video_lease_release) when the
+  * last reference goes away.
+  */
+static struct video_lease *_lease( struct video_capture *vci,
+		const struct video_frame *fr ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+
+	return video_lease_issue( vs->lease, vs->frame_count, vci, fr );
+}
+
+
+static int _userptr( struct video_capture *vci, void *arena, size_t size ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+
+	if( vs->frame_count > 0 ) {
+		warnx( "userptr must precede config" );
+		return -1;
+	}
+	vs->memory     = V4L2_MEMORY_USERPTR;
+	vs->arena      = arena;
+	vs->arena_size = size;
+	return 0;
+}
+
+
+static int _modes( struct video_capture *vci, const struct video_format **mode ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+	*mode = vs->mode;
+	return vs->mode_count;
+}
+
+
+static int _stats( struct video_capture *vci, struct video_stats *st ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+	video_stats_copy( st, &vs->stats );
+	st->queued  = __builtin_popcountll(
+		__atomic_load_n( &vs->queued, __ATOMIC_RELAXED ) );
+	st->buffers = __atomic_load_n( &vs->frame_count, __ATOMIC_RELAXED );
+	return 0;
+}
+
+
+static int _buffers( struct video_capture *vci, int count, int max ) {
+
+	struct video_state *vs
+		= ( struct video_state*)vci;
+
+	if( vs->frame_count > 0 ) {
+		warnx( "buffers must precede config" );
+		return -1;
+	}
+	if( count < 1 || count > VIDEO_MAX_BUFFERS ) {
+		warnx( "buffer count %d not in [1,%d]", count, VIDEO_MAX_BUFFERS );
+		return -1;
+	}
+	vs->buffer_count = count;
+	vs->buffer_max   = max < count ? count
+		: ( max > VIDEO_MAX_BUFFERS ? VIDEO_MAX_BUFFERS : max );
+	return 0;
+}
+
+
+static const struct video_capture _interface = {
+	.format  = _format,
+	.config  = _config,
+	.snap    = _snap,
+	.start   = _start,
+	.enqueue1 = _enqueue1,
+	.enqueue = _enqueue,
+	.dequeue = _dequeue,
+	.dequeue_many = _dequeue_many,
+	.dequeue_latest = _dequeue_latest,
+	.stop    = _stop,
+	.destroy = _destroy,
+	.descriptor = _descriptor,
+	.export  = _export,
+	.userptr = _userptr,
+	.lease   = _lease,
+	.buffers = _buffers,
+	.modes   = _modes,
+	.stats   = _stats,
 };
-#ifdef _DEBUG
-const uint32_t *queued = &_singleton_state.queued;
-#endif
-#endif
 
 /**
   * Either attempt to foist a specific resolution and format
@@ -873,8 +1938,12 @@ struct video_capture *video_open( const char *devpath ) {
 	struct stat st;
 	int fd = -1;
 
-	if( VIDEO_MAX_FRAME != 32 )
-		return NULL; // too much depends on this now.
+	if( strncmp( devpath, "replay:", 7 ) == 0 )
+		return video_replay_open( devpath + 7, 0 );
+	if( strncmp( devpath, "replay-realtime:", 16 ) == 0 )
+		return video_replay_open( devpath + 16, VIDEO_REPLAY_REALTIME );
+	if( strncmp( devpath, "synthetic:", 10 ) == 0 )
+		return video_synthetic_open( devpath + 10 );
 
 	/**
 	  * Do all the most likely to fail stuff first.
@@ -906,7 +1975,11 @@ struct video_capture *video_open( const char *devpath ) {
 		goto unwind0;
 	}
 
-	if( ! (cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ) {
+	if( cap.capabilities & V4L2_CAP_DEVICE_CAPS )
+		cap.capabilities = cap.device_caps; // ...of this node, specifically
+
+	if( ! (cap.capabilities
+			& (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)) ) {
 		warnx( "not video capture device\n");
 		goto unwind0;
 	}
@@ -915,23 +1988,27 @@ struct video_capture *video_open( const char *devpath ) {
 		goto unwind0;
 	}
 
-#ifdef HAVE_SINGLETON_DEVICE
-	vs = &_singleton_state;
-#else
 	vs = calloc( 1, sizeof(struct video_state) );
-	if( NULL == vs )
+	if( NULL == vs ) {
+		warn( "allocating state for %s", devpath );
 		goto unwind0;
-#endif
-
-	/**
-	  * TODO: Revisit: Just enumerate supported formats here and cache
-	  * them in user space for subsequent inspection by client.
-	  */
+	}
+	vs->interface = _interface;
+	vs->type = ( cap.capabilities & V4L2_CAP_VIDEO_CAPTURE )
+		? V4L2_BUF_TYPE_VIDEO_CAPTURE
+		: V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	vs->dequeue_timeout = 2000 /* milliseconds */;
+	vs->memory = V4L2_MEMORY_MMAP;
+	vs->epfd = -1;
+	vs->buffer_count = VIDEO_DEFAULT_BUFFERS;
+	vs->buffer_max   = VIDEO_DEFAULT_BUFFERS;
 
 	// Move everything to the struct...
 	strncpy( vs->name, devpath, MAXLEN_DEVPATH+1 );
 	vs->fd = fd;
 
+	_enumerate( vs );
+
 #ifdef _DEBUG
 	_dump( vs, stdout );
 #endif
@@ -944,9 +2021,9 @@ unwind0:
 	return NULL;
 }
 /*
-	if( __builtin_popcount( vs->queued ) < 2 ) {
+	if( __builtin_popcountll( vs->queued ) < 2 ) {
 		warnx( "too few frames (%d) queued",
-			__builtin_popcount( vs->queued ) );
+			__builtin_popcountll( vs->queued ) );
 		return (void*)(-1);
 	}
 */
@@ -965,6 +2042,8 @@ unwind0:
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/Xutil.h>
+
+#include "yuyv.h"
 #endif
 
 /**
@@ -1250,86 +2329,19 @@ static Bool _procEvent( XEvent *e ) {
 }
 
 
-static inline uint8_t clampf( float v ) {
-	if( v < 0.0 )
-		return 0;
-	else
-	if( v > 255.0 )
-		return 255;
-	else
-		return (uint8_t)v;
-}
-
-static inline uint8_t clampi( int v ) {
-	if( v < 0 )
-		return 0;
-	else
-	if( v > 255 )
-		return 255;
-	else
-		return (uint8_t)v;
-}
-
-static inline void YUV2BGR( int y, int u, int v, uint8_t *bgr ) {
-#if 1
-	const int C = y -  16;
-	const int D = u - 128;
-	const int E = v - 128;
-	bgr[2] = clampi( (298*C         + 409*E + 128) >> 8 );
-	bgr[1] = clampi( (298*C - 100*D - 208*E + 128) >> 8 );
-	bgr[0] = clampi( (298*C + 516*D         + 128) >> 8 );
-#else
-	bgr[2] = clampf( y +                 1.402*(u-128) );
-	bgr[1] = clampf( y - 0.344*(v-128) - 0.714*(u-128) );
-	bgr[0] = clampf( y + 1.772*(v-128)                 );
-#endif
-}
-
-static void _render_video_frame( void *vbuf ) {
-
-	const uint16_t *yuyv = vbuf;
-	int err, r, c;
-
-	/**
-	  * Copy the video frame into our local buffer converting
-	  * it from YUYV to...
-	  */
+/**
+  * Regions (-R) to render; none means the whole frame.
+  */
+#define MAX_ROIS (8)
+static struct video_rect _roi[ MAX_ROIS ];
+static int _rois = 0;
 
-	for(r = 0; r < _fmt.height; r++ ) {
-#if 0
-		/**
-		  * ...grayscale rendered as 24-bit color in the process.
-		  */
-		for(c = 0; c < _fmt.width; c++ ) {
-			const uint8_t GRAY
-				= (uint8_t)(0x00FF & yuyv[ r*_fmt.width + c ]);
-			_data[ 4*_fmt.width*r + 4*c+2 ] = GRAY; // red
-			_data[ 4*_fmt.width*r + 4*c+1 ] = GRAY; // green
-			_data[ 4*_fmt.width*r + 4*c+0 ] = GRAY; // blue
-		}
-#else
-		/**
-		  * ...24-bit color in the process.
-		  */
-		const uint8_t *iline = (const uint8_t*)(
-			yuyv  + r*_fmt.width );
-		      uint8_t *oline = 
-			_data + r*_fmt.width*4;
-		for(c = 0; c < 2*_fmt.width; c+=4 ) {
-			const int Y0 = iline[c+0];
-			const int U  = iline[c+1];
-			const int Y1 = iline[c+2];
-			const int V  = iline[c+3];
-			YUV2BGR( Y0, U, V, oline + 4*(c/2+0) );
-			YUV2BGR( Y1, U, V, oline + 4*(c/2+1) );
-		}
-#endif
-	}
+static void _put( int x, int y, int w, int h ) {
 
-	err = XPutImage( _cx.display, _cx.win, _cx.gc, _img, 
-			0, 0,
-			0, 0,
-			_fmt.width, _fmt.height );
+	const int err = XPutImage( _cx.display, _cx.win, _cx.gc, _img, 
+			x, y,
+			x, y,
+			w, h );
 
 	if( Success != err ) {
 		static char buf[512];
@@ -1339,13 +2351,43 @@ static void _render_video_frame( void *vbuf ) {
 }
 
 
-static void _exec_gui( const char *devname, int timeout_s, int W, int H ) {
+/**
+  * Converts the n regions of a YUYV frame whose rows are stride bytes
+  * apart into the XImage, which mirrors the frame, and shows them.
+  */
+static void _render_video_frame( const uint8_t *yuyv, size_t stride,
+		const struct video_rect *roi, int n ) {
+
+	uint8_t *o[ MAX_ROIS ];
+	size_t ostride[ MAX_ROIS ];
+	int i;
+
+	for(i = 0; i < n; i++ ) {
+		o[i] = _data + 4*( roi[i].y*_fmt.width + roi[i].x );
+		ostride[i] = 4*_fmt.width;
+	}
+	if( yuyv2bgrx_roi( yuyv, stride, _fmt.width, _fmt.height, roi, n, o, ostride ) )
+		return;
+	for(i = 0; i < n; i++ )
+		_put( roi[i].x, roi[i].y, roi[i].w, roi[i].h );
+}
+
+
+static void _exec_gui( const char *devname, int timeout_ms, int W, int H ) {
 
 	Display *d = _cx.display;
 	Window topwin;
 
 	XEvent e;
 
+	// The whole frame unless regions were given, its rows as the
+	// driver lays them out.
+
+	const struct video_rect FRAME = { 0, 0, _fmt.width, _fmt.height };
+	const struct video_rect *roi = _rois ? _roi : &FRAME;
+	const int n = _rois ? _rois : 1;
+	const size_t stride = _fmt.stride ? _fmt.stride : 2*_fmt.width;
+
 #ifdef _DEBUG
 #ifdef HAVE_EXTRAS
 	XSetAfterFunction( d, _afterFxn );
@@ -1418,9 +2460,11 @@ static void _exec_gui( const char *devname, int timeout_s, int W, int H ) {
 			  * and immediately requeue the frame.
 			  */
 
-			if( _vci->dequeue( _vci, timeout_s, &fr ) == 0 ) {
-				_render_video_frame( fr.mem );
-				_vci->enqueue( _vci, 1 << fr.buffer_id );
+			if( _vci->dequeue( _vci, timeout_ms, &fr ) == 0 ) {
+				VIDEO_TRACE( VIDEO_TRACE_RENDER_BEGIN, fr.buffer_id );
+				_render_video_frame( fr.mem, stride, roi, n );
+				VIDEO_TRACE( VIDEO_TRACE_RENDER_END, fr.buffer_id );
+				_vci->enqueue1( _vci, fr.buffer_id );
 			}
 		}
 
@@ -1437,34 +2481,22 @@ int main( int argc, char *argv[] ) {
 
 	static char video_device[ 64 ];
 	static const char *USAGE
-		= "%s -w <width>[%d] -h <height>[%d] -f <FOURCC pixel type>[%s] -t <timeout(s)>[%d] [ <device path> ]\n";
+		= "%s -w <width>[%d] -h <height>[%d] -f <FOURCC pixel type>[%s] -r <fps>[any] -t <timeout(ms)>[%d] -b <buffers>[%d] [-l(ist modes)] [-d(iscover devices)] [-T <trace JSON>] [-R <w>x<h>+<x>+<y> (region to render; repeatable)] [ <device path> ]\n";
 #ifndef HAVE_X11
 	size_t   snapsize = 0;
 	uint8_t *snapshot = NULL;
 #endif
-	int timeout_s = 1;
-
-#if 0
-	printf( "offsetof( struct v4l2_buffer, timestamp) = %ld\n",
-			offsetof( struct v4l2_buffer, timestamp) );
-	printf( "offsetof( struct video_frame, timestamp) = %ld\n",
-			offsetof( struct video_frame, timestamp) );
-	printf( "offsetof( struct v4l2_buffer, m) = %ld\n",
-			offsetof( struct v4l2_buffer, m) );
-	printf( "offsetof( struct video_frame, mem) = %ld\n",
-			offsetof( struct video_frame, mem) );
-	printf( "sizeof(struct v4l2_buffer) = %ld\n",
-			sizeof(struct v4l2_buffer) );
-	printf( "sizeof(struct video_frame) = %ld\n",
-			sizeof(struct video_frame) );
-#endif
+	int timeout_ms = 1000;
+	int buffers = VIDEO_DEFAULT_BUFFERS;
+	bool list = false;
+	const char *trace = NULL;
 
 	/**
 	  * Process options
 	  */
 
 	do {
-		static const char *OPTIONS = "w:h:f:t:v:?";
+		static const char *OPTIONS = "w:h:f:r:t:b:ldT:R:v:?";
 		const int c = getopt( argc, argv, OPTIONS );
 		if( c < 0 ) break;
 
@@ -1483,7 +2515,55 @@ int main( int argc, char *argv[] ) {
 			break;
 
 		case 't':
-			timeout_s = atoi( optarg );
+			timeout_ms = atoi( optarg );
+			break;
+
+		case 'b':
+			buffers = atoi( optarg );
+			break;
+
+		case 'r':
+			_fmt.fps = atoi( optarg );
+			break;
+
+		case 'l':
+			list = true;
+			break;
+
+		case 'd':
+			{
+				struct video_device dev[ 16 ];
+				const int N = video_discover( dev, 16 );
+				if( N < 0 )
+					fprintf( stderr, "no sysfs video4linux class\n" );
+				for(int i = 0; i < N; i++ )
+					fprintf( stdout, "%s %s (%s) %s caps %08x\n",
+						dev[i].path, dev[i].id, dev[i].driver,
+						dev[i].card, dev[i].caps );
+				exit( N < 0 ? -1 : 0 );
+			}
+			break;
+
+		case 'T':
+			trace = optarg;
+			video_trace_enable( true );
+			break;
+
+		case 'R':
+#ifdef HAVE_X11
+			if( _rois < MAX_ROIS ) {
+				struct video_rect *R = _roi + _rois;
+				if( sscanf( optarg, "%dx%d+%d+%d", &R->w, &R->h, &R->x, &R->y ) == 4 )
+					_rois++;
+				else
+					fprintf( stderr, "warning: ignoring region \"%s\"\n", optarg );
+			} else
+				fprintf( stderr, "warning: ignoring region \"%s\" (at most %d)\n",
+					optarg, MAX_ROIS );
+#else
+			fprintf( stderr, "error: regions (-R) are only rendered by the X11 viewer\n" );
+			exit(-1);
+#endif
 			break;
 
 		case 'v':
@@ -1520,8 +2600,39 @@ int main( int argc, char *argv[] ) {
 		fprintf( stderr, "error: opening \"%s\"\n", video_device );
 		abort();
 	}
+	if( list ) {
+		const struct video_format *mode;
+		const int N = _vci->modes( _vci, &mode );
+		for(int i = 0; i < N; i++ )
+			fprintf( stdout, "%s %dx%d @%d\n", mode[i].pixel_format,
+				mode[i].width, mode[i].height, mode[i].fps );
+		_vci->destroy( _vci );
+		return 0;
+	}
+	if( _vci->buffers( _vci, buffers, buffers ) != 0 )
+		abort();
 	if( _vci->config( _vci, &_fmt, 1 ) != 0 )
 		abort();
+	_fmt = *_vci->format( _vci ); // ...which may only approximate the request.
+
+#ifdef HAVE_X11
+	for(int i = 0; i < _rois; i++ ) {
+
+		// Clip regions to the frame actually configured.
+
+		struct video_rect *R = _roi + i;
+		if( R->x < 0 ) { R->w += R->x; R->x = 0; }
+		if( R->y < 0 ) { R->h += R->y; R->y = 0; }
+		if( R->x + R->w > (int)_fmt.width )
+			R->w = _fmt.width - R->x;
+		if( R->y + R->h > (int)_fmt.height )
+			R->h = _fmt.height - R->y;
+		if( R->w <= 0 || R->h <= 0 ) {
+			fprintf( stderr, "warning: region %d is outside the frame\n", i );
+			_roi[ i-- ] = _roi[ --_rois ];
+		}
+	}
+#endif
 
 #ifndef HAVE_X11
 
@@ -1529,7 +2640,7 @@ int main( int argc, char *argv[] ) {
 	  * Without X, just emit a snapshot to a tmp file in CWD.
 	  */
 
-	if( _vci->snap( _vci, timeout_s, &snapsize, &snapshot ) == 0 ) {
+	if( _vci->snap( _vci, timeout_ms, &snapsize, &snapshot ) == 0 ) {
 		char filename[ 10 ];
 		int fd;
 		strcpy( filename, "imgXXXXXX" );
@@ -1575,7 +2686,7 @@ int main( int argc, char *argv[] ) {
 			XSetErrorHandler( _errorHandler );
 			XSetIOErrorHandler( _ioErrorHandler );
 #endif
-			_exec_gui( video_device, timeout_s, _fmt.width, _fmt.height ); // runs an event loop
+			_exec_gui( video_device, timeout_ms, _fmt.width, _fmt.height ); // runs an event loop
 
 			if( _img )
 				XDestroyImage( _img );
@@ -1588,9 +2699,18 @@ int main( int argc, char *argv[] ) {
 
 	_vci->destroy( _vci );
 
+	if( trace ) {
+		FILE *fp = fopen( trace, "w" );
+		video_trace_enable( false );
+		if( fp == NULL || video_trace_dump( fp ) )
+			warn( "writing trace %s", trace );
+		if( fp )
+			fclose( fp );
+	}
+
 	return 0;
 usage:
-	fprintf( stdout, USAGE, argv[0], _fmt.width, _fmt.height, _fmt.pixel_format, timeout_s );
+	fprintf( stdout, USAGE, argv[0], _fmt.width, _fmt.height, _fmt.pixel_format, timeout_ms, buffers );
 	return -1;
 }
 
@@ -23,11 +23,22 @@
 
 struct video_frame;
 struct video_format;
+struct video_export;
+struct video_lease;
+struct video_thread;
+struct video_snapshot;
+struct video_stats;
+struct video_rect;
 
 /**
   * All supported formats' pixel sizes should be defined below.
   */
 #define SIZEOF_PIXEL_YUYV (2)
+
+/**
+  * All timeouts are in milliseconds. DEFAULT selects the device's own
+  * default (2s); NONE does not wait at all.
+  */
 #define VIDEO_DEQ_TIMEOUT_DEFAULT (0)
 #define VIDEO_DEQ_TIMEOUT_NONE    (-1)
 
@@ -47,10 +58,10 @@ struct video_capture {
 	int   (*enqueue1)( struct video_capture *, int buffer_id );
 
 	/**
-	  * Bits in flags correspond to buffers 0..31.
+	  * Bits in flags correspond to buffers 0..63.
 	  * Multiple buffers can be enqueued in one enqueue call.
 	  */
-	int   (*enqueue)( struct video_capture *, unsigned int buffer_flags );
+	int   (*enqueue)( struct video_capture *, uint64_t buffer_flags );
 
 	/**
 	  * Dequeues exactly one of enqueued buffers, if any are available
@@ -59,19 +70,227 @@ struct video_capture {
 	int   (*dequeue)( struct video_capture *, int timeout, 
 			struct video_frame * /* out */ );
 
+	/**
+	  * Waits once, as dequeue does, then dequeues every buffer the driver
+	  * has completed (up to max) without waiting again. Frames are
+	  * returned oldest first. Returns the number of frames, 0 on timeout
+	  * or -1 on error.
+	  */
+	int   (*dequeue_many)( struct video_capture *, int timeout, 
+			struct video_frame * /* out */, int max );
+
+	/**
+	  * Waits once, as dequeue does, then drains every completed buffer
+	  * and returns only the newest, requeueing the rest; *skipped (if
+	  * not NULL) receives how many were requeued unseen. For consumers
+	  * slower than the sensor, this bounds the age of what they process
+	  * to one frame period. Returns as dequeue does.
+	  */
+	int   (*dequeue_latest)( struct video_capture *, int timeout,
+			struct video_frame * /* out */, int *skipped );
+
 	int   (*stop)(    struct video_capture * );
 
 	void  (*destroy)( struct video_capture * );
+
+	/**
+	  * Returns a file descriptor that polls readable when a frame can be
+	  * dequeued without waiting. This is what allows video_loop to wait
+	  * on several devices at once.
+	  */
+	int   (*descriptor)( struct video_capture * );
+
+	/**
+	  * Describes the DMABUF backing a dequeued frame so that it can be
+	  * passed to other components or processes without copying. Buffers
+	  * are exported once during config; returns -1 if the driver did not
+	  * support that.
+	  */
+	int   (*export)( struct video_capture *, const struct video_frame *,
+			struct video_export * /* out */ );
+
+	/**
+	  * Switches to V4L2_MEMORY_USERPTR: frames are captured directly into
+	  * the caller's arena (see video_arena_alloc) instead of driver
+	  * buffers. Must precede config, which slices the arena into as many
+	  * page-aligned frames as fit. The arena must outlive the capture.
+	  */
+	int   (*userptr)( struct video_capture *, void *arena, size_t size );
+
+	/**
+	  * Converts a dequeued frame into a lease holding one reference.
+	  * Instead of enqueueing the buffer, holders (possibly on several
+	  * threads) retain and release the lease; the buffer is enqueued
+	  * automatically by the last release.
+	  */
+	struct video_lease *(*lease)( struct video_capture *,
+			const struct video_frame * );
+
+	/**
+	  * Sets the number of buffers config requests (default
+	  * VIDEO_DEFAULT_BUFFERS) and must therefore precede it. While
+	  * streaming, whenever a dequeue leaves the driver with no buffer to
+	  * fill (i.e. the consumer has fallen behind) one more buffer is
+	  * added, up to max; a max not above count disables growth. The
+	  * driver may grant fewer buffers than asked for.
+	  */
+	int   (*buffers)( struct video_capture *, int count, int max );
+
+	/**
+	  * Points *mode at the modes (pixel format, size and frame rate)
+	  * enumerated when the device was opened and returns their number.
+	  * These are what config chooses from. The array belongs to the
+	  * capture.
+	  */
+	int   (*modes)( struct video_capture *, const struct video_format **mode );
+
+	/**
+	  * Copies the capture's metrics (see vidstats.h). Cheap enough to
+	  * call from a monitoring thread at any rate, while streaming.
+	  */
+	int   (*stats)( struct video_capture *, struct video_stats * /* out */ );
 };
 
+/**
+  * Besides V4L2 device paths, devpath may be "replay:<path>" or
+  * "replay-realtime:<path>" (see video_replay_open), or
+  * "synthetic:<spec>" (see video_synthetic_open).
+  */
 struct video_capture *video_open( const char *devpath );
 
+/**
+  * Replays a recording (a file of raw frames or a directory of PGMs) as
+  * if it were a camera. See replay.c for details.
+  * REALTIME paces delivery by the recording's timestamps (if any) rather
+  * than as fast as frames are dequeued; LOOP restarts at the end instead
+  * of failing dequeue with ENODATA.
+  */
+#define VIDEO_REPLAY_REALTIME (0x1)
+#define VIDEO_REPLAY_LOOP     (0x2)
+
+struct video_capture *video_replay_open( const char *path, int flags );
+
+/**
+  * A camera generating deterministic test patterns; spec is, e.g.,
+  * "1920x1080:YUYV@240:bars". See synthetic.c for details.
+  */
+struct video_capture *video_synthetic_open( const char *spec );
+
+/**
+  * Lease reference counting. Both are safe to call from any thread.
+  */
+struct video_lease *video_lease_retain( struct video_lease * );
+void video_lease_release( struct video_lease * );
+
+/**
+  * Push-mode capture. A dedicated thread dequeues frames as soon as the
+  * driver completes them and passes them through a bounded lock-free
+  * single-producer/single-consumer ring of (at least) capacity frames.
+  * try_pop never blocks; popped frames are owned exactly as if they had
+  * been dequeued by the caller. When the ring is full the newest frame is
+  * requeued and counted as dropped.
+  */
+struct video_thread *video_thread_start( struct video_capture *vci,
+		int capacity, int timeout );
+bool video_thread_try_pop( struct video_thread *, struct video_frame * );
+unsigned long video_thread_dropped( struct video_thread * );
+void video_thread_stop( struct video_thread * );
+
+/**
+  * Persistent snapshots. The stream is started once (the capture must be
+  * configured, not started) and kept running while a thread holds the
+  * newest frame, so a snapshot costs no stream setup and is never more
+  * than a frame period old. video_snapshot_lease shares that frame
+  * without copying (release it with video_lease_release); copy fills
+  * (and if need be reallocates) *frame as video_capture.snap does. Both
+  * wait up to timeout ms, but only for the very first frame.
+  */
+struct video_snapshot *video_snapshot_start( struct video_capture *vci,
+		int timeout );
+struct video_lease *video_snapshot_lease( struct video_snapshot *,
+		int timeout );
+int  video_snapshot_copy( struct video_snapshot *, int timeout,
+		size_t *len, uint8_t **frame );
+void video_snapshot_stop( struct video_snapshot * );
+
+/**
+  * Arenas for video_capture.userptr.
+  * HUGETLB falls back to ordinary (THP-advised) pages when no huge pages
+  * are available; PREFAULT populates the page tables up front so the
+  * first frames don't pay for page faults. The same flags must be passed
+  * to video_arena_free.
+  */
+#define VIDEO_ARENA_HUGETLB  (0x1)
+#define VIDEO_ARENA_PREFAULT (0x2)
+
+void *video_arena_alloc( size_t size, int flags );
+int   video_arena_free( void *arena, size_t size, int flags );
+
+/**
+  * Called by video_loop for each dequeued frame. The handler owns the
+  * frame exactly as if it had called dequeue itself; in particular it
+  * must (eventually) enqueue the buffer again. Returning non-zero ends
+  * the loop.
+  */
+typedef int (*video_frame_handler)( struct video_capture *,
+		struct video_frame *, void *context );
+
+/**
+  * Services n started devices from the calling thread with a single wait
+  * per wakeup, dispatching each ready frame to handler. Timeout (ms)
+  * bounds the wait for *any* device; a non-positive timeout waits forever.
+  * Returns the handler's non-zero value, or -1 on timeout, wait failure
+  * or when no serviceable devices remain.
+  */
+int video_loop( struct video_capture **vci, int n, int timeout,
+		video_frame_handler handler, void *context );
+
 /**
   * YUYV conversion routines.
   */
 void yuyv2gray( const uint16_t *yuyv, int w, int h, uint8_t *o );
+void yuyv2gray_stride( const uint8_t *yuyv, size_t istride, int w, int h,
+		uint8_t *o, size_t ostride );
 void yuyv2rgb( const uint16_t *yuyv, int w, int h, uint8_t *o );
+int yuyv2rgb_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride );
+int yuyv2gray_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride );
+int yuyv2rgb_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+int yuyv2gray_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+
+/**
+  * A capture node found by video_discover. The id is stable across
+  * reboots and re-plugging (unlike the /dev/videoN numbering): it is
+  * derived from the driver, the bus position and the node's index on the
+  * device, so the same camera in the same port always has the same id.
+  */
+struct video_device {
+	char     path[ 64 ];     // e.g. /dev/video2
+	char     card[ 32 ];     // as from VIDIOC_QUERYCAP
+	char     driver[ 16 ];
+	char     bus_info[ 32 ];
+	char     id[ 96 ];
+	unsigned index;          // of the node on its device (sysfs "index")
+	uint32_t caps;           // the node's V4L2_CAP_* (device_caps)
+};
+
+/**
+  * Scans /sys/class/video4linux once and fills in up to max streaming
+  * capture nodes (single- or multi-planar) in /dev/videoN order. Nodes
+  * sysfs already shows can't capture (UVC metadata) aren't opened; the
+  * rest are queried in parallel, and any that haven't answered within
+  * half a second are left out, so a stalled node costs at most that.
+  * Returns the count found or -1 if sysfs is unavailable.
+  */
+int video_discover( struct video_device *dev, int max );
 
+/**
+  * Copies the path of the first capture node (per video_discover, or the
+  * first character device /dev/video0..7 without sysfs) into path.
+  */
 int first_video_dev( char *path, int maxlen );
 
 #endif
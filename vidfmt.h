@@ -34,6 +34,20 @@ struct video_format {
 	unsigned /*short*/ width;
 	unsigned /*short*/ height;
 	char pixel_format[ 4 + 1 /* allow for NUL term */ ];
+	unsigned fps; // 0 means unspecified (or unknown)
+	/**
+	  * Bytes per row (of the first plane) as laid out by the driver,
+	  * which may pad rows. Set by config; ignored in preferences.
+	  */
+	unsigned stride;
+};
+
+/**
+  * A region of interest: columns [x, x + w) of rows [y, y + h).
+  */
+struct video_rect {
+	int x, y;
+	int w, h;
 };
 
 #endif
@@ -25,16 +25,46 @@
 // This ought to be same as in <linux/videodev2.h>
 #define VIDEO_MAX_FRAME (32)
 #endif
-#define ALL_AVAILABLE_BUFFERS (0xFFFFFFFF)
 
 /**
-  * This struct is intended to *overlay* a struct v4l2_buffer to:
+  * Buffers per capture are tracked in a 64-bit mask, hence the ceiling,
+  * which is independent of the (driver-dependent) VIDEO_MAX_FRAME.
+  * Config requests VIDEO_DEFAULT_BUFFERS unless told otherwise (see
+  * video_capture.buffers): enough to ride out scheduling jitter without
+  * adding frames of queueing latency or pinning much memory.
+  */
+#define VIDEO_MAX_BUFFERS     (64)
+#define VIDEO_DEFAULT_BUFFERS (4)
+#define ALL_AVAILABLE_BUFFERS (~(uint64_t)0)
+
+/**
+  * Enough for the semi-planar (NV12, NV16 and their multi-planar
+  * variants) formats supported.
+  */
+#define VIDEO_FRAME_PLANES (3)
+
+/**
+  * One image plane of a frame, e.g. the luma or the interleaved chroma
+  * of NV12.
+  */
+struct video_plane {
+	void    *mem;
+	uint32_t stride;    // bytes per row
+	uint32_t bytesused;
+};
+
+/**
+  * The leading part of this struct is intended to *overlay* a struct
+  * v4l2_buffer to:
   * 1) minimize mem copying required when dequeueing frames, and
   * 2) insulate code external to video.c--in particular, the state machine
   *    implementation--from the V4L2 internals.
+  * The kernel writes only that part; everything after it is filled in by
+  * video_capture.dequeue (and its variants).
   *
-  * AUDIT: The index and timeval members must be in exactly the same
-  * position in this struct and in struct v4l2_buffer.
+  * AUDIT: Every named member of the overlay must be in exactly the same
+  * position as its counterpart in struct v4l2_buffer. video.c checks
+  * this at compile time.
   */
 struct video_frame {
 
@@ -43,11 +73,21 @@ struct video_frame {
 	  */
 	int buffer_id;
 
+	uint32_t pad0;      // <type>
+
 	/**
-	  * This padding insures that the timestamp is in the same position
-	  * in video_frame as it is in v4l2_buffer.
+	  * Bytes of the buffer the frame actually occupies; less than a
+	  * full frame means it was truncated.
 	  */
-	char pad0[16];
+	uint32_t bytesused;
+
+	/**
+	  * V4L2_BUF_FLAG_*, in particular the timestamp type and source and
+	  * V4L2_BUF_FLAG_ERROR.
+	  */
+	uint32_t flags;
+
+	uint32_t field;     // enum v4l2_field
 
 	/**
 	  * This is the actual kernel (or device driver/V4L2)-provided
@@ -55,25 +95,91 @@ struct video_frame {
 	  */
 	struct timeval timestamp;
 
+	char pad1[16];      // <timecode>
+
 	/**
-	  * This padding insures that the two buffers are the same total size
-	  * This is essential since monitor.c will "offer" video_frame pointers
-	  * to video_capture.dequeue which will use them internally as if they
-	  * were v4l2_buffer's to receive dequeued frame information.
+	  * The driver's count of frames since streaming started, including
+	  * any it dropped.
 	  */
-	char pad1[24];
+	uint32_t sequence;
+
+	uint32_t pad2;      // <memory>
 
 	/**
 	  * A pointer to the actual (memory mapped) buffer of the frame
 	  * indicated by <index>.
-	  * This field clobbers the <type> field of struct v4l2_buffer.
-	  * video_capture.dequeue overwrites v4l2_buffer.type with this pointer
-	  * before returning.
+	  * This field clobbers the <m> union of struct v4l2_buffer.
+	  * video_capture.dequeue overwrites it with this pointer before
+	  * returning.
 	  */
 	void *mem;
 
-	char pad2[12];
+	uint32_t length;    // of the buffer (all its planes)
+
+	uint32_t pad3[3];   // <reserved2>, <request_fd> and tail padding
+
+	/**
+	  * End of the overlay.
+	  * Frames the driver dropped between the previous frame dequeued
+	  * from this capture and this one.
+	  */
+	uint32_t gap;
+
+	/**
+	  * The timestamp on CLOCK_MONOTONIC, whatever clock the driver used.
+	  */
+	struct timespec monotonic;
+
+	/**
+	  * CLOCK_MONOTONIC at dequeue minus <monotonic>, i.e. how long the
+	  * frame waited in the driver's done queue (plus any transfer delay
+	  * the driver's timestamp excludes).
+	  */
+	int64_t latency_ns;
+
+	/**
+	  * The frame's image planes: 1 for packed formats (plane[0].mem is
+	  * then just <mem>), 2 for semi-planar ones. Planes may share one
+	  * buffer, one after the other, or (with the V4L2 multi-planar API)
+	  * each have their own.
+	  */
+	int planes;
+	struct video_plane plane[ VIDEO_FRAME_PLANES ];
+};
+
+/**
+  * A copy-free handle to a dequeued frame. The frame's buffer must not be
+  * re-enqueued until every recipient of fd is done with it.
+  */
+struct video_export {
+	int    buffer_id;
+	int    fd;        // DMABUF descriptor, owned by the video_capture
+	size_t length;    // of the whole buffer
+	size_t bytesused; // by the frame currently in the buffer
+};
+
+/**
+  * A reference-counted claim on a dequeued frame's buffer, allowing one
+  * frame to be shared (without copying) by several consumers that finish
+  * with it independently. See video_capture.lease.
+  */
+struct video_lease {
+	struct video_capture *vci;
+	int      buffer_id;
+	void    *mem;
+	size_t   bytesused;
+	int      planes;  // as in the frame leased
+	struct video_plane plane[ VIDEO_FRAME_PLANES ];
+	unsigned refs;    // only ever accessed atomically
 };
 
+/**
+  * For video_capture implementations: issues the lease on dequeued frame
+  * fr from lease[], the implementation's array of one per buffer (of
+  * count), or returns NULL if the buffer is out of range or still leased.
+  */
+struct video_lease *video_lease_issue( struct video_lease *lease, int count,
+		struct video_capture *vci, const struct video_frame *fr );
+
 #endif
 
@@ -0,0 +1,156 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only) 
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * A single-threaded event loop servicing any number of capture devices.
+  * All device descriptors are gathered into one pollfd array up front so
+  * that each wakeup costs exactly one poll() regardless of device count.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <errno.h>
+#include <err.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
+#include "vidfrm.h"
+#include "vidstats.h"
+#include "vidtrace.h"
+
+/**
+  * While any device is parked (see below) poll wakes this often to see
+  * whether it has buffers queued again.
+  */
+#define PARKED_RECHECK_MS (10)
+
+/**
+  * A parked device's descriptor is kept bitwise inverted, which poll
+  * ignores, until buffers are queued to it again. Dropped devices have
+  * no events, which is what distinguishes them.
+  */
+static int _unpark( struct video_capture **vci, struct pollfd *pfd, int n ) {
+
+	struct video_stats st;
+	int i, parked = 0;
+
+	for(i = 0; i < n; i++ ) {
+		if( pfd[i].fd >= 0 || 0 == pfd[i].events )
+			continue;
+		if( vci[i]->stats( vci[i], &st ) == 0 && st.queued > 0 )
+			pfd[i].fd = ~pfd[i].fd;
+		else
+			parked++;
+	}
+	return parked;
+}
+
+int video_loop( struct video_capture **vci, int n, int timeout,
+		video_frame_handler handler, void *context ) {
+
+	struct pollfd *pfd;
+	int i, live = 0, idle = 0, result = -1;
+
+	pfd = calloc( n, sizeof(struct pollfd) );
+	if( NULL == pfd ) {
+		warn( "allocating %d pollfd", n );
+		return -1;
+	}
+
+	for(i = 0; i < n; i++ ) {
+		pfd[i].fd     = vci[i]->descriptor( vci[i] );
+		pfd[i].events = pfd[i].fd >= 0 ? POLLIN : 0;
+		if( pfd[i].fd >= 0 )
+			live++;
+	}
+
+	while( live > 0 ) {
+
+		const int parked
+			= _unpark( vci, pfd, n );
+		const int wait
+			= parked > 0 && ( timeout <= 0 || timeout - idle > PARKED_RECHECK_MS )
+			? PARKED_RECHECK_MS
+			: ( timeout > 0 ? timeout - idle : -1 );
+		const int nfd
+			= poll( pfd, n, wait );
+
+		if( nfd < 0 ) {
+			if( EINTR == errno )
+				continue;
+			warn( "waiting on %d devices", live );
+			break;
+		}
+
+		if( 0 == nfd ) {
+			idle += wait;
+			if( timeout > 0 && idle >= timeout ) {
+				warnx( "video_loop timeout (%dms)", timeout );
+				break;
+			}
+			continue;
+		}
+		idle = 0;
+
+		VIDEO_TRACE( VIDEO_TRACE_WAKEUP, nfd );
+
+		for(i = 0; i < n; i++ ) {
+
+			struct video_frame fr;
+
+			if( pfd[i].revents & POLLIN ) {
+				// Readiness was just reported; don't wait again.
+				fr.flags = 0;
+				if( vci[i]->dequeue( vci[i], VIDEO_DEQ_TIMEOUT_NONE, &fr ) ) {
+					// A corrupt frame still holds a buffer; give it back.
+					if( fr.flags & V4L2_BUF_FLAG_ERROR )
+						vci[i]->enqueue1( vci[i], fr.buffer_id );
+					continue;
+				}
+				if( (result = handler( vci[i], &fr, context )) != 0 )
+					goto done;
+			} else
+			if( pfd[i].revents & (POLLHUP|POLLNVAL) ) {
+				warnx( "dropping device %d from loop (revents %04x)",
+					i, pfd[i].revents );
+				pfd[i].fd     = -1;
+				pfd[i].events = 0;
+				live--;
+			} else
+			if( pfd[i].revents & POLLERR ) {
+				/**
+				  * V4L2 reports POLLERR when a device has nothing
+				  * queued (e.g. the handler is holding every buffer),
+				  * and would keep doing so; park it until that changes.
+				  */
+				pfd[i].fd = ~pfd[i].fd;
+			}
+		}
+		result = -1;
+	}
+
+done:
+	free( pfd );
+	return result;
+}
+
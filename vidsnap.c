@@ -0,0 +1,243 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Persistent snapshots: rather than starting and stopping the stream
+  * for every still (as video_capture.snap does), the stream runs
+  * continuously and a thread keeps a lease on the newest frame. Taking a
+  * snapshot is then just retaining that lease. Every other buffer goes
+  * straight back to the driver, so the driver never starves and the
+  * frame handed out is at most one frame period old.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
+#include "vidfrm.h"
+
+/**
+  * Some (gspca) cameras' first frame is always bad; see _snap in video.c.
+  */
+#define DISCARD_FRAMES (1)
+
+struct video_snapshot {
+
+	struct video_capture *vci;
+	int timeout;
+
+	pthread_t thread;
+	bool      running;   // atomic
+
+	/**
+	  * The newest frame, guarded by lock. The snapshot thread holds one
+	  * reference until a newer frame replaces it.
+	  */
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;
+	struct video_lease *latest;
+};
+
+
+static void *_capture( void *arg ) {
+
+	struct video_snapshot *vs = arg;
+	struct video_capture *vci = vs->vci;
+	int discard = DISCARD_FRAMES;
+
+	while( __atomic_load_n( &vs->running, __ATOMIC_RELAXED ) ) {
+
+		struct video_frame fr;
+		struct video_lease *l, *old;
+
+		fr.flags = 0;
+		if( vci->dequeue( vci, vs->timeout, &fr ) ) {
+			// A corrupt frame still holds a buffer; give it back.
+			if( fr.flags & V4L2_BUF_FLAG_ERROR ) {
+				vci->enqueue1( vci, fr.buffer_id );
+				continue;
+			}
+			// Snapshot holders have every buffer, or a timeout.
+			static const struct timespec BACKOFF = { 0, 1000000 };
+			nanosleep( &BACKOFF, NULL );
+			continue;
+		}
+
+		if( discard > 0 || (l = vci->lease( vci, &fr )) == NULL ) {
+			if( discard > 0 )
+				discard--;
+			vci->enqueue1( vci, fr.buffer_id );
+			continue;
+		}
+
+		pthread_mutex_lock( &vs->lock );
+		old = vs->latest;
+		vs->latest = l;
+		pthread_cond_broadcast( &vs->ready );
+		pthread_mutex_unlock( &vs->lock );
+
+		if( old )
+			video_lease_release( old );
+	}
+	return NULL;
+}
+
+
+/**
+  * Starts the stream (the capture must be configured but not started)
+  * and the thread maintaining the newest frame. Timeout is the thread's
+  * dequeue timeout.
+  */
+struct video_snapshot *video_snapshot_start( struct video_capture *vci,
+		int timeout ) {
+
+	struct video_snapshot *vs
+		= calloc( 1, sizeof(struct video_snapshot) );
+	pthread_condattr_t ca;
+	int e;
+
+	if( vs == NULL ) {
+		warn( "allocating snapshot state" );
+		return NULL;
+	}
+	vs->vci     = vci;
+	vs->timeout = timeout;
+	vs->running = true;
+
+	pthread_mutex_init( &vs->lock, NULL );
+	pthread_condattr_init( &ca );
+	pthread_condattr_setclock( &ca, CLOCK_MONOTONIC );
+	pthread_cond_init( &vs->ready, &ca );
+	pthread_condattr_destroy( &ca );
+
+	vci->enqueue( vci, ALL_AVAILABLE_BUFFERS );
+	if( vci->start( vci ) < 0 )
+		goto unwind;
+
+	if( (e = pthread_create( &vs->thread, NULL, _capture, vs )) != 0 ) {
+		warnx( "pthread_create: error %d", e );
+		vci->stop( vci );
+		goto unwind;
+	}
+	return vs;
+
+unwind:
+	pthread_cond_destroy( &vs->ready );
+	pthread_mutex_destroy( &vs->lock );
+	free( vs );
+	return NULL;
+}
+
+
+/**
+  * Returns a new reference to the newest frame, waiting up to timeout ms
+  * only if there hasn't been any frame yet.
+  */
+struct video_lease *video_snapshot_lease( struct video_snapshot *vs,
+		int timeout ) {
+
+	struct video_lease *l = NULL;
+	struct timespec deadline;
+
+	clock_gettime( CLOCK_MONOTONIC, &deadline );
+	deadline.tv_sec  += timeout / 1000;
+	deadline.tv_nsec += ( timeout % 1000 ) * 1000000L;
+	if( deadline.tv_nsec >= 1000000000L ) {
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec  += 1;
+	}
+
+	pthread_mutex_lock( &vs->lock );
+	while( vs->latest == NULL && timeout > 0 ) {
+		if( pthread_cond_timedwait( &vs->ready, &vs->lock, &deadline ) )
+			break;
+	}
+	if( vs->latest )
+		l = video_lease_retain( vs->latest );
+	pthread_mutex_unlock( &vs->lock );
+
+	if( l == NULL )
+		warnx( "no frame for snapshot (%dms)", timeout );
+	return l;
+}
+
+
+/**
+  * Copies the newest frame as video_capture.snap does: *frame is
+  * reallocated if *len is too small, and *len is set to the frame size.
+  * The planes of planar formats are copied back to back.
+  */
+int video_snapshot_copy( struct video_snapshot *vs, int timeout,
+		size_t *len, uint8_t **frame ) {
+
+	struct video_lease *l
+		= video_snapshot_lease( vs, timeout );
+	int econd = 0;
+
+	if( l == NULL )
+		return -1;
+
+	if( *len < l->bytesused ) {
+		void *p = realloc( *frame, l->bytesused );
+		if( p )
+			*frame = p;
+		else
+			econd = -1;
+	}
+	if( econd == 0 ) {
+		size_t n = 0;
+		int i;
+		for(i = 0; i < l->planes; i++ ) {
+			memcpy( *frame + n, l->plane[i].mem, l->plane[i].bytesused );
+			n += l->plane[i].bytesused;
+		}
+		*len = n;
+	}
+
+	video_lease_release( l );
+	return econd;
+}
+
+
+/**
+  * Joins the thread and stops the stream. Leases still held by callers
+  * remain valid until released.
+  */
+void video_snapshot_stop( struct video_snapshot *vs ) {
+
+	__atomic_store_n( &vs->running, false, __ATOMIC_RELAXED );
+	pthread_join( vs->thread, NULL );
+
+	if( vs->latest )
+		video_lease_release( vs->latest );
+	vs->vci->stop( vs->vci );
+
+	pthread_cond_destroy( &vs->ready );
+	pthread_mutex_destroy( &vs->lock );
+	free( vs );
+}
+
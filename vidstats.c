@@ -0,0 +1,78 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Capture metrics shared by all video_capture implementations. Updates
+  * are relaxed atomic adds, so they cost next to nothing and a copy taken
+  * on another thread is consistent counter by counter (though not
+  * necessarily across counters).
+  */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "video.h"
+#include "vidfrm.h"
+#include "vidstats.h"
+
+static inline int _bucket( int64_t ns ) {
+	const int64_t US = ns / 1000;
+	int b;
+	if( US < 1 )
+		return 0;
+	b = 64 - __builtin_clzll( (uint64_t)US );
+	return b < VIDEO_STATS_BUCKETS ? b : VIDEO_STATS_BUCKETS - 1;
+}
+
+
+void video_stats_frame( struct video_stats *st, const struct video_frame *fr ) {
+
+	const int64_t NS
+		= fr->monotonic.tv_sec*1000000000LL + fr->monotonic.tv_nsec;
+	const int64_t LAST
+		= __atomic_load_n( &st->last_ns, __ATOMIC_RELAXED );
+
+	__atomic_add_fetch( &st->frames, 1, __ATOMIC_RELAXED );
+	if( fr->gap )
+		__atomic_add_fetch( &st->dropped, fr->gap, __ATOMIC_RELAXED );
+
+	__atomic_add_fetch( st->latency + _bucket( fr->latency_ns ), 1, __ATOMIC_RELAXED );
+	if( LAST )
+		__atomic_add_fetch( st->interval + _bucket( NS - LAST ), 1, __ATOMIC_RELAXED );
+	__atomic_store_n( &st->last_ns, NS, __ATOMIC_RELAXED );
+}
+
+
+void video_stats_copy( struct video_stats *dst, const struct video_stats *src ) {
+
+	int i;
+
+	dst->frames   = __atomic_load_n( &src->frames,   __ATOMIC_RELAXED );
+	dst->timeouts = __atomic_load_n( &src->timeouts, __ATOMIC_RELAXED );
+	dst->errors   = __atomic_load_n( &src->errors,   __ATOMIC_RELAXED );
+	dst->dropped  = __atomic_load_n( &src->dropped,  __ATOMIC_RELAXED );
+	dst->last_ns  = __atomic_load_n( &src->last_ns,  __ATOMIC_RELAXED );
+	for(i = 0; i < VIDEO_STATS_BUCKETS; i++ ) {
+		dst->latency[i]  = __atomic_load_n( src->latency  + i, __ATOMIC_RELAXED );
+		dst->interval[i] = __atomic_load_n( src->interval + i, __ATOMIC_RELAXED );
+	}
+}
+
@@ -0,0 +1,71 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+
+#ifndef _vidstats_h_
+#define _vidstats_h_
+
+/**
+  * Histogram bucket 0 counts values under 1us; bucket i > 0 counts
+  * [2^(i-1), 2^i) microseconds, and the last bucket everything above.
+  */
+#define VIDEO_STATS_BUCKETS (32)
+
+/**
+  * Always-on capture metrics, maintained by every video_capture with
+  * relaxed atomics and copied out by video_capture.stats. Counters are
+  * cumulative from open; rates are for the client to derive.
+  */
+struct video_stats {
+
+	unsigned long frames;   // dequeued from the driver, whatever became of them
+	unsigned long timeouts; // waits for a frame that expired
+	unsigned long errors;   // V4L2_BUF_FLAG_ERROR buffers and failed dequeues
+	unsigned long dropped;  // by the driver, i.e. the sum of frame gaps
+
+	unsigned queued;        // buffers with the driver (at the time of the copy)
+	unsigned buffers;       // buffers in all
+
+	/**
+	  * CLOCK_MONOTONIC timestamp (ns) of the latest frame.
+	  */
+	int64_t last_ns;
+
+	/**
+	  * Driver timestamp to dequeue (video_frame.latency_ns), and
+	  * timestamp to timestamp of consecutive frames.
+	  */
+	unsigned long latency [ VIDEO_STATS_BUCKETS ];
+	unsigned long interval[ VIDEO_STATS_BUCKETS ];
+};
+
+/**
+  * Helpers for video_capture implementations.
+  * video_stats_frame accounts for one dequeued frame; it must only be
+  * called by the dequeueing thread, though copy may run on any.
+  */
+void video_stats_frame( struct video_stats *, const struct video_frame * );
+void video_stats_copy( struct video_stats *dst, const struct video_stats *src );
+
+static inline void video_stats_count( unsigned long *counter ) {
+	__atomic_add_fetch( counter, 1, __ATOMIC_RELAXED );
+}
+
+#endif
+
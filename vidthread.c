@@ -0,0 +1,187 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only) 
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Push-mode capture: a dedicated thread services the driver (DQBUF) as
+  * soon as frames complete and hands them to the consumer through a
+  * bounded single-producer/single-consumer ring. Consumer jitter then
+  * only costs frames when the ring itself overflows, and in that case the
+  * newest frame is dropped and its buffer immediately requeued so the
+  * driver never starves.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
+#include "vidfrm.h"
+
+#define CACHE_LINE (64)
+
+struct video_thread {
+
+	struct video_capture *vci;
+	int timeout;
+
+	pthread_t thread;
+	bool      running;   // atomic
+
+	/**
+	  * Frames dropped because the ring was full.
+	  */
+	unsigned long dropped; // atomic
+
+	/**
+	  * Producer and consumer indices are free-running and each lives on
+	  * its own cache line; slot i is ring[ i & mask ].
+	  */
+	unsigned mask;
+	unsigned head __attribute__((aligned(CACHE_LINE))); // written by producer
+	unsigned tail __attribute__((aligned(CACHE_LINE))); // written by consumer
+
+	struct video_frame ring[] __attribute__((aligned(CACHE_LINE)));
+};
+
+
+static bool _push( struct video_thread *vt, const struct video_frame *fr ) {
+
+	const unsigned HEAD
+		= __atomic_load_n( &vt->head, __ATOMIC_RELAXED );
+
+	if( HEAD - __atomic_load_n( &vt->tail, __ATOMIC_ACQUIRE ) > vt->mask )
+		return false; // full
+
+	vt->ring[ HEAD & vt->mask ] = *fr;
+	__atomic_store_n( &vt->head, HEAD + 1, __ATOMIC_RELEASE );
+	return true;
+}
+
+
+bool video_thread_try_pop( struct video_thread *vt, struct video_frame *fr ) {
+
+	const unsigned TAIL
+		= __atomic_load_n( &vt->tail, __ATOMIC_RELAXED );
+
+	if( TAIL == __atomic_load_n( &vt->head, __ATOMIC_ACQUIRE ) )
+		return false; // empty
+
+	*fr = vt->ring[ TAIL & vt->mask ];
+	__atomic_store_n( &vt->tail, TAIL + 1, __ATOMIC_RELEASE );
+	return true;
+}
+
+
+static void *_capture( void *arg ) {
+
+	struct video_thread *vt = arg;
+	struct video_capture *vci = vt->vci;
+
+	while( __atomic_load_n( &vt->running, __ATOMIC_RELAXED ) ) {
+
+		struct video_frame fr;
+
+		fr.flags = 0;
+		if( vci->dequeue( vci, vt->timeout, &fr ) ) {
+			// A corrupt frame still holds a buffer; give it back.
+			if( fr.flags & V4L2_BUF_FLAG_ERROR ) {
+				vci->enqueue1( vci, fr.buffer_id );
+				continue;
+			}
+			// Nothing queued (consumer holds every buffer) or a
+			// timeout; either way don't spin.
+			static const struct timespec BACKOFF = { 0, 1000000 };
+			nanosleep( &BACKOFF, NULL );
+			continue;
+		}
+
+		if( ! _push( vt, &fr ) ) {
+			vci->enqueue1( vci, fr.buffer_id );
+			__atomic_add_fetch( &vt->dropped, 1, __ATOMIC_RELAXED );
+		}
+	}
+	return NULL;
+}
+
+
+/**
+  * The stream must already be started and buffers queued. Capacity is
+  * rounded up to a power of 2.
+  */
+struct video_thread *video_thread_start( struct video_capture *vci,
+		int capacity, int timeout ) {
+
+	struct video_thread *vt = NULL;
+	unsigned n = 1;
+	int e;
+
+	while( n < capacity )
+		n <<= 1;
+
+	if( posix_memalign( (void**)&vt, CACHE_LINE,
+			sizeof(struct video_thread) + n*sizeof(struct video_frame) ) ) {
+		warnx( "allocating capture thread ring (%d)", n );
+		return NULL;
+	}
+
+	vt->vci     = vci;
+	vt->timeout = timeout;
+	vt->running = true;
+	vt->dropped = 0;
+	vt->mask    = n - 1;
+	vt->head    = 0;
+	vt->tail    = 0;
+
+	if( (e = pthread_create( &vt->thread, NULL, _capture, vt )) != 0 ) {
+		warnx( "pthread_create: error %d", e );
+		free( vt );
+		return NULL;
+	}
+	return vt;
+}
+
+
+/**
+  * Joins the capture thread (which may take up to its dequeue timeout)
+  * and returns any frames the consumer never popped to the driver.
+  */
+void video_thread_stop( struct video_thread *vt ) {
+
+	struct video_frame fr;
+
+	__atomic_store_n( &vt->running, false, __ATOMIC_RELAXED );
+	pthread_join( vt->thread, NULL );
+
+	while( video_thread_try_pop( vt, &fr ) )
+		vt->vci->enqueue1( vt->vci, fr.buffer_id );
+
+	free( vt );
+}
+
+
+unsigned long video_thread_dropped( struct video_thread *vt ) {
+	return __atomic_load_n( &vt->dropped, __ATOMIC_RELAXED );
+}
+
@@ -0,0 +1,151 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  *
+  * Per-thread trace rings; see vidtrace.h.
+  *
+  * A thread's ring is allocated by its first event and pushed (lock-free)
+  * onto a global list for the dumper. Rings are never freed, so events of
+  * threads that have since exited still appear in dumps.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "vidtrace.h"
+
+#define TRACE_RING (8192) // events per thread; a power of 2
+
+struct trace_entry {
+	int64_t  ns;          // CLOCK_MONOTONIC
+	uint32_t arg;
+	uint32_t event;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t    tid;
+	unsigned head;        // free-running; written only by the owner
+	struct trace_entry entry[ TRACE_RING ];
+};
+
+bool video_trace_enabled = false;
+
+static struct trace_ring *_rings = NULL;
+
+static __thread struct trace_ring *_ring = NULL;
+
+static const char *NAME[ VIDEO_TRACE_EVENTS ] = {
+	"QBUF",
+	"DQBUF",
+	"wakeup",
+	"convert",
+	"convert",
+	"render",
+	"render",
+};
+
+static const char PHASE[ VIDEO_TRACE_EVENTS ] = {
+	'i', 'i', 'i', 'B', 'E', 'B', 'E'
+};
+
+
+static struct trace_ring *_register( void ) {
+
+	struct trace_ring *r
+		= calloc( 1, sizeof(struct trace_ring) );
+
+	if( r == NULL )
+		return NULL;
+	r->tid  = syscall( SYS_gettid );
+	r->next = __atomic_load_n( &_rings, __ATOMIC_RELAXED );
+	while( ! __atomic_compare_exchange_n( &_rings, &r->next, r,
+			true, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+		;
+	return r;
+}
+
+
+void video_trace_record( enum video_trace_event event, uint32_t arg ) {
+
+	struct trace_entry *e;
+	struct timespec now;
+	unsigned head;
+
+	if( _ring == NULL && (_ring = _register()) == NULL )
+		return;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	head = _ring->head;
+	e = _ring->entry + ( head & ( TRACE_RING - 1 ) );
+	e->ns    = now.tv_sec*1000000000LL + now.tv_nsec;
+	e->arg   = arg;
+	e->event = event;
+	__atomic_store_n( &_ring->head, head + 1, __ATOMIC_RELEASE );
+}
+
+
+void video_trace_enable( bool enable ) {
+	__atomic_store_n( &video_trace_enabled, enable, __ATOMIC_RELAXED );
+}
+
+
+int video_trace_dump( FILE *fp ) {
+
+	const struct trace_ring *r;
+	const pid_t PID = getpid();
+	const char *sep = "";
+
+	fprintf( fp, "{\"traceEvents\":[\n" );
+
+	for(r = __atomic_load_n( &_rings, __ATOMIC_ACQUIRE ); r; r = r->next ) {
+
+		const unsigned HEAD
+			= __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+		unsigned i
+			= HEAD > TRACE_RING ? HEAD - TRACE_RING : 0;
+
+		for(; i != HEAD; i++ ) {
+			const struct trace_entry *e
+				= r->entry + ( i & ( TRACE_RING - 1 ) );
+			if( e->event >= VIDEO_TRACE_EVENTS )
+				continue;
+			fprintf( fp,
+				"%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03d,"
+				"\"pid\":%d,\"tid\":%d%s,\"args\":{\"arg\":%u}}",
+				sep,
+				NAME[ e->event ],
+				PHASE[ e->event ],
+				(long long)( e->ns / 1000 ), (int)( e->ns % 1000 ),
+				PID, r->tid,
+				PHASE[ e->event ] == 'i' ? ",\"s\":\"t\"" : "",
+				e->arg );
+			sep = ",\n";
+		}
+	}
+
+	fprintf( fp, "\n],\"displayTimeUnit\":\"ns\"}\n" );
+	return ferror( fp ) ? -1 : 0;
+}
+
@@ -0,0 +1,64 @@
+
+/**
+  * Simple wrapper API for accessing imaging devices through the V4L2
+  * API (Linux only)
+  * Copyright (C) 2015  Roger Kramer
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+
+#ifndef _vidtrace_h_
+#define _vidtrace_h_
+
+/**
+  * Hot-path event tracing. Each thread records into its own fixed-size
+  * ring (the oldest events are overwritten), so recording takes no locks
+  * and makes no system calls beyond reading the clock. Tracing is always
+  * compiled in but disabled until video_trace_enable(true); disabled,
+  * each trace point costs one predictable branch.
+  *
+  * video_trace_dump writes every thread's ring as Chrome trace JSON
+  * (loadable in chrome://tracing or Perfetto). Dump after disabling;
+  * events recorded during a dump may be garbled.
+  */
+
+enum video_trace_event {
+	VIDEO_TRACE_QBUF,          // arg: buffer index
+	VIDEO_TRACE_DQBUF,         // arg: buffer index
+	VIDEO_TRACE_WAKEUP,        // arg: descriptors ready
+	VIDEO_TRACE_CONVERT_BEGIN, // arg: pixels
+	VIDEO_TRACE_CONVERT_END,
+	VIDEO_TRACE_RENDER_BEGIN,  // arg: buffer index, if known
+	VIDEO_TRACE_RENDER_END,
+	VIDEO_TRACE_EVENTS
+};
+
+void video_trace_enable( bool enable );
+int  video_trace_dump( FILE *fp );
+
+/**
+  * For trace points.
+  */
+extern bool video_trace_enabled;
+
+void video_trace_record( enum video_trace_event, uint32_t arg );
+
+#define VIDEO_TRACE(event,arg) \
+	do { \
+		if( __builtin_expect( __atomic_load_n( &video_trace_enabled, __ATOMIC_RELAXED ), 0 ) ) \
+			video_trace_record( (event), (arg) ); \
+	} while(0)
+
+#endif
+
@@ -18,27 +18,154 @@
   * along with this program.  If not, see <http://www.gnu.org/licenses/>.
   */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 
-void yuyv2gray( const uint16_t *yuyv, int w, int h, uint8_t *o ) {
-#if 0
-	int r, c;
-	for(r = 0; r < h; r++ ) {
-		for(c = 0; c < w; c++ ) {
-			o[ r*w + c ] = i[ r*w*2 + c*2 ];
-		}
+#include "vidfmt.h"
+#include "vidtrace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+  * Row converters take a row of w YUYV pixels and write w output pixels.
+  * Each has a scalar reference and, on x86, vectorized variants chosen
+  * on first use by what the CPU supports; racing first calls just
+  * choose the same thing.
+  */
+typedef void (*gray_row_t)( const uint8_t *iline, int w, uint8_t *oline );
+typedef void (*rgb_row_t)( const uint8_t *iline, int w, uint8_t *oline );
+
+/**
+  * Luminance is the even (low, as uint16_t) byte of every pixel.
+  */
+static void _gray_pixels( const uint8_t *iline, int c, int w, uint8_t *oline ) {
+	for(; c < w; c++ )
+		oline[c] = iline[2*c];
+}
+
+
+static void _gray_row_scalar( const uint8_t *iline, int w, uint8_t *oline ) {
+	_gray_pixels( iline, 0, w, oline );
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/**
+  * Mask off the chroma bytes and let packuswb (which can't saturate
+  * what's left) narrow the words; the wider variants' packs interleave
+  * their 128-bit lanes, which a 64-bit permute undoes.
+  */
+
+__attribute__((target("sse2")))
+static void _gray_row_sse2( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m128i LO = _mm_set1_epi16( 0xFF );
+	int c;
+
+	for(c = 0; c + 16 <= w; c += 16 ) {
+		const __m128i A = _mm_loadu_si128( (const __m128i*)( iline + 2*c ) );
+		const __m128i B = _mm_loadu_si128( (const __m128i*)( iline + 2*c + 16 ) );
+		_mm_storeu_si128( (__m128i*)( oline + c ),
+			_mm_packus_epi16( _mm_and_si128( A, LO ), _mm_and_si128( B, LO ) ) );
 	}
-#else
-	int r, c;
-	for(r = 0; r < h; r++ ) {
-		for(c = 0; c < w; c++ ) {
-			// Following demonstrates that when input is treated as
-			// the 2-byte-per-pixel data it is, luminance is the low
-			// byte in every pair.
-			o[ r*w + c ] = (uint8_t)(0x00FF & yuyv[ r*w + c ]);
-		}
+	_gray_pixels( iline, c, w, oline );
+}
+
+
+__attribute__((target("avx2")))
+static void _gray_row_avx2( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m256i LO = _mm256_set1_epi16( 0xFF );
+	int c;
+
+	for(c = 0; c + 32 <= w; c += 32 ) {
+		const __m256i A = _mm256_loadu_si256( (const __m256i*)( iline + 2*c ) );
+		const __m256i B = _mm256_loadu_si256( (const __m256i*)( iline + 2*c + 32 ) );
+		const __m256i P = _mm256_packus_epi16(
+			_mm256_and_si256( A, LO ), _mm256_and_si256( B, LO ) );
+		_mm256_storeu_si256( (__m256i*)( oline + c ),
+			_mm256_permute4x64_epi64( P, 0xD8 ) );
 	}
+	_gray_pixels( iline, c, w, oline );
+}
+
+
+__attribute__((target("avx512bw")))
+static void _gray_row_avx512( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m512i LO = _mm512_set1_epi16( 0xFF );
+	const __m512i ORDER = _mm512_setr_epi64( 0, 2, 4, 6, 1, 3, 5, 7 );
+	int c;
+
+	for(c = 0; c + 64 <= w; c += 64 ) {
+		const __m512i A = _mm512_loadu_si512( (const void*)( iline + 2*c ) );
+		const __m512i B = _mm512_loadu_si512( (const void*)( iline + 2*c + 64 ) );
+		const __m512i P = _mm512_packus_epi16(
+			_mm512_and_si512( A, LO ), _mm512_and_si512( B, LO ) );
+		_mm512_storeu_si512( (void*)( oline + c ),
+			_mm512_permutexvar_epi64( ORDER, P ) );
+	}
+	_gray_pixels( iline, c, w, oline );
+}
+
 #endif
+
+static gray_row_t _gray_row = NULL;
+
+static gray_row_t _select_gray_row( void ) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512bw" ) )
+		return _gray_row_avx512;
+	if( __builtin_cpu_supports( "avx2" ) )
+		return _gray_row_avx2;
+	if( __builtin_cpu_supports( "sse2" ) )
+		return _gray_row_sse2;
+#endif
+	return _gray_row_scalar;
+}
+
+
+static gray_row_t _get_gray_row( void ) {
+
+	gray_row_t row
+		= __atomic_load_n( &_gray_row, __ATOMIC_RELAXED );
+
+	if( row == NULL ) {
+		row = _select_gray_row();
+		__atomic_store_n( &_gray_row, row, __ATOMIC_RELAXED );
+	}
+	return row;
+}
+
+
+/**
+  * Rows are istride bytes apart in the input and ostride bytes apart in
+  * the output, so drivers' padded rows can be read and luma written
+  * straight into a padded (e.g. analysis) buffer. Neither padding is
+  * read or written.
+  */
+void yuyv2gray_stride( const uint8_t *yuyv, size_t istride, int w, int h,
+		uint8_t *o, size_t ostride ) {
+
+	const gray_row_t row = _get_gray_row();
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, w*h );
+	for(int r = 0; r < h; r++ )
+		row( yuyv + r*istride, w, o + r*ostride );
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+}
+
+
+void yuyv2gray( const uint16_t *yuyv, int w, int h, uint8_t *o ) {
+	yuyv2gray_stride( (const uint8_t*)yuyv, 2*w, w, h, o, w );
 }
 
 
@@ -80,36 +207,814 @@ static inline void YUV2RGB( int y, int u, int v, uint8_t *rgb ) {
 }
 
 
+/**
+  * Converts pixels [c, w) of a row, c being even. Rows are converted pair
+  * by pair from their start, so the final pixel of an odd width has no V
+  * of its own and borrows the preceding pair's (or neutral chroma).
+  * This is the reference the vectorized rows must match bit for bit.
+  */
+static void _rgb_pixels( const uint8_t *iline, int c, int w, uint8_t *oline ) {
+	for(; c + 1 < w; c += 2 ) {
+		const int Y0 = iline[2*c+0];
+		const int U  = iline[2*c+1];
+		const int Y1 = iline[2*c+2];
+		const int V  = iline[2*c+3];
+		YUV2RGB( Y0, U, V, oline + 3*(c+0) );
+		YUV2RGB( Y1, U, V, oline + 3*(c+1) );
+	}
+	if( c < w )
+		YUV2RGB( iline[2*c], iline[2*c+1], c > 0 ? iline[2*c-1] : 128,
+			oline + 3*c );
+}
+
+
+static void _rgb_row_scalar( const uint8_t *iline, int w, uint8_t *oline ) {
+	_rgb_pixels( iline, 0, w, oline );
+}
+
+
+#if defined(HAVE_X86_SIMD) && ! defined(HAVE_FLOAT_CONVERSION)
+#define HAVE_SIMD_CONVERSION
+
+/**
+  * The vectorized rows evaluate exactly the integer expressions of
+  * YUV2RGB: luma terms (298*C + 128) and the chroma terms of each pixel
+  * pair are 32-bit multiply-adds (pmaddwd) of 16-bit pairs, summed,
+  * shifted and clamped. Pixels leave as R,G,B,0 quads whose padding
+  * byte the next pixel's store overwrites, so every block must be
+  * followed by at least 2 pixels; the scalar code converts the rest.
+  *
+  * Lane bookkeeping is entirely within 128-bit lanes: the low halves of
+  * each lane's unpacks are its first 4 pixels and the high its last 4.
+  */
+
+#define KY ( 298 | ( 128 << 16 ) )                      // C, 1
+#define KR ( (uint32_t)409 << 16 )                      // D, E
+#define KG ( (uint16_t)-100 | ( (uint32_t)(uint16_t)-208 << 16 ) )
+#define KB ( 516 )
+
+__attribute__((target("sse2")))
+static inline __m128i _channel_sse2( __m128i yl, __m128i yh, __m128i ch ) {
+	const __m128i LO
+		= _mm_srai_epi32( _mm_add_epi32( yl, _mm_unpacklo_epi32( ch, ch ) ), 8 );
+	const __m128i HI
+		= _mm_srai_epi32( _mm_add_epi32( yh, _mm_unpackhi_epi32( ch, ch ) ), 8 );
+	return _mm_min_epi16( _mm_max_epi16( _mm_packs_epi32( LO, HI ),
+		_mm_setzero_si128() ), _mm_set1_epi16( 255 ) );
+}
+
+
+__attribute__((target("sse2")))
+static void _rgb_row_sse2( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m128i ONE = _mm_set1_epi16( 1 );
+	int c;
+
+	for(c = 0; c + 8 + 2 <= w; c += 8 ) {
+
+		const __m128i X  = _mm_loadu_si128( (const __m128i*)( iline + 2*c ) );
+		const __m128i C  = _mm_sub_epi16( _mm_and_si128( X, _mm_set1_epi16( 0xFF ) ),
+			_mm_set1_epi16( 16 ) );
+		const __m128i DE = _mm_sub_epi16( _mm_srli_epi16( X, 8 ), _mm_set1_epi16( 128 ) );
+		const __m128i YL = _mm_madd_epi16( _mm_unpacklo_epi16( C, ONE ), _mm_set1_epi32( KY ) );
+		const __m128i YH = _mm_madd_epi16( _mm_unpackhi_epi16( C, ONE ), _mm_set1_epi32( KY ) );
+		const __m128i R  = _channel_sse2( YL, YH, _mm_madd_epi16( DE, _mm_set1_epi32( KR ) ) );
+		const __m128i G  = _channel_sse2( YL, YH, _mm_madd_epi16( DE, _mm_set1_epi32( KG ) ) );
+		const __m128i B  = _channel_sse2( YL, YH, _mm_madd_epi16( DE, _mm_set1_epi32( KB ) ) );
+		const __m128i RG = _mm_or_si128( R, _mm_slli_epi16( G, 8 ) );
+		uint32_t px[8];
+		int i;
+
+		// Without pshufb, RGB24 is best written a quad at a time.
+
+		_mm_storeu_si128( (__m128i*)( px + 0 ), _mm_unpacklo_epi16( RG, B ) );
+		_mm_storeu_si128( (__m128i*)( px + 4 ), _mm_unpackhi_epi16( RG, B ) );
+		for(i = 0; i < 8; i++ )
+			memcpy( oline + 3*(c+i), px + i, 4 );
+	}
+	_rgb_pixels( iline, c, w, oline );
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i _channel_avx2( __m256i yl, __m256i yh, __m256i ch ) {
+	const __m256i LO
+		= _mm256_srai_epi32( _mm256_add_epi32( yl, _mm256_unpacklo_epi32( ch, ch ) ), 8 );
+	const __m256i HI
+		= _mm256_srai_epi32( _mm256_add_epi32( yh, _mm256_unpackhi_epi32( ch, ch ) ), 8 );
+	return _mm256_min_epi16( _mm256_max_epi16( _mm256_packs_epi32( LO, HI ),
+		_mm256_setzero_si256() ), _mm256_set1_epi16( 255 ) );
+}
+
+
+__attribute__((target("avx2")))
+static void _rgb_row_avx2( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m256i ONE = _mm256_set1_epi16( 1 );
+	const __m256i PACK = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+	int c;
+
+	for(c = 0; c + 16 + 2 <= w; c += 16 ) {
+
+		const __m256i X  = _mm256_loadu_si256( (const __m256i*)( iline + 2*c ) );
+		const __m256i C  = _mm256_sub_epi16( _mm256_and_si256( X, _mm256_set1_epi16( 0xFF ) ),
+			_mm256_set1_epi16( 16 ) );
+		const __m256i DE = _mm256_sub_epi16( _mm256_srli_epi16( X, 8 ), _mm256_set1_epi16( 128 ) );
+		const __m256i YL = _mm256_madd_epi16( _mm256_unpacklo_epi16( C, ONE ), _mm256_set1_epi32( KY ) );
+		const __m256i YH = _mm256_madd_epi16( _mm256_unpackhi_epi16( C, ONE ), _mm256_set1_epi32( KY ) );
+		const __m256i R  = _channel_avx2( YL, YH, _mm256_madd_epi16( DE, _mm256_set1_epi32( KR ) ) );
+		const __m256i G  = _channel_avx2( YL, YH, _mm256_madd_epi16( DE, _mm256_set1_epi32( KG ) ) );
+		const __m256i B  = _channel_avx2( YL, YH, _mm256_madd_epi16( DE, _mm256_set1_epi32( KB ) ) );
+		const __m256i RG = _mm256_or_si256( R, _mm256_slli_epi16( G, 8 ) );
+		const __m256i P0 = _mm256_shuffle_epi8( _mm256_unpacklo_epi16( RG, B ), PACK );
+		const __m256i P1 = _mm256_shuffle_epi8( _mm256_unpackhi_epi16( RG, B ), PACK );
+		uint8_t *o = oline + 3*c;
+
+		// Pixels 0-3, 4-7, 8-11, 12-15 in 12 bytes of 16.
+
+		_mm_storeu_si128( (__m128i*)( o +  0 ), _mm256_castsi256_si128( P0 ) );
+		_mm_storeu_si128( (__m128i*)( o + 12 ), _mm256_castsi256_si128( P1 ) );
+		_mm_storeu_si128( (__m128i*)( o + 24 ), _mm256_extracti128_si256( P0, 1 ) );
+		_mm_storeu_si128( (__m128i*)( o + 36 ), _mm256_extracti128_si256( P1, 1 ) );
+	}
+	_rgb_pixels( iline, c, w, oline );
+}
+
+
+__attribute__((target("avx512bw")))
+static inline __m512i _channel_avx512( __m512i yl, __m512i yh, __m512i ch ) {
+	const __m512i LO
+		= _mm512_srai_epi32( _mm512_add_epi32( yl, _mm512_unpacklo_epi32( ch, ch ) ), 8 );
+	const __m512i HI
+		= _mm512_srai_epi32( _mm512_add_epi32( yh, _mm512_unpackhi_epi32( ch, ch ) ), 8 );
+	return _mm512_min_epi16( _mm512_max_epi16( _mm512_packs_epi32( LO, HI ),
+		_mm512_setzero_si512() ), _mm512_set1_epi16( 255 ) );
+}
+
+
+__attribute__((target("avx512bw")))
+static void _rgb_row_avx512( const uint8_t *iline, int w, uint8_t *oline ) {
+
+	const __m512i ONE = _mm512_set1_epi16( 1 );
+	const __m512i PACK = _mm512_broadcast_i32x4( _mm_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 ) );
+	int c;
+
+	for(c = 0; c + 32 + 2 <= w; c += 32 ) {
+
+		const __m512i X  = _mm512_loadu_si512( (const void*)( iline + 2*c ) );
+		const __m512i C  = _mm512_sub_epi16( _mm512_and_si512( X, _mm512_set1_epi16( 0xFF ) ),
+			_mm512_set1_epi16( 16 ) );
+		const __m512i DE = _mm512_sub_epi16( _mm512_srli_epi16( X, 8 ), _mm512_set1_epi16( 128 ) );
+		const __m512i YL = _mm512_madd_epi16( _mm512_unpacklo_epi16( C, ONE ), _mm512_set1_epi32( KY ) );
+		const __m512i YH = _mm512_madd_epi16( _mm512_unpackhi_epi16( C, ONE ), _mm512_set1_epi32( KY ) );
+		const __m512i R  = _channel_avx512( YL, YH, _mm512_madd_epi16( DE, _mm512_set1_epi32( KR ) ) );
+		const __m512i G  = _channel_avx512( YL, YH, _mm512_madd_epi16( DE, _mm512_set1_epi32( KG ) ) );
+		const __m512i B  = _channel_avx512( YL, YH, _mm512_madd_epi16( DE, _mm512_set1_epi32( KB ) ) );
+		const __m512i RG = _mm512_or_si512( R, _mm512_slli_epi16( G, 8 ) );
+		const __m512i P0 = _mm512_shuffle_epi8( _mm512_unpacklo_epi16( RG, B ), PACK );
+		const __m512i P1 = _mm512_shuffle_epi8( _mm512_unpackhi_epi16( RG, B ), PACK );
+		uint8_t *o = oline + 3*c;
+
+		_mm_storeu_si128( (__m128i*)( o +  0 ), _mm512_extracti32x4_epi32( P0, 0 ) );
+		_mm_storeu_si128( (__m128i*)( o + 12 ), _mm512_extracti32x4_epi32( P1, 0 ) );
+		_mm_storeu_si128( (__m128i*)( o + 24 ), _mm512_extracti32x4_epi32( P0, 1 ) );
+		_mm_storeu_si128( (__m128i*)( o + 36 ), _mm512_extracti32x4_epi32( P1, 1 ) );
+		_mm_storeu_si128( (__m128i*)( o + 48 ), _mm512_extracti32x4_epi32( P0, 2 ) );
+		_mm_storeu_si128( (__m128i*)( o + 60 ), _mm512_extracti32x4_epi32( P1, 2 ) );
+		_mm_storeu_si128( (__m128i*)( o + 72 ), _mm512_extracti32x4_epi32( P0, 3 ) );
+		_mm_storeu_si128( (__m128i*)( o + 84 ), _mm512_extracti32x4_epi32( P1, 3 ) );
+	}
+	_rgb_pixels( iline, c, w, oline );
+}
+
+#endif
+
+static rgb_row_t _rgb_row = NULL;
+
+static rgb_row_t _select_rgb_row( void ) {
+#ifdef HAVE_SIMD_CONVERSION
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512bw" ) )
+		return _rgb_row_avx512;
+	if( __builtin_cpu_supports( "avx2" ) )
+		return _rgb_row_avx2;
+	if( __builtin_cpu_supports( "sse2" ) )
+		return _rgb_row_sse2;
+#endif
+	return _rgb_row_scalar;
+}
+
+
+static rgb_row_t _get_rgb_row( void ) {
+
+	rgb_row_t row
+		= __atomic_load_n( &_rgb_row, __ATOMIC_RELAXED );
+
+	if( row == NULL ) {
+		row = _select_rgb_row();
+		__atomic_store_n( &_rgb_row, row, __ATOMIC_RELAXED );
+	}
+	return row;
+}
+
+
 void yuyv2rgb( const uint16_t *yuyv, int w, int h, uint8_t *o ) {
 
+	const rgb_row_t row = _get_rgb_row();
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, w*h );
+
 	for(int r = 0; r < h; r++ ) {
-#if 0
-		/**
-		  * ...grayscale rendered as 24-bit color in the process.
-		  */
-		for(c = 0; c < w; c++ ) {
-			const uint8_t GRAY
-				= (uint8_t)(0x00FF & yuyv[ r*w + c ]);
-			o[ 4*w*r + 4*c+2 ] = GRAY; // red
-			o[ 4*w*r + 4*c+1 ] = GRAY; // green
-			o[ 4*w*r + 4*c+0 ] = GRAY; // blue
-		}
-#else
 		/**
 		  * ...24-bit color in the process.
 		  */
-		const uint8_t *iline
-			= (const uint8_t*)(yuyv  + r*w );
-		uint8_t *oline = o + r*w*3;
-		for(int c = 0; c < 2*w; c+=4 ) {
-			const int Y0 = iline[c+0];
-			const int U  = iline[c+1];
-			const int Y1 = iline[c+2];
-			const int V  = iline[c+3];
-			YUV2RGB( Y0, U, V, oline + 3*(c/2+0) );
-			YUV2RGB( Y1, U, V, oline + 3*(c/2+1) );
+		row( (const uint8_t*)( yuyv + r*w ), w, o + r*w*3 );
+	}
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+}
+
+
+/**
+  * Returns the regions' total pixels, or -1 if any isn't in the frame.
+  */
+static long _roi_pixels( int w, int h, const struct video_rect *roi, int n ) {
+	long pixels = 0;
+	for(int i = 0; i < n; i++ ) {
+		const struct video_rect *R = roi + i;
+		if( R->w <= 0 || R->h <= 0 || R->x < 0 || R->y < 0
+		 || R->x + R->w > w || R->y + R->h > h )
+			return -1;
+		pixels += (long)R->w*R->h;
+	}
+	return pixels;
+}
+
+
+static void _rgb_span( rgb_row_t row, const uint8_t *iline, int w,
+		int x0, int x1, uint8_t *o ) {
+
+	if( x0 & 1 ) {
+		YUV2RGB( iline[2*x0], iline[2*x0-1], iline[2*x0+1], o );
+		x0++;
+		o += 3;
+	}
+	if( ( x1 - x0 ) & 1 ) {
+		const int L = x1 - 1;
+		row( iline + 2*x0, L - x0, o );
+		YUV2RGB( iline[2*L], iline[2*L+1],
+			L + 1 < w ? iline[2*L+3] : ( L > 0 ? iline[2*L-1] : 128 ),
+			o + 3*( L - x0 ) );
+	} else
+		row( iline + 2*x0, x1 - x0, o );
+}
+
+
+/**
+  * Each region comes out pixel for pixel as the whole-frame conversion
+  * would convert it, so a region starting at the second pixel of a
+  * pair, or ending at the first, takes that pair's chroma from outside
+  * the region. (Gray pixels are independent.)
+  */
+int yuyv2rgb_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride ) {
+
+	const rgb_row_t row = _get_rgb_row();
+	const long PIXELS = _roi_pixels( w, h, roi, n );
+
+	if( PIXELS < 0 )
+		return -1;
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, PIXELS );
+	for(int i = 0; i < n; i++ ) {
+		const struct video_rect *R = roi + i;
+		for(int r = 0; r < R->h; r++ )
+			_rgb_span( row, yuyv + ( R->y + r )*istride, w,
+				R->x, R->x + R->w, o[i] + r*ostride[i] );
+	}
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+	return 0;
+}
+
+
+/**
+  * Regions are converted row by row to RGB exactly as yuyv2rgb_roi does,
+  * into one scratch row, and expanded from there.
+  */
+int yuyv2bgrx_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride ) {
+
+	const rgb_row_t row = _get_rgb_row();
+	const long PIXELS = _roi_pixels( w, h, roi, n );
+	int widest = 0;
+	uint8_t *rgb;
+
+	if( PIXELS < 0 )
+		return -1;
+	for(int i = 0; i < n; i++ )
+		if( widest < roi[i].w )
+			widest = roi[i].w;
+	if( (rgb = malloc( 3*widest + 1 )) == NULL )
+		return -1;
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, PIXELS );
+	for(int i = 0; i < n; i++ ) {
+		const struct video_rect *R = roi + i;
+		for(int r = 0; r < R->h; r++ ) {
+			uint8_t *oline = o[i] + r*ostride[i];
+			_rgb_span( row, yuyv + ( R->y + r )*istride, w,
+				R->x, R->x + R->w, rgb );
+			for(int c = 0; c < R->w; c++ ) {
+				oline[4*c+0] = rgb[3*c+2];
+				oline[4*c+1] = rgb[3*c+1];
+				oline[4*c+2] = rgb[3*c+0];
+				oline[4*c+3] = 0;
+			}
+		}
+	}
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+	free( rgb );
+	return 0;
+}
+
+
+int yuyv2gray_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride ) {
+
+	const gray_row_t row = _get_gray_row();
+	const long PIXELS = _roi_pixels( w, h, roi, n );
+
+	if( PIXELS < 0 )
+		return -1;
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, PIXELS );
+	for(int i = 0; i < n; i++ ) {
+		const struct video_rect *R = roi + i;
+		for(int r = 0; r < R->h; r++ )
+			row( yuyv + ( R->y + r )*istride + 2*R->x, R->w, o[i] + r*ostride[i] );
+	}
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+	return 0;
+}
+
+
+/**
+  * Scaled conversion box-filters scale x scale blocks: each input row is
+  * added (or, first in its block, copied), byte for byte, into a row of
+  * 16-bit sums (a loop the compiler
+  * vectorizes; a block of 8x8 sums to at most 64*255), and once a row of
+  * blocks is complete its sums are reduced to a YUYV row of block means,
+  * which the row converters then convert. That keeps the output 4:2:2
+  * like the input, each output pair's chroma being the mean over both of
+  * its blocks. scale being even, blocks start on pixel pairs; means are
+  * rounded. The input is read once; the full-resolution conversion, if
+  * wanted, is done from each row while it's still in cache.
+  */
+
+static void _accumulate( const uint8_t *iline, int n, bool first, uint16_t *sum ) {
+	if( first )
+		for(int i = 0; i < n; i++ )
+			sum[i] = iline[i];
+	else
+		for(int i = 0; i < n; i++ )
+			sum[i] += iline[i];
+}
+
+
+/**
+  * Reduces the sums of W blocks of 1 << l pixels square to a YUYV row.
+  * Inlined for each scale, so the inner loops unroll.
+  */
+static inline void _reduce( const uint16_t *sum, int W, int l, uint8_t *row ) {
+
+	const int S = 1 << l;
+	int x;
+
+	for(x = 0; x < W; x++ ) {
+		const uint16_t *b = sum + 2*S*x;
+		unsigned Y = 0;
+		for(int i = 0; i < 2*S; i += 2 )
+			Y += b[i];
+		row[2*x] = ( Y + ( S*S/2 ) ) >> 2*l;
+	}
+	for(x = 0; x + 1 < W; x += 2 ) {
+		const uint16_t *b = sum + 2*S*x;
+		unsigned U = 0, V = 0;
+		for(int i = 0; i < 4*S; i += 4 ) {
+			U += b[i+1];
+			V += b[i+3];
+		}
+		row[2*x+1] = ( U + S*S/2 ) >> 2*l;
+		row[2*x+3] = ( V + S*S/2 ) >> 2*l;
+	}
+	if( x < W ) {
+		const uint16_t *b = sum + 2*S*x;
+		unsigned U = 0;
+		for(int i = 0; i < 2*S; i += 4 )
+			U += b[i+1];
+		row[2*x+1] = ( U + S*S/4 ) >> ( 2*l - 1 );
+	}
+}
+
+
+/**
+  * Halving needs no sums: the means come straight from the block's two
+  * rows. With SSE2, 8 blocks at a time: the rows' Y and chroma words are
+  * added, horizontally adjacent Y by pmaddwd and adjacent blocks' U and
+  * V by adding the vector to itself with dwords swapped.
+  */
+static void _reduce2( const uint8_t *a, const uint8_t *b, int W, uint8_t *row ) {
+
+	int x = 0, c;
+
+#ifdef __SSE2__
+	const __m128i LO  = _mm_set1_epi16( 0xFF );
+	const __m128i ONE = _mm_set1_epi16( 1 );
+	const __m128i TWO = _mm_set1_epi16( 2 );
+
+	for(; x + 8 <= W; x += 8 ) {
+
+		__m128i half[2];
+
+		for(int k = 0; k < 2; k++ ) {
+			const __m128i A = _mm_loadu_si128( (const __m128i*)( a + 4*x + 16*k ) );
+			const __m128i B = _mm_loadu_si128( (const __m128i*)( b + 4*x + 16*k ) );
+			const __m128i Y = _mm_madd_epi16( _mm_add_epi16(
+				_mm_and_si128( A, LO ), _mm_and_si128( B, LO ) ), ONE );
+			const __m128i C = _mm_add_epi16( _mm_srli_epi16( A, 8 ), _mm_srli_epi16( B, 8 ) );
+			const __m128i D = _mm_add_epi16( C, _mm_shuffle_epi32( C, _MM_SHUFFLE(2,3,0,1) ) );
+			const __m128i YW = _mm_srli_epi16( _mm_add_epi16( _mm_packs_epi32( Y, Y ), TWO ), 2 );
+			const __m128i CW = _mm_srli_epi16( _mm_add_epi16(
+				_mm_shuffle_epi32( D, _MM_SHUFFLE(2,0,2,0) ), TWO ), 2 );
+			half[k] = _mm_or_si128( YW, _mm_slli_epi16( CW, 8 ) );
 		}
+		_mm_storeu_si128( (__m128i*)( row + 2*x ), _mm_unpacklo_epi64( half[0], half[1] ) );
+	}
+#endif
+	for(c = x; c < W; c++ )
+		row[2*c] = ( a[4*c] + a[4*c+2] + b[4*c] + b[4*c+2] + 2 ) >> 2;
+	for(c = x; c + 1 < W; c += 2 ) {
+		row[2*c+1] = ( a[4*c+1] + a[4*c+5] + b[4*c+1] + b[4*c+5] + 2 ) >> 2;
+		row[2*c+3] = ( a[4*c+3] + a[4*c+7] + b[4*c+3] + b[4*c+7] + 2 ) >> 2;
+	}
+	if( c < W )
+		row[2*c+1] = ( a[4*c+1] + b[4*c+1] + 1 ) >> 1;
+}
+
+
+static int _yuyv_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		bool rgb, uint8_t *o, size_t ostride, uint8_t *full, size_t fstride ) {
+
+	const int W = w / scale, H = h / scale;
+	const int N = 2*W*scale; // bytes of a row's complete blocks
+	const int ROWS = full ? h : H*scale;
+	const rgb_row_t CONVERT = rgb ? _get_rgb_row() : NULL;
+	const gray_row_t FULL = full ? ( rgb ? _get_rgb_row() : _get_gray_row() ) : NULL;
+	uint16_t *sum;
+	uint8_t *row;
+	int l;
+
+	switch( scale ) {
+	case 2: l = 1; break;
+	case 4: l = 2; break;
+	case 8: l = 3; break;
+	default:
+		return -1;
+	}
+	if( (sum = calloc( N + 2*W + 2, sizeof(uint16_t) )) == NULL )
+		return -1;
+	row = (uint8_t*)( sum + N + 1 );
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_BEGIN, w*h );
+
+	for(int r = 0; r < ROWS; r++ ) {
+
+		const uint8_t *iline = yuyv + r*istride;
+		uint8_t *oline;
+
+		if( full )
+			FULL( iline, w, full + r*fstride );
+		if( r >= H*scale )
+			continue;
+		if( l > 1 )
+			_accumulate( iline, N, ( r & ( scale - 1 ) ) == 0, sum );
+		if( ( r & ( scale - 1 ) ) != scale - 1 )
+			continue;
+
+		// The block row is complete.
+
+		switch( l ) {
+		case 1: _reduce2( iline - istride, iline, W, row ); break;
+		case 2: _reduce( sum, W, 2, row ); break;
+		case 3: _reduce( sum, W, 3, row ); break;
+		}
+		oline = o + ( r >> l )*ostride;
+		if( rgb )
+			CONVERT( row, W, oline );
+		else
+			for(int x = 0; x < W; x++ )
+				oline[x] = row[2*x];
+	}
+
+	VIDEO_TRACE( VIDEO_TRACE_CONVERT_END, 0 );
+	free( sum );
+	return 0;
+}
+
+
+int yuyv2rgb_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride ) {
+	return _yuyv_scaled( yuyv, istride, w, h, scale, true, o, ostride, full, fstride );
+}
+
+
+int yuyv2gray_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride ) {
+	return _yuyv_scaled( yuyv, istride, w, h, scale, false, o, ostride, full, fstride );
+}
+
+
+#ifdef UNIT_TEST_YUYV
+
+#include <stdlib.h>
+#include <err.h>
+
+/**
+  * Differential test: every row converter the CPU supports must match
+  * the scalar reference exactly, for random frames of every width up to
+  * a few blocks beyond the widest, and must not write past the frame.
+  * Gray frames are converted between padded rows (as for drivers'
+  * bytesperline), whose padding must survive untouched.
+  */
+
+#define GUARD (64)
+
+static const struct {
+	const char *name;
+	const char *feature;
+	gray_row_t  gray;
+	rgb_row_t   rgb;
+} _rows[] = {
+#ifdef HAVE_X86_SIMD
+	{ "sse2",     "sse2",     _gray_row_sse2,   NULL },
+	{ "avx2",     "avx2",     _gray_row_avx2,   NULL },
+	{ "avx512bw", "avx512bw", _gray_row_avx512, NULL },
+#endif
+#ifdef HAVE_SIMD_CONVERSION
+	{ "sse2",     "sse2",     NULL, _rgb_row_sse2 },
+	{ "avx2",     "avx2",     NULL, _rgb_row_avx2 },
+	{ "avx512bw", "avx512bw", NULL, _rgb_row_avx512 },
 #endif
+	{ "scalar",   NULL,       _gray_row_scalar, _rgb_row_scalar },
+};
+
+static bool _supported( const char *feature ) {
+#ifdef HAVE_X86_SIMD
+	if( strcmp( feature, "sse2" ) == 0 )
+		return __builtin_cpu_supports( "sse2" );
+	if( strcmp( feature, "avx2" ) == 0 )
+		return __builtin_cpu_supports( "avx2" );
+	if( strcmp( feature, "avx512bw" ) == 0 )
+		return __builtin_cpu_supports( "avx512bw" );
+#endif
+	return false;
+}
+
+
+/**
+  * Converts an h-row frame with both the reference and the candidate
+  * row converter; returns non-zero if the outputs differ anywhere.
+  */
+static int _compare( void (*ref)( const uint8_t *, int, uint8_t * ),
+		void (*row)( const uint8_t *, int, uint8_t * ),
+		const uint8_t *in, size_t istride, int w, int h, size_t ostride ) {
+
+	const size_t N = ostride*h + GUARD;
+	uint8_t *a = malloc( N );
+	uint8_t *b = malloc( N );
+	int differ;
+
+	memset( a, 0xA5, N );
+	memset( b, 0xA5, N );
+	for(int r = 0; r < h; r++ ) {
+		ref( in + r*istride, w, a + r*ostride );
+		row( in + r*istride, w, b + r*ostride );
+	}
+	differ = memcmp( a, b, N );
+	free( a );
+	free( b );
+	return differ;
+}
+
+
+/**
+  * Scaled conversion against block means computed the obvious way, and
+  * its full-resolution output against the plain conversion.
+  */
+static int _test_scaled( void ) {
+
+	int failures = 0, tested = 0;
+
+	for(int scale = 2; scale <= 8; scale *= 2 ) {
+		for(int w = 1; w <= 3*scale + 20; w++ ) {
+			for(int h = 1; h <= 2*scale + 1; h++ ) {
+
+				const size_t ISTRIDE = 2*w + ( w % 3 );
+				const int W = w / scale, H = h / scale;
+				const int N = scale*scale;
+				uint8_t *in = malloc( ISTRIDE*h );
+				uint8_t *ref = malloc( 3*W*H + 1 ), *rgb = malloc( 3*W*H + 1 );
+				uint8_t *gref = malloc( W*H + 1 ), *gray = malloc( W*H + 1 );
+				uint8_t *full = malloc( 3*w*h ), *plain = malloc( 3*w*h );
+				uint8_t *fgray = malloc( w*h ), *pgray = malloc( w*h );
+
+				for(int i = 0; i < ISTRIDE*h; i++ )
+					in[i] = random();
+
+				for(int y = 0; y < H; y++ ) {
+
+					// Block means as a YUYV row, chroma over pairs of blocks.
+
+					uint8_t row[ 2*W + 1 ];
+
+					for(int x = 0; x < W; x++ ) {
+						unsigned Y = 0, U = 0, V = 0;
+						const int PAIR = x + 1 < W || x % 2 ? 2 : 1;
+						for(int j = 0; j < scale; j++ ) {
+							const uint8_t *p = in + ( y*scale + j )*ISTRIDE;
+							for(int i = 0; i < scale; i++ )
+								Y += p[ 2*( x*scale + i ) ];
+							for(int i = ( x & ~1 )*scale; i < ( ( x & ~1 ) + PAIR )*scale; i += 2 ) {
+								U += p[ 2*i + 1 ];
+								V += p[ 2*i + 3 ];
+							}
+						}
+						row[ 2*x ] = ( Y + N/2 ) / N;
+						row[ 2*x + 1 ] = x & 1
+							? ( V + N/2 ) / N
+							: ( U + PAIR*N/4 ) / ( PAIR*N/2 );
+						gref[ y*W + x ] = row[ 2*x ];
+					}
+					_rgb_row_scalar( row, W, ref + 3*y*W );
+				}
+				for(int y = 0; y < h; y++ ) {
+					_rgb_row_scalar( in + y*ISTRIDE, w, plain + 3*y*w );
+					_gray_row_scalar( in + y*ISTRIDE, w, pgray + y*w );
+				}
+
+				yuyv2rgb_scaled( in, ISTRIDE, w, h, scale, rgb, 3*W, full, 3*w );
+				yuyv2gray_scaled( in, ISTRIDE, w, h, scale, gray, W, fgray, w );
+
+				if( ( memcmp( ref, rgb, 3*W*H ) || memcmp( gref, gray, W*H )
+				   || memcmp( full, plain, 3*w*h ) || memcmp( fgray, pgray, w*h ) )
+				 && failures++ < 8 )
+					warnx( "1/%d scaled conversion differs at %dx%d", scale, w, h );
+				tested++;
+				free( in );
+				free( ref );
+				free( rgb );
+				free( gref );
+				free( gray );
+				free( full );
+				free( plain );
+				free( fgray );
+				free( pgray );
+			}
+		}
+	}
+	printf( "%-17s %d frames compared\n", "scaled", tested );
+	return failures;
+}
+
+
+/**
+  * Region conversion against crops of the whole-frame conversion, for
+  * regions of every parity of position and width, edges included.
+  */
+static int _test_roi( void ) {
+
+	int failures = 0, tested = 0;
+
+	for(int w = 1; w <= 70; w++ ) {
+		for(int t = 0; t < 20; t++ ) {
+
+			const int H = 5;
+			const size_t ISTRIDE = 2*w + 2*( w % 3 );
+			uint8_t *in = malloc( ISTRIDE*H );
+			uint8_t *rgb = malloc( 3*w*H ), *gray = malloc( w*H );
+			struct video_rect R[2];
+			uint8_t *o[2], *g[2], *x[2];
+			size_t ostride[2], gstride[2], xstride[2];
+
+			for(int i = 0; i < ISTRIDE*H; i++ )
+				in[i] = random();
+			for(int y = 0; y < H; y++ ) {
+				_rgb_row_scalar( in + y*ISTRIDE, w, rgb + 3*y*w );
+				_gray_row_scalar( in + y*ISTRIDE, w, gray + y*w );
+			}
+			for(int k = 0; k < 2; k++ ) {
+				R[k].x = random() % w;
+				R[k].w = 1 + random() % ( w - R[k].x );
+				R[k].y = random() % H;
+				R[k].h = 1 + random() % ( H - R[k].y );
+				ostride[k] = 3*R[k].w + k;
+				gstride[k] = R[k].w + k;
+				xstride[k] = 4*R[k].w + 4*k;
+				o[k] = malloc( ostride[k]*R[k].h );
+				g[k] = malloc( gstride[k]*R[k].h );
+				x[k] = malloc( xstride[k]*R[k].h );
+			}
+			yuyv2rgb_roi( in, ISTRIDE, w, H, R, 2, o, ostride );
+			yuyv2gray_roi( in, ISTRIDE, w, H, R, 2, g, gstride );
+			yuyv2bgrx_roi( in, ISTRIDE, w, H, R, 2, x, xstride );
+
+			for(int k = 0; k < 2; k++ ) {
+				bool bad = false;
+				for(int y = 0; y < R[k].h; y++ ) {
+					bad |= memcmp( o[k] + y*ostride[k],
+						rgb + 3*( ( R[k].y + y )*w + R[k].x ), 3*R[k].w ) != 0;
+					bad |= memcmp( g[k] + y*gstride[k],
+						gray + ( R[k].y + y )*w + R[k].x, R[k].w ) != 0;
+					for(int c = 0; c < R[k].w; c++ ) {
+						const uint8_t *RGB
+							= rgb + 3*( ( R[k].y + y )*w + R[k].x + c );
+						const uint8_t *BGRX
+							= x[k] + y*xstride[k] + 4*c;
+						bad |= BGRX[0] != RGB[2] || BGRX[1] != RGB[1]
+							|| BGRX[2] != RGB[0] || BGRX[3] != 0;
+					}
+				}
+				if( bad && failures++ < 8 )
+					warnx( "region %dx%d+%d+%d of width %d differs",
+						R[k].w, R[k].h, R[k].x, R[k].y, w );
+				free( o[k] );
+				free( g[k] );
+				free( x[k] );
+			}
+			tested++;
+			free( in );
+			free( rgb );
+			free( gray );
+		}
 	}
+	printf( "%-17s %d frames compared\n", "regions", tested );
+	return failures;
 }
 
+
+int main( int argc, char *argv[] ) {
+
+	const int TRIALS = argc > 1 ? atoi( argv[1] ) : 4;
+	const int H = 3;
+	int failures = 0;
+
+	__builtin_cpu_init();
+	srandom( 1 );
+
+	for(int k = 0; k < sizeof(_rows)/sizeof(_rows[0]); k++ ) {
+
+		const char *KIND = _rows[k].gray
+			? ( _rows[k].rgb ? "gray+rgb" : "gray" )
+			: "rgb";
+		int tested = 0;
+
+		if( _rows[k].feature && ! _supported( _rows[k].feature ) ) {
+			printf( "%-8s %-8s unsupported, skipped\n", _rows[k].name, KIND );
+			continue;
+		}
+		for(int w = 1; w <= 200; w++ ) {
+			for(int t = 0; t < TRIALS; t++ ) {
+
+				const size_t ISTRIDE = 2*w + 2*( w % 7 );
+				uint8_t *in = malloc( ISTRIDE*H );
+				int differ = 0;
+
+				for(int i = 0; i < ISTRIDE*H; i++ )
+					in[i] = t == 0 ? ( i & 1 ? ( i & 2 ? 255 : 0 ) : 255 ) : random();
+
+				if( _rows[k].gray )
+					differ |= _compare( _gray_row_scalar, _rows[k].gray,
+						in, ISTRIDE, w, H, w + ( w % 5 ) );
+				if( _rows[k].rgb )
+					differ |= _compare( _rgb_row_scalar, _rows[k].rgb,
+						in, 2*w, w, H, 3*w );
+				if( differ && failures++ < 8 )
+					warnx( "%s %s differs at width %d (trial %d)",
+						_rows[k].name, KIND, w, t );
+				tested++;
+				free( in );
+			}
+		}
+		printf( "%-8s %-8s %d frames compared\n", _rows[k].name, KIND, tested );
+	}
+
+	failures += _test_scaled();
+	failures += _test_roi();
+
+	printf( "%s\n", failures ? "FAILED" : "passed" );
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
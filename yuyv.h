@@ -22,7 +22,43 @@
 #define _yuyv_h_
 
 void yuyv2gray( const uint16_t *yuyv, int w, int h, uint8_t *o );
+void yuyv2gray_stride( const uint8_t *yuyv, size_t istride, int w, int h,
+		uint8_t *o, size_t ostride );
 void yuyv2rgb( const uint16_t *yuyv, int w, int h, uint8_t *o );
 
+/**
+  * Conversion and downscaling in one pass: each scale x scale block
+  * (scale 2, 4 or 8) of the input is averaged into one pixel of a
+  * (w/scale) x (h/scale) output, any partial blocks at the right and
+  * bottom being dropped. If full isn't NULL, the full-resolution
+  * conversion is written there too, from the same read of the input.
+  * Returns -1 for other scales or if out of memory.
+  */
+int yuyv2rgb_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride );
+int yuyv2gray_scaled( const uint8_t *yuyv, size_t istride, int w, int h, int scale,
+		uint8_t *o, size_t ostride, uint8_t *full, size_t fstride );
+
+struct video_rect;
+
+/**
+  * Converts only the n regions roi (see vidfmt.h), region i into o[i]
+  * with rows ostride[i] bytes apart. Each comes out exactly as the same
+  * pixels of the whole frame would. Returns -1 if a region isn't within
+  * the w x h frame.
+  */
+int yuyv2rgb_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+int yuyv2gray_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+
+/**
+  * As yuyv2rgb_roi, but to 32-bit pixels laid out B, G, R, 0 (as for
+  * 24-bit-depth XImages and most framebuffers). Also returns -1 if out
+  * of memory.
+  */
+int yuyv2bgrx_roi( const uint8_t *yuyv, size_t istride, int w, int h,
+		const struct video_rect *roi, int n, uint8_t * const *o, const size_t *ostride );
+
 #endif
 